@@ -36,11 +36,6 @@
 ## $QT_END_LICENSE$
 ##
 
-function qt_env_addto()
-{
-    eval $1="$2\${$1:+:\$$1}"
-}
-
 function qt_select()
 {
     # Get or set the Qt version
@@ -52,54 +47,19 @@ function qt_select()
             echo "Using Qt version: $QT_SELECT"
         fi
     else
-        # Set the working Qt version
-        unset QT_SELECT
-        local QTTOOLDIR
-        test x$1 = xnone || eval $(qtchooser -qt=$1 -print-env) || return $?
+        # Set the working Qt version: qtchooser prints all the changes to
+        # the environment, including removing the previous version's entries
+        local QT_ENV
+        export LD_LIBRARY_PATH PKG_CONFIG_PATH CMAKE_PREFIX_PATH QTLIBDIR QTDIR
+        QT_ENV=$(qtchooser -qt=$1 -print-env=sh) || return $?
+        eval "$QT_ENV"
 
-        # Remove old
-        qt_env_removefrom LD_LIBRARY_PATH $QTLIBDIR
-        qt_env_removefrom PKG_CONFIG_PATH $QTLIBDIR/pkgconfig
-        qt_env_removefrom CMAKE_PREFIX_PATH $QTDIR
-
-        # Add new
         if [ x$1 != xnone ]; then
-            qt_env_addto LD_LIBRARY_PATH $QTLIBDIR
-            qt_env_addto PKG_CONFIG_PATH $QTLIBDIR/pkgconfig
-
             echo "Using Qt version: $1"
-            export LD_LIBRARY_PATH PKG_CONFIG_PATH
-            export QTLIBDIR QT_SELECT
-
-            # try to get the QTDIR from qmake now
-            if QTSRCDIR=$(qmake -query QT_INSTALL_PREFIX/src); then
-                # Recent version of qmake that supports /get and /src
-                QTDIR=$(qmake -query QT_INSTALL_PREFIX/get)
-                export QTSRCDIR
-            else
-                # Older version
-                QTDIR=$(qmake -query QT_INSTALL_PREFIX)
-
-                # is this an uninstalled Qt build dir?
-                if [ -f $QTDIR/Makefile ]; then
-                    QTSRCDIR=$(dirname $(awk '/Project:/{print $NF}' $QTDIR/Makefile))
-                    export QTSRCDIR
-                else
-                    unset QTSRCDIR
-                fi
-            fi
-            export QTDIR
-
-            qt_env_addto CMAKE_PREFIX_PATH $QTDIR
-            export CMAKE_PREFIX_PATH
+        elif qtchooser -print-env >/dev/null 2>&1; then
+            echo "Using default Qt version."
         else
-            unset QTLIBDIR QTSRCDIR QTDIR QT_SELECT
-
-            if qtchooser -print-env >/dev/null 2>&1; then
-                echo "Using default Qt version."
-            else
-                echo "Not using Qt."
-            fi
+            echo "Not using Qt."
         fi
     fi
 }
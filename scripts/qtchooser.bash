@@ -39,23 +39,6 @@
 
 source ${BASH_SOURCE%/*}/common.sh
 
-function qt_env_removefrom()
-{
-    local entry
-    local -a contents
-    local IFS=' '
-    export IFS
-
-    # Split on ':'
-    for entry in `IFS=: eval echo \\\$$1`; do
-        test "$entry" = "$2" || contents=("${contents[@]}" $entry)
-    done
-
-    # Set it again
-    IFS=:
-    eval "$1=\"\${contents[*]}\""
-}
-
 # completion:
 function _qt()
 {
@@ -37,14 +37,6 @@
 ##
 
 
-function _qt_env_removefrom
-    test (count $argv) -eq 2; or return
-    set -l INDEX (eval contains -i -- $argv[2] $$argv[1])
-    if test $INDEX
-        set -e $argv[1][$INDEX]
-    end
-end
-
 function _qt_select
     # Get or set the Qt version
     if test 0 -eq (count $argv)
@@ -54,50 +46,17 @@ function _qt_select
             echo "Using Qt version: $QT_SELECT"
         end
     else
-        # Set the working Qt version
-        set -e QT_SELECT
-        set -l QTTOOLDIR
-        set -l QTCHOOSER_PRINT_ENV qtchooser -qt=$argv[1] -print-env
-        set -l QT_ENV (test x$argv[1] = xnone; or eval $QTCHOOSER_PRINT_ENV)
-
-        # Remove old
-        _qt_env_removefrom LD_LIBRARY_PATH $QTLIBDIR
-        _qt_env_removefrom PKG_CONFIG_PATH $QTLIBDIR/pkgconfig
-        _qt_env_removefrom CMAKE_PREFIX_PATH $QTDIR
+        # Set the working Qt version: qtchooser prints all the changes to
+        # the environment, including removing the previous version's entries
+        set -l QT_ENV (qtchooser -qt=$argv[1] -print-env=fish); or return
+        eval $QT_ENV
 
         if test "x$argv[1]" != "xnone"
-            for QT_ENV_VAR in $QT_ENV
-                eval set -gx (echo $QT_ENV_VAR | sed -e "s,=, ,")
-            end
-
-            # Add new
-            set -gx LD_LIBRARY_PATH $LD_LIBRARY_PATH $QTLIBDIR
-            set -gx PKG_CONFIG_PATH $PKG_CONFIG_PATH $QTLIBDIR/pkgconfig
-
             echo "Using Qt version: $argv[1]"
-
-            # try to get the QTDIR from qmake now
-            set -gx QTDIR (qmake -query QT_INSTALL_PREFIX)
-
-            set -gx CMAKE_PREFIX_PATH $CMAKE_PREFIX_PATH $QTDIR
-
-            # is this an uninstalled Qt build dir?
-            if test -f $QTDIR/Makefile
-                set -gx QTSRCDIR (dirname (awk '/Project:/{print $NF}' $QTDIR/Makefile))
-            else
-                set -e QTSRCDIR
-            end
+        else if qtchooser -print-env >/dev/null 2>&1
+            echo "Using default Qt version."
         else
-            set -e QTLIBDIR
-            set -e QTSRCDIR
-            set -e QTDIR
-            set -e QT_SELECT
-
-            if qtchooser -print-env >/dev/null 2>&1
-                echo "Using default Qt version."
-            else
-                echo "Not using Qt."
-            end
+            echo "Not using Qt."
         end
     end
 end
@@ -0,0 +1,494 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Intel Corporation.
+** Contact: http://www.qt-project.org/legal
+**
+** This file is part of the Qt tool chooser of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and Digia.  For licensing terms and
+** conditions see http://qt.digia.com/licensing.  For further information
+** use the contact form at http://qt.digia.com/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** In addition, as a special exception, Digia gives you certain additional
+** rights.  These rights are described in the Digia Qt LGPL Exception
+** version 1.1, included in the file LGPL_EXCEPTION.txt in this package.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+/*
+ * Measures what the qtchooser wrapper costs per exec. It creates a synthetic
+ * tree of config files in a temporary directory and runs the wrapper in each
+ * of its modes, comparing against exec'ing the target tool directly. The
+ * results are written as JSON.
+ *
+ * The "ld-path" modes run with a long LD_LIBRARY_PATH of empty directories
+ * in front of the libraries the tool needs, which are copied into the SDK's
+ * lib dir, to compare tool startup with and without QTCHOOSER_LIBPATH.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#  include <elf.h>
+#  include <link.h>
+#  include <sys/ptrace.h>
+#endif
+
+using namespace std;
+
+struct Mode
+{
+    const char *name;
+    bool direct;                // exec the tool directly instead of the wrapper
+    bool runsTool;              // also measured for the extra wrapper binaries
+    const char *arguments[4];
+    const char *extraEnvironment;
+    bool longLibraryPath;       // run with the long LD_LIBRARY_PATH
+};
+
+static const Mode modes[] = {
+    { "baseline", true, false, { 0 }, 0, false },
+    { "list-versions", false, false, { "-list-versions", 0 }, 0, false },
+    { "print-env", false, false, { "-print-env", 0 }, 0, false },
+    { "run-tool", false, true, { "-run-tool=moc", 0 }, 0, false },
+    { "run-tool-nocache", false, true, { "-run-tool=moc", 0 }, "QTCHOOSER_NO_CACHE=1", false },
+    { "run-tool-fallback", false, true, { "-run-tool=qtdiag", 0 }, 0, false },
+    { "baseline-ld-path", true, false, { 0 }, 0, true },
+    { "run-tool-ld-path", false, false, { "-run-tool=moc", 0 }, 0, true },
+    { "run-tool-libpath-env", false, false, { "-run-tool=moc", 0 }, "QTCHOOSER_LIBPATH=env", true },
+    { "run-tool-libpath-ldso", false, false, { "-run-tool=moc", 0 }, "QTCHOOSER_LIBPATH=ldso", true },
+};
+
+struct Result
+{
+    string binary;
+    const char *mode;
+    int configCount;
+    vector<double> wallTimes;   // in microseconds
+    double minorFaults;
+    double majorFaults;
+    long syscalls;
+};
+
+static void die(const char *what, const string &path = string())
+{
+    fprintf(stderr, "qtchooser-bench: %s%s%s: %s\n", what, path.empty() ? "" : " ",
+            path.c_str(), strerror(errno));
+    exit(1);
+}
+
+static void writeFile(const string &path, const string &contents, mode_t mode = 0644)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd == -1 || ::write(fd, contents.data(), contents.size()) != ssize_t(contents.size()))
+        die("could not write", path);
+    ::close(fd);
+}
+
+static void copyFile(const string &from, const string &to)
+{
+    int in = ::open(from.c_str(), O_RDONLY);
+    if (in == -1)
+        die("could not open", from);
+    int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (out == -1)
+        die("could not create", to);
+
+    char buf[65536];
+    ssize_t n;
+    while ((n = ::read(in, buf, sizeof buf)) > 0) {
+        if (::write(out, buf, n) != n)
+            die("could not write", to);
+    }
+    ::close(in);
+    ::close(out);
+}
+
+static void makeDir(const string &path)
+{
+    if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST)
+        die("could not create", path);
+}
+
+static void removeTree(const string &path)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("rm", "rm", "-rf", path.c_str(), (char *)0);
+        _exit(127);
+    }
+    waitpid(pid, 0, 0);
+}
+
+#ifdef __linux__
+struct LoadedObjects
+{
+    string interpreter;         // the main program's PT_INTERP
+    vector<string> libraries;
+};
+
+static int collectLibrary(struct dl_phdr_info *info, size_t, void *data)
+{
+    LoadedObjects *objects = static_cast<LoadedObjects *>(data);
+    if (!*info->dlpi_name) {
+        // the main program, which comes first
+        for (int i = 0; i < info->dlpi_phnum; ++i) {
+            if (info->dlpi_phdr[i].p_type == PT_INTERP)
+                objects->interpreter = reinterpret_cast<const char *>(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+        }
+    } else if (*info->dlpi_name == '/' && objects->interpreter != info->dlpi_name) {
+        objects->libraries.push_back(info->dlpi_name);
+    }
+    return 0;
+}
+#endif
+
+// Copies the libraries that the tool probably needs into dir: the ones
+// loaded here except the dynamic loader, of which the trivial tools we run
+// need a subset
+static void copyLibraries(const string &dir)
+{
+#ifdef __linux__
+    LoadedObjects objects;
+    dl_iterate_phdr(collectLibrary, &objects);
+    for (size_t i = 0; i < objects.libraries.size(); ++i) {
+        const string &library = objects.libraries[i];
+        copyFile(library, dir + library.substr(library.rfind('/')));
+    }
+#else
+    (void)dir;
+#endif
+}
+
+// Creates <root>/config/qtchooser with configCount dummy SDKs plus:
+//  default.conf   -> <root>/qt-default/bin, which has "moc", and lib, which
+//                    has copies of the libraries it needs
+//  fallback.conf  -> <root>/qt-fallback/bin, which has "qtdiag"
+// and libraryPathDirs empty directories for the long LD_LIBRARY_PATH.
+// The tools are copies of a trivial executable so that exec'ing them
+// measures process startup and not the tool itself.
+static void createTree(const string &root, int configCount, const string &tool, int libraryPathDirs)
+{
+    makeDir(root);
+    makeDir(root + "/config");
+    makeDir(root + "/config/qtchooser");
+    makeDir(root + "/cache");
+    makeDir(root + "/qt-default");
+    makeDir(root + "/qt-default/bin");
+    makeDir(root + "/qt-default/lib");
+    copyLibraries(root + "/qt-default/lib");
+    makeDir(root + "/ld-path");
+    for (int i = 0; i < libraryPathDirs; ++i) {
+        char name[32];
+        snprintf(name, sizeof name, "/ld-path/%d", i);
+        makeDir(root + name);
+    }
+    makeDir(root + "/qt-fallback");
+    makeDir(root + "/qt-fallback/bin");
+    copyFile(tool, root + "/qt-default/bin/moc");
+    copyFile(tool, root + "/qt-fallback/bin/qtdiag");
+
+    const string dir = root + "/config/qtchooser/";
+    writeFile(dir + "default.conf", root + "/qt-default/bin\n" + root + "/qt-default/lib\n");
+    writeFile(dir + "fallback.conf", root + "/qt-fallback/bin\n" + root + "/qt-fallback/lib\n");
+    for (int i = 0; i < configCount; ++i) {
+        char name[32];
+        snprintf(name, sizeof name, "sdk%05d", i);
+        writeFile(dir + name + ".conf", root + "/" + name + "/bin\n" + root + "/" + name + "/lib\n");
+    }
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static pid_t spawn(const string &program, const Mode &mode, const vector<string> &env, bool traced)
+{
+    vector<char *> argv;
+    argv.push_back(const_cast<char *>(program.c_str()));
+    for (int i = 0; !mode.direct && mode.arguments[i]; ++i)
+        argv.push_back(const_cast<char *>(mode.arguments[i]));
+    argv.push_back(0);
+
+    vector<char *> envp;
+    for (size_t i = 0; i < env.size(); ++i)
+        envp.push_back(const_cast<char *>(env[i].c_str()));
+    if (mode.extraEnvironment)
+        envp.push_back(const_cast<char *>(mode.extraEnvironment));
+    envp.push_back(0);
+
+    pid_t pid = fork();
+    if (pid == -1)
+        die("fork");
+    if (pid == 0) {
+        int devnull = ::open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+#ifdef __linux__
+        if (traced)
+            ptrace(PTRACE_TRACEME, 0, 0, 0);
+#else
+        (void)traced;
+#endif
+        execve(argv[0], &argv[0], &envp[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+#ifdef __linux__
+// Counts the system calls made by the child and by whatever it execs,
+// using a ptrace loop. This is slow, so it's done in a separate pass.
+static long countSyscalls(const string &program, const Mode &mode, const vector<string> &env)
+{
+    pid_t pid = spawn(program, mode, env, true);
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status))
+        return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC);
+
+    long stops = 0;
+    while (true) {
+        if (ptrace(PTRACE_SYSCALL, pid, 0, 0) == -1)
+            return -1;
+        if (waitpid(pid, &status, 0) == -1)
+            return -1;
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            break;
+        if (WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80))
+            ++stops;
+    }
+
+    // each system call stops on entry and on exit, except exit_group, which
+    // never returns
+    return (stops + 1) / 2;
+}
+#endif
+
+static Result measure(const string &program, const Mode &mode, const vector<string> &env,
+                      int configCount, int iterations)
+{
+    Result result;
+    result.binary = mode.direct ? "-" : program.substr(program.rfind('/') + 1);
+    result.mode = mode.name;
+    result.configCount = configCount;
+    result.minorFaults = result.majorFaults = 0;
+    result.syscalls = -1;
+
+    // warm up: populates the page cache and the resolution cache
+    for (int i = 0; i < 3; ++i)
+        waitpid(spawn(program, mode, env, false), 0, 0);
+
+    for (int i = 0; i < iterations; ++i) {
+        int status;
+        struct rusage ru;
+        double start = now();
+        pid_t pid = spawn(program, mode, env, false);
+        if (wait4(pid, &status, 0, &ru) == -1)
+            die("wait4");
+        result.wallTimes.push_back(now() - start);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "qtchooser-bench: mode %s failed with status 0x%x\n", mode.name, status);
+            exit(1);
+        }
+        result.minorFaults += ru.ru_minflt;
+        result.majorFaults += ru.ru_majflt;
+    }
+    result.minorFaults /= iterations;
+    result.majorFaults /= iterations;
+    sort(result.wallTimes.begin(), result.wallTimes.end());
+
+#ifdef __linux__
+    result.syscalls = countSyscalls(program, mode, env);
+#endif
+    return result;
+}
+
+static double median(const vector<double> &sorted)
+{
+    return sorted[sorted.size() / 2];
+}
+
+static double mean(const vector<double> &values)
+{
+    double sum = 0;
+    for (size_t i = 0; i < values.size(); ++i)
+        sum += values[i];
+    return sum / values.size();
+}
+
+static void printJson(FILE *f, const vector<Result> &results, int iterations)
+{
+    fprintf(f, "{\n  \"iterations\": %d,\n  \"results\": [\n", iterations);
+    double baseline = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        if (strcmp(r.mode, "baseline") == 0)
+            baseline = median(r.wallTimes);
+        fprintf(f, "    { \"binary\": \"%s\", \"mode\": \"%s\", \"configs\": %d, "
+                "\"wall_us\": { \"min\": %.1f, \"median\": %.1f, \"mean\": %.1f }, "
+                "\"overhead_us\": %.1f, \"minor_faults\": %.1f, \"major_faults\": %.1f, "
+                "\"syscalls\": %ld }%s\n",
+                r.binary.c_str(), r.mode, r.configCount, r.wallTimes.front(), median(r.wallTimes), mean(r.wallTimes),
+                median(r.wallTimes) - baseline, r.minorFaults, r.majorFaults, r.syscalls,
+                i + 1 == results.size() ? "" : ",");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+static void printTable(const vector<Result> &results)
+{
+    fprintf(stderr, "%-18s %-22s %8s %12s %12s %10s %10s\n",
+            "binary", "mode", "configs", "median(us)", "min(us)", "minflt", "syscalls");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        fprintf(stderr, "%-18s %-22s %8d %12.1f %12.1f %10.1f %10ld\n", r.binary.c_str(), r.mode, r.configCount,
+                median(r.wallTimes), r.wallTimes.front(), r.minorFaults, r.syscalls);
+    }
+}
+
+static int usage()
+{
+    fprintf(stderr, "Usage: qtchooser-bench [-n <iterations>] [-configs <count>]... [-tool <executable>]\n"
+                    "                       [-ld-path-dirs <count>] [-o <results.json>]\n"
+                    "                       <path-to-qtchooser> [<other wrapper>...]\n"
+                    "Only the modes that run a tool are measured for the other wrappers.\n");
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 200;
+    vector<int> configCounts;
+    const char *output = 0;
+    const char *tool = "/bin/true";
+    int libraryPathDirs = 32;
+    vector<string> programs;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-n") == 0 && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else if (strcmp(arg, "-configs") == 0 && i + 1 < argc)
+            configCounts.push_back(atoi(argv[++i]));
+        else if (strcmp(arg, "-tool") == 0 && i + 1 < argc)
+            tool = argv[++i];
+        else if (strcmp(arg, "-ld-path-dirs") == 0 && i + 1 < argc)
+            libraryPathDirs = atoi(argv[++i]);
+        else if (strcmp(arg, "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (*arg != '-')
+            programs.push_back(arg);
+        else
+            return usage();
+    }
+    if (programs.empty() || iterations <= 0)
+        return usage();
+    if (configCounts.empty()) {
+        configCounts.push_back(10);
+        configCounts.push_back(1000);
+    }
+
+    char *cwd = getcwd(0, 0);
+    for (size_t i = 0; i < programs.size(); ++i) {
+        if (programs[i][0] != '/')
+            programs[i] = string(cwd) + '/' + programs[i];
+    }
+    free(cwd);
+
+    char rootTemplate[] = "/tmp/qtchooser-bench.XXXXXX";
+    if (!mkdtemp(rootTemplate))
+        die("could not create temporary directory");
+    const string base = rootTemplate;
+
+    vector<Result> results;
+    for (size_t c = 0; c < configCounts.size(); ++c) {
+        char name[32];
+        snprintf(name, sizeof name, "/tree%d", configCounts[c]);
+        const string root = base + name;
+        createTree(root, configCounts[c], tool, libraryPathDirs);
+
+        vector<string> env;
+        env.push_back("HOME=" + root);
+        env.push_back("XDG_CONFIG_HOME=" + root + "/no-such-dir");
+        env.push_back("XDG_CONFIG_DIRS=" + root + "/config");
+        env.push_back("XDG_CACHE_HOME=" + root + "/cache");
+        env.push_back("QTCHOOSER_NO_GLOBAL_DIR=1");
+
+        vector<string> longLibraryPathEnv = env;
+        string libraryPath = "LD_LIBRARY_PATH=";
+        for (int i = 0; i < libraryPathDirs; ++i) {
+            char name[32];
+            snprintf(name, sizeof name, "/ld-path/%d", i);
+            if (i)
+                libraryPath += ':';
+            libraryPath += root + name;
+        }
+        longLibraryPathEnv.push_back(libraryPath);
+
+        for (size_t p = 0; p < programs.size(); ++p) {
+            for (size_t m = 0; m < sizeof modes / sizeof modes[0]; ++m) {
+                const Mode &mode = modes[m];
+                if (p > 0 && !mode.runsTool)
+                    continue;
+                string target = mode.direct ? root + "/qt-default/bin/moc" : programs[p];
+                results.push_back(measure(target, mode, mode.longLibraryPath ? longLibraryPathEnv : env,
+                                          configCounts[c], iterations));
+            }
+        }
+    }
+    removeTree(base);
+
+    printTable(results);
+    FILE *f = output ? fopen(output, "w") : stdout;
+    if (!f)
+        die("could not open", output);
+    printJson(f, results, iterations);
+    if (output)
+        fclose(f);
+    return 0;
+}
@@ -47,52 +47,51 @@
  * opendir(3) and readdir(3) as well as paths exclusively separated by slashes.
  */
 
-#define _CRT_SECURE_NO_WARNINGS
-#define _POSIX_C_SOURCE 200809L
-
-#include <algorithm>
-#include <set>
-#include <string>
-#include <vector>
-
-#include <assert.h>
-#include <errno.h>
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <limits.h>
-
-#if defined(_WIN32) || defined(__WIN32__)
-#  include <process.h>
-#  define execv _execv
-#  define stat _stat
-#  define PATH_SEP "\\"
-#  define EXE_SUFFIX ".exe"
-#else
-#  include <sys/types.h>
-#  include <sys/stat.h>
-#  include <dirent.h>
-#  include <fcntl.h>
-#  include <libgen.h>
-#  include <pwd.h>
-#  include <unistd.h>
-#  define PATH_SEP "/"
-#  define EXE_SUFFIX ""
-#endif
+#include "qtchooser_p.h"
 
-using namespace std;
+using namespace QtChooser;
+
+#if !defined(_WIN32) && !defined(__WIN32__)
+extern char **environ;
+#endif
 
 static const char myName[] = "qtchooser" EXE_SUFFIX;
-static const char confSuffix[] = ".conf";
+
+// The tools that get symlinked to qtchooser on installation: keep in sync
+// with TOOLS and MACTOOLS in the top-level Makefile.
+static const char *const knownTools[] = {
+    "assistant", "designer", "lconvert", "linguist", "lrelease", "lupdate",
+    "moc", "pixeltool", "qcollectiongenerator", "qdbus", "qdbuscpp2xml",
+    "qdbusviewer", "qdbusxml2cpp", "qdoc", "qdoc3", "qhelpconverter",
+    "qhelpgenerator", "qlalr", "qmake", "qml", "qml1plugindump", "qmlbundle",
+    "qmleasing", "qmlimportscanner", "qmllint", "qmlmin", "qmlplugindump",
+    "qmlprofiler", "qmlscene", "qmltestrunner", "qmlviewer", "qtconfig",
+    "qtdiag", "qtpaths", "qtplugininfo", "rcc", "uic", "uic3", "xmlpatterns",
+    "xmlpatternsvalidator",
+#ifdef __APPLE__
+    "macdeployqt",
+#endif
+    0
+};
 
 static const char *argv0;
+static double traceStart;
 enum Mode {
     Unknown,
     PrintHelp,
     RunTool,
     ListVersions,
     PrintEnvironment,
-    Install
+    Install,
+    ResolveBatch,
+    Materialize,
+    Stats,
+    Compile,
+    Scan,
+    ExecBatch,
+    OutputCacheStats,
+    Export,
+    Import
 };
 
 enum InstallOptions
@@ -101,76 +100,180 @@ enum InstallOptions
     LocalInstall     = 1,
 
     NoOverwrite      = 0,
-    ForceOverwrite   = 2
+    ForceOverwrite   = 2,
+
+    SyncEachFile     = 0,
+    DeferSync        = 4        // the caller syncs the directory with syncDir()
 };
 
-struct Sdk
+// Records the event covering the whole run and writes out the trace; called
+// just before exec'ing the tool, or at exit.
+static void traceFinish()
 {
-    string name;
-    string configFile;
-    string toolsPath;
-    string librariesPath;
+    if (!traceFile)
+        return;
+    traceEvent(argv0, 'X', traceStart, traceTimestamp(), 0);
+    traceFlush();
+    traceFile = 0;
+}
 
-    bool isValid() const { return !toolsPath.empty(); }
-    bool hasTool(const string &targetTool) const;
+// Invocation statistics, enabled by setting QTCHOOSER_STATS to a file name.
+// Each tool run appends one fixed-size record with a single O_APPEND write,
+// so concurrent jobs need no locking; "qtchooser -stats" aggregates them.
+// Records are in host byte order.
+enum StatsFlags {
+    StatsFallback = 0x1,    // the fallback search over all SDKs ran
+    StatsCacheHit = 0x2,    // resolved from the resolution cache
+    StatsFailed   = 0x4     // no SDK was found
 };
 
-bool Sdk::hasTool(const string &targetTool) const
+struct StatsRecord
 {
-    struct stat st;
-    if (toolsPath.empty())
-        return false;
-    if (stat((toolsPath + PATH_SEP + targetTool).c_str(), &st))
-        return false;
-#ifdef S_IEXEC
-    return (st.st_mode & S_IEXEC);
-#endif
-    return true;
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    int64_t timestamp;      // microseconds since the Epoch
+    uint32_t resolveTime;   // microseconds
+    uint32_t reserved;
+    char tool[48];          // NUL-padded, truncated if longer
+    char sdk[48];
+};
+static const uint32_t statsMagic = 0x53435451;  // "QTCS"
+static const char *statsFile;
+
+static void logStats(double start, int flags, const char *tool, const char *sdk)
+{
+    if (!statsFile)
+        return;
+
+    StatsRecord record;
+    memset(&record, 0, sizeof record);
+    record.magic = statsMagic;
+    record.version = 1;
+    record.flags = flags;
+    record.resolveTime = uint32_t(traceTimestamp() - start);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record.timestamp = int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    strncpy(record.tool, tool, sizeof record.tool - 1);
+    strncpy(record.sdk, *sdk ? sdk : "default", sizeof record.sdk - 1);
+
+    int fd = ::open(statsFile, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (fd == -1)
+        return;
+    if (::write(fd, &record, sizeof record) != sizeof record)
+        fprintf(stderr, "%s: error writing to stats file '%s': %s\n", argv0, statsFile, strerror(errno));
+    ::close(fd);
 }
 
-struct ToolWrapper
+// Logs a successful resolution under the name of the config file that was used
+static void logStats(double start, int flags, const char *tool, const char *configFile,
+                     size_t configFileLength)
+{
+    if (!statsFile)
+        return;
+
+    const char *name = configFile;
+    for (const char *p = configFile; p < configFile + configFileLength; ++p) {
+        if (*p == '/')
+            name = p + 1;
+    }
+    size_t length = configFile + configFileLength - name;
+    length = length < sizeof confSuffix - 1 ? 0 : length - (sizeof confSuffix - 1);
+    char sdk[sizeof ((StatsRecord *)0)->sdk];
+    snprintf(sdk, sizeof sdk, "%.*s", int(length), name);
+    logStats(start, flags, tool, sdk);
+}
+
+struct ToolWrapper : Resolver
 {
     int printHelp();
     int listVersions();
-    int printEnvironment(const string &targetSdk);
+    int listVersionsVerbose(bool json);
+    int printEnvironment(const string &targetSdk, const string &shell = string());
+    int runTool(const char *targetSdk, const char *targetTool, char **argv);
     int runTool(const string &targetSdk, const string &targetTool, char **argv);
     int install(const string &sdkName, const string &qmake, int installOptions);
+    int scan(const vector<string> &roots, int installOptions);
+    int exportManifest(const string &fileName);
+    int importManifest(const string &fileName, int installOptions);
+    int resolveBatch();
+    int materialize(const string &sdkName, const string &targetDir);
+    int printStats(const string &fileName, bool prometheus);
+    int execBatch(const string &targetSdk, const string &jobFile, long jobCount);
+    int compile(const string &dir);
 
 private:
-    vector<string> searchPaths() const;
+    int execTool(const char *targetTool, char *tool, const char *configFile, const char *librariesPath,
+                 const char *libraryPathSetting, char **argv);
+
+    // same as Resolver::selectSdk, but reports a failure on stderr
+    Sdk selectSdk(const string &targetSdk, const string &targetTool = "", bool *usedFallback = 0);
+    int printShellEnvironment(const string &targetSdk, const string &shell);
+    bool writeSdk(const string &sdkName, const string &fileContents, int installOptions,
+                  string *sdkFullPath) const;
+    bool registerSdk(const string &sdkName, const string &toolsPath, const string &fileContents,
+                     int installOptions, string *sdkFullPath);
+};
 
-    typedef bool (*VisitFunction)(const string &targetSdk, Sdk &item);
-    typedef void (*FinishFunction)(const set<string> &seenSdks);
-    Sdk iterateSdks(const string &targetSdk, VisitFunction visit, FinishFunction finish = 0,
-                    const string &targetTool = "");
-    Sdk selectSdk(const string &targetSdk, const string &targetTool = "");
+static void reportMissingSdk(const string &targetSdk, const Sdk &sdk)
+{
+    if (sdk.state == Unreadable)
+        fprintf(stderr, "%s: could not open config file '%s': %s\n",
+                argv0, sdk.configFile.c_str(), strerror(sdk.error));
+    else
+        fprintf(stderr, "%s: could not find a Qt installation of '%s'\n", argv0, targetSdk.c_str());
+}
 
-    static void printSdks(const set<string> &seenNames);
-    static bool matchSdk(const string &targetSdk, Sdk &sdk);
-};
+Sdk ToolWrapper::selectSdk(const string &targetSdk, const string &targetTool, bool *usedFallback)
+{
+    Sdk sdk = Resolver::selectSdk(targetSdk, targetTool, usedFallback);
+    if (!sdk.isValid())
+        reportMissingSdk(targetSdk, sdk);
+    return sdk;
+}
 
 int ToolWrapper::printHelp()
 {
     puts("Usage:\n"
          "  qtchooser { -l | -list-versions | -print-env }\n"
+         "  qtchooser -list-versions -verbose [-json]\n"
+         "  qtchooser -print-env={sh|bash|zsh|fish} [-qt=<Qt version or none>]\n"
          "  qtchooser -install [-f] [-local] <name> <path-to-qmake>\n"
+         "  qtchooser -scan [-f] [-local] <directory>...\n"
+         "  qtchooser -export [<manifest file>]\n"
+         "  qtchooser -import [-f] [-local] <manifest file or ->\n"
+         "  qtchooser -compile <config directory>\n"
+         "  qtchooser -materialize <name> <directory>\n"
+         "  qtchooser -stats [-prometheus] [<stats file>]\n"
+         "  qtchooser -resolve-batch < <lines of \"<Qt version or -> <tool name>\">\n"
+         "  qtchooser [-qt=<Qt version>] -exec-batch <job file or -> [-j <jobs>]\n"
+         "  qtchooser -output-cache-stats\n"
          "  qtchooser -run-tool=<tool name> [-qt=<Qt version>] [program arguments]\n"
          "  <executable name> [-qt=<Qt version>] [program arguments]\n"
          "\n"
+         "A <Qt version> that is not the name of a configuration may select the newest\n"
+         "one by version: latest, a prefix like 5.12, or a range like >=5.12 or <6.\n"
+         "\n"
          "Environment variables accepted:\n"
-         " QTCHOOSER_RUNTOOL  name of the tool to be run (same as the -run-tool argument)\n"
-         " QT_SELECT          version of Qt to be run (same as the -qt argument)\n");
+         " QTCHOOSER_RUNTOOL           name of the tool to be run (same as -run-tool)\n"
+         " QTCHOOSER_LIBPATH           env or ldso: run tools with the Qt libraries\n"
+         "                             first in the dynamic loader's search path\n"
+         " QTCHOOSER_NO_CACHE          disable the cache of tool resolutions\n"
+         " QTCHOOSER_OUTPUT_CACHE      cache the outputs of moc, uic and rcc in this\n"
+         "                             directory, or in a default one if not absolute\n"
+         " QTCHOOSER_OUTPUT_CACHE_SIZE size limit of the output cache (default 1G)\n"
+         " QTCHOOSER_STATS             append a record of each tool run to this file\n"
+         " QTCHOOSER_TRACE             append a trace of the lookup phases to this file\n"
+         " QT_SELECT                   version of Qt to be run (same as the -qt argument)\n");
     return 0;
 }
 
-int ToolWrapper::listVersions()
+int ToolWrapper::printEnvironment(const string &targetSdk, const string &shell)
 {
-    iterateSdks(string(), 0, &ToolWrapper::printSdks);
-    return 0;
-}
+    if (!shell.empty())
+        return printShellEnvironment(targetSdk, shell);
 
-int ToolWrapper::printEnvironment(const string &targetSdk)
-{
     Sdk sdk = selectSdk(targetSdk);
     if (!sdk.isValid())
         return 1;
@@ -186,24 +289,6 @@ int ToolWrapper::printEnvironment(const string &targetSdk)
     return 0;
 }
 
-static string userHome()
-{
-    const char *value = getenv("HOME");
-    if (value)
-        return value;
-
-#if defined(_WIN32) || defined(__WIN32__)
-    // ### FIXME: some Windows-specific code to get the user's home directory
-    // using GetUserProfileDirectory (userenv.h / dll)
-    return "C:";
-#else
-    struct passwd *pwd = getpwuid(getuid());
-    if (pwd && pwd->pw_dir)
-        return pwd->pw_dir;
-    return string();
-#endif
-}
-
 static inline bool beginsWith(const char *haystack, const char *needle)
 {
     return strncmp(haystack, needle, strlen(needle)) == 0;
@@ -222,6 +307,7 @@ bool linksBackToSelf(const char *link, const char *target)
 {
 #if !defined(_WIN32) && !defined(__WIN32__)
     char buf[512];
+    TraceScope trace("readlink", link);
     int count = readlink(link, buf, sizeof(buf) - 1);
     if (count >= 0) {
         buf[count] = '\0';
@@ -231,372 +317,2006 @@ bool linksBackToSelf(const char *link, const char *target)
             return true;
         }
     }
-#endif
-    return false;
+#endif
+    return false;
+}
+
+// Expands a leading "~" in place. Returns false if the result doesn't fit.
+static bool expandHome(FixedPath *path)
+{
+    if (path->data[0] != '~')
+        return true;
+    char buf[4096];
+    FixedPath expanded;
+    expanded.append(userHome(buf, sizeof buf)).append(path->data + 1);
+    *path = expanded;
+    return !path->overflow;
+}
+
+// How a tool is pointed at its SDK's librariesPath, so that tools built
+// without an RPATH find the right Qt libraries without the dynamic loader
+// searching LD_LIBRARY_PATH and the default directories first. It is the
+// value of QTCHOOSER_LIBPATH, or else of the libpath= key of the config file:
+//   env    librariesPath is prepended to LD_LIBRARY_PATH, which the tool's
+//          children inherit too
+//   ldso   the tool is run by its dynamic loader with --library-path, which
+//          applies to the tool only
+// Anything else leaves the environment alone.
+enum LibraryPathMode { LibraryPathOff, LibraryPathEnvironment, LibraryPathLoader };
+
+static LibraryPathMode libraryPathMode(const char *sdkSetting)
+{
+    const char *mode = getenv("QTCHOOSER_LIBPATH");
+    if (!mode || !*mode)
+        mode = sdkSetting;
+    if (strcmp(mode, "env") == 0)
+        return LibraryPathEnvironment;
+    if (strcmp(mode, "ldso") == 0)
+        return LibraryPathLoader;
+    return LibraryPathOff;
+}
+
+// Reads the program interpreter, which is the dynamic loader, that an ELF
+// executable of our own class asks for. Returns false for anything else:
+// scripts, static executables and foreign binaries.
+static bool readInterpreter(const char *path, char *interpreter, size_t size)
+{
+#if defined(__linux__)
+#  if __SIZEOF_POINTER__ == 8
+    typedef Elf64_Ehdr ElfHeader;
+    typedef Elf64_Phdr ProgramHeader;
+    const unsigned char elfClass = ELFCLASS64;
+#  else
+    typedef Elf32_Ehdr ElfHeader;
+    typedef Elf32_Phdr ProgramHeader;
+    const unsigned char elfClass = ELFCLASS32;
+#  endif
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    TraceScope trace("readInterpreter", path);
+    ElfHeader header;
+    bool found = false;
+    if (pread(fd, &header, sizeof header, 0) == ssize_t(sizeof header)
+            && memcmp(header.e_ident, ELFMAG, SELFMAG) == 0 && header.e_ident[EI_CLASS] == elfClass
+            && header.e_phentsize == sizeof(ProgramHeader)) {
+        for (unsigned i = 0; i < header.e_phnum; ++i) {
+            ProgramHeader ph;
+            if (pread(fd, &ph, sizeof ph, header.e_phoff + i * sizeof ph) != ssize_t(sizeof ph))
+                break;
+            if (ph.p_type != PT_INTERP)
+                continue;
+            if (ph.p_filesz < size && pread(fd, interpreter, ph.p_filesz, ph.p_offset) == ssize_t(ph.p_filesz)) {
+                interpreter[ph.p_filesz] = '\0';
+                found = *interpreter == '/';
+            }
+            break;
+        }
+    }
+    ::close(fd);
+    return found;
+#else
+    (void)path;
+    (void)interpreter;
+    (void)size;
+    return false;
+#endif
+}
+
+// Runs the tool without allocating any memory when the caches can answer,
+// which is what almost every run of a build does
+int ToolWrapper::runTool(const char *targetSdk, const char *targetTool, char **argv)
+{
+    const double start = statsFile ? traceTimestamp() : 0;
+    FixedPath pinnedSdk;
+    if (!*targetSdk) {
+        // a project's .qtchooser applies if no version was selected
+        if (!cachedProjectSdk(&pinnedSdk))
+            return runTool(projectSdk(), string(targetTool), argv);
+        targetSdk = pinnedSdk.c_str();
+    }
+
+    CachedTool cached;
+    if (!lookupCachedTool(targetSdk, targetTool, &cached) || !expandHome(&cached.tool)
+            || !expandHome(&cached.librariesPath))
+        return runTool(string(targetSdk), string(targetTool), argv);
+    logStats(start, StatsCacheHit, targetTool, cached.configFile.c_str(), cached.configFile.length);
+    return execTool(targetTool, cached.tool.data, cached.configFile.c_str(), cached.librariesPath.c_str(),
+                    cached.libraryPathMode.c_str(), argv);
+}
+
+int ToolWrapper::runTool(const string &targetSdk, const string &targetTool, char **argv)
+{
+    const double start = statsFile ? traceTimestamp() : 0;
+    Resolution resolution;
+    const bool found = resolve(targetSdk, targetTool, &resolution);
+    const int statsFlags = (resolution.cacheHit ? StatsCacheHit : 0)
+            | (resolution.usedFallback ? StatsFallback : 0);
+    if (!found) {
+        reportMissingSdk(targetSdk, resolution.sdk);
+        logStats(start, statsFlags | StatsFailed, targetTool.c_str(), targetSdk.c_str());
+        return 1;
+    }
+
+    logStats(start, statsFlags, targetTool.c_str(), resolution.configFile.c_str(),
+             resolution.configFile.size());
+    return execTool(targetTool.c_str(), &resolution.tool[0], resolution.configFile.c_str(),
+                    resolution.librariesPath.c_str(), resolution.libraryPathMode.c_str(), argv);
+}
+
+int ToolWrapper::execTool(const char *targetTool, char *tool, const char *configFile, const char *librariesPath,
+                          const char *libraryPathSetting, char **argv)
+{
+    // check if the tool is a symlink to ourselves
+    if (linksBackToSelf(tool, argv0))
+        return 1;
+
+    argv[0] = tool;
+
+    // "LD_LIBRARY_PATH=<librariesPath>:<LD_LIBRARY_PATH>", which putenv()
+    // keeps using until we exec
+    static FixedString<2 * MaxPathLength> libraryPath;
+    LibraryPathMode mode = *librariesPath ? libraryPathMode(libraryPathSetting) : LibraryPathOff;
+    if (mode != LibraryPathOff) {
+        const char *current = getenv("LD_LIBRARY_PATH");
+        libraryPath.append("LD_LIBRARY_PATH=").append(librariesPath);
+        if (current && *current)
+            libraryPath.append(":").append(current);
+        if (libraryPath.overflow)
+            mode = LibraryPathOff;
+    }
+    char interpreter[PATH_MAX];
+    if (mode == LibraryPathLoader && !readInterpreter(tool, interpreter, sizeof interpreter))
+        mode = LibraryPathEnvironment;      // not a dynamically-linked executable
+    if (mode == LibraryPathEnvironment)
+        putenv(libraryPath.data);
+
+    char **toolArgv = argv;
+    vector<char *> loaderArgv;
+    if (mode == LibraryPathLoader) {
+        // --library-path is searched instead of LD_LIBRARY_PATH, and only by
+        // the loader of this process, not by the tool's children. --argv0
+        // gives the tool its own path in argv[0], but /proc/self/exe still
+        // names the loader.
+        char **last = argv;
+        while (*last)
+            ++last;
+        loaderArgv.push_back(interpreter);
+        loaderArgv.push_back(const_cast<char *>("--library-path"));
+        loaderArgv.push_back(libraryPath.data + strlen("LD_LIBRARY_PATH="));
+        loaderArgv.push_back(const_cast<char *>("--argv0"));
+        loaderArgv.push_back(tool);
+        loaderArgv.insert(loaderArgv.end(), argv, last + 1);
+        argv = &loaderArgv[0];
+    }
+
+    // deterministic tools may be answered from the output cache, which runs
+    // them the same way on a miss
+    int exitCode;
+    if (outputCacheEnabled(targetTool)
+            && runToolCached(targetTool, tool, configFile, toolArgv, argv, &exitCode))
+        return exitCode;
+
+#ifdef QTCHOOSER_TEST_MODE
+    // not with stdio, whose buffer would be allocated
+    for ( ; *argv; ++argv) {
+        struct iovec iov[2] = { { *argv, strlen(*argv) }, { const_cast<char *>("\n"), 1 } };
+        if (writev(STDOUT_FILENO, iov, 2) < 0)
+            return 1;
+    }
+    if (mode == LibraryPathEnvironment) {
+        struct iovec iov[2] = { { libraryPath.data, libraryPath.length }, { const_cast<char *>("\n"), 1 } };
+        if (writev(STDOUT_FILENO, iov, 2) < 0)
+            return 1;
+    }
+    return 0;
+#else
+    if (traceFile) {
+        double now = traceTimestamp();
+        traceEvent("execv", 'i', now, now, argv[0]);
+        traceFinish();
+    }
+    execv(argv[0], argv);
+#ifdef __APPLE__
+    // failed; see if we have a .app package by the same name
+    {
+        char appPath[PATH_MAX];
+        snprintf(appPath, PATH_MAX, "%s.app/Contents/MacOS/%s",
+                 argv[0], basename(argv[0]));
+        execv(appPath, argv);
+    }
+#endif
+    fprintf(stderr, "%s: could not exec '%s': %s\n",
+            argv0, argv[0], strerror(errno));
+    return 1;
+#endif
+}
+
+// Quotes a label value as the Prometheus text format requires
+static string prometheusLabel(const string &value)
+{
+    string result = "\"";
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '"' || value[i] == '\\')
+            result += '\\';
+        if (value[i] == '\n')
+            result += "\\n";
+        else
+            result += value[i];
+    }
+    return result + '"';
+}
+
+// Aggregates the records written to the QTCHOOSER_STATS file into per-tool
+// counts and resolution time percentiles, either as a table or in the
+// Prometheus text exposition format (for node_exporter's textfile collector).
+int ToolWrapper::printStats(const string &fileName, bool prometheus)
+{
+    if (fileName.empty()) {
+        fprintf(stderr, "%s: no stats file given and QTCHOOSER_STATS is not set\n", argv0);
+        return 1;
+    }
+    FILE *f = fopen(fileName.c_str(), "rb");
+    if (!f) {
+        fprintf(stderr, "%s: could not open stats file '%s': %s\n", argv0, fileName.c_str(), strerror(errno));
+        return 1;
+    }
+
+    struct ToolStats {
+        vector<uint32_t> times;
+        map<string, unsigned long> sdks;
+        unsigned long fallbacks, cacheHits, failures;
+        double totalTime;
+        ToolStats() : fallbacks(0), cacheHits(0), failures(0), totalTime(0) {}
+    };
+    map<string, ToolStats> tools;
+    unsigned long skipped = 0;
+
+    StatsRecord record;
+    while (fread(&record, sizeof record, 1, f) == 1) {
+        if (record.magic != statsMagic || record.version != 1) {
+            ++skipped;
+            continue;
+        }
+        record.tool[sizeof record.tool - 1] = record.sdk[sizeof record.sdk - 1] = '\0';
+        ToolStats &stats = tools[record.tool];
+        stats.times.push_back(record.resolveTime);
+        stats.totalTime += record.resolveTime;
+        ++stats.sdks[record.sdk];
+        if (record.flags & StatsFallback)
+            ++stats.fallbacks;
+        if (record.flags & StatsCacheHit)
+            ++stats.cacheHits;
+        if (record.flags & StatsFailed)
+            ++stats.failures;
+    }
+    fclose(f);
+    if (skipped)
+        fprintf(stderr, "%s: skipped %lu invalid records in '%s'\n", argv0, skipped, fileName.c_str());
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+    if (prometheus) {
+        puts("# HELP qtchooser_runs_total Tool runs through qtchooser, by tool and SDK.\n"
+             "# TYPE qtchooser_runs_total counter");
+        for (map<string, ToolStats>::iterator it = tools.begin(); it != tools.end(); ++it) {
+            for (map<string, unsigned long>::iterator sdk = it->second.sdks.begin(); sdk != it->second.sdks.end(); ++sdk)
+                printf("qtchooser_runs_total{tool=%s,sdk=%s} %lu\n", prometheusLabel(it->first).c_str(),
+                       prometheusLabel(sdk->first).c_str(), sdk->second);
+        }
+        puts("# HELP qtchooser_fallback_runs_total Tool runs that searched all SDKs for the tool.\n"
+             "# TYPE qtchooser_fallback_runs_total counter");
+        for (map<string, ToolStats>::iterator it = tools.begin(); it != tools.end(); ++it)
+            printf("qtchooser_fallback_runs_total{tool=%s} %lu\n", prometheusLabel(it->first).c_str(),
+                   it->second.fallbacks);
+        puts("# HELP qtchooser_cache_hits_total Tool runs resolved from the resolution cache.\n"
+             "# TYPE qtchooser_cache_hits_total counter");
+        for (map<string, ToolStats>::iterator it = tools.begin(); it != tools.end(); ++it)
+            printf("qtchooser_cache_hits_total{tool=%s} %lu\n", prometheusLabel(it->first).c_str(),
+                   it->second.cacheHits);
+        puts("# HELP qtchooser_resolve_seconds Time spent finding the tool to run.\n"
+             "# TYPE qtchooser_resolve_seconds summary");
+    } else {
+        printf("%-24s %8s %8s %8s %10s %10s %10s %10s\n", "TOOL", "RUNS", "FALLBACK", "CACHED",
+               "P50(us)", "P90(us)", "P99(us)", "MAX(us)");
+    }
+
+    for (map<string, ToolStats>::iterator it = tools.begin(); it != tools.end(); ++it) {
+        ToolStats &stats = it->second;
+        sort(stats.times.begin(), stats.times.end());
+        uint32_t values[sizeof quantiles / sizeof quantiles[0]];
+        for (size_t i = 0; i < sizeof quantiles / sizeof quantiles[0]; ++i)
+            values[i] = stats.times[size_t(quantiles[i] * (stats.times.size() - 1) + 0.5)];
+
+        if (prometheus) {
+            const string tool = prometheusLabel(it->first);
+            for (size_t i = 0; i < sizeof quantiles / sizeof quantiles[0]; ++i)
+                printf("qtchooser_resolve_seconds{tool=%s,quantile=\"%g\"} %g\n",
+                       tool.c_str(), quantiles[i], values[i] / 1e6);
+            printf("qtchooser_resolve_seconds_sum{tool=%s} %g\n", tool.c_str(), stats.totalTime / 1e6);
+            printf("qtchooser_resolve_seconds_count{tool=%s} %lu\n", tool.c_str(),
+                   (unsigned long)stats.times.size());
+        } else {
+            printf("%-24s %8lu %8lu %8lu %10u %10u %10u %10u\n", it->first.c_str(),
+                   (unsigned long)stats.times.size(), stats.fallbacks, stats.cacheHits,
+                   values[0], values[1], values[2], stats.times.back());
+        }
+    }
+
+    if (!prometheus) {
+        // and the SDKs
+        map<string, unsigned long> sdks;
+        for (map<string, ToolStats>::iterator it = tools.begin(); it != tools.end(); ++it) {
+            for (map<string, unsigned long>::iterator sdk = it->second.sdks.begin(); sdk != it->second.sdks.end(); ++sdk)
+                sdks[sdk->first] += sdk->second;
+        }
+        printf("\n%-24s %8s\n", "SDK", "RUNS");
+        for (map<string, unsigned long>::iterator it = sdks.begin(); it != sdks.end(); ++it)
+            printf("%-24s %8lu\n", it->first.c_str(), it->second);
+    }
+    return 0;
+}
+
+// Removes a directory populated by materialize(), which only holds symlinks
+// and the stamp file
+static void removeMaterializedDir(const string &dir)
+{
+    if (DIR *d = opendir(dir.c_str())) {
+        while (struct dirent *e = readdir(d)) {
+            if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+                unlink((dir + PATH_SEP + e->d_name).c_str());
+        }
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+}
+
+// Makes targetDir a symlink to a directory holding one symlink per tool that
+// the SDK provides, pointing straight at the binary in its bin dir. Putting
+// targetDir in $PATH runs the tools without going through qtchooser. The
+// directory is rebuilt only if the SDK's config file or its bin dir changed
+// since the last run, and is replaced atomically by renaming a new symlink
+// over targetDir.
+int ToolWrapper::materialize(const string &sdkName, const string &targetDir)
+{
+    if (targetDir.empty()) {
+        fprintf(stderr, "%s: missing option: target directory\n", argv0);
+        return 1;
+    }
+
+    Sdk sdk = selectSdk(sdkName);
+    if (!sdk.isValid())
+        return 1;
+
+    string toolsPath = sdk.toolsPath;
+    if (toolsPath[0] == '~')
+        toolsPath = userHome() + toolsPath.substr(1);
+
+    string dir = targetDir;
+    while (dir.size() > 1 && dir[dir.size() - 1] == '/')
+        dir.erase(dir.size() - 1);
+    const string stampName = dir + PATH_SEP ".qtchooser-stamp";
+    const string stamp = "conf " + fileStamp(sdk.configFile) + ' ' + sdk.configFile + "\n"
+            "bin " + fileStamp(toolsPath) + ' ' + toolsPath + '\n';
+
+    string oldTarget;
+    struct stat st;
+    if (lstat(dir.c_str(), &st) == 0) {
+        if (!S_ISLNK(st.st_mode)) {
+            fprintf(stderr, "%s: '%s' exists and was not created by -materialize\n", argv0, dir.c_str());
+            return 1;
+        }
+
+        string oldStamp;
+        if (readSmallFile(stampName, &oldStamp) && oldStamp == stamp)
+            return 0;   // up to date
+
+        char buf[PATH_MAX];
+        ssize_t len = readlink(dir.c_str(), buf, sizeof buf - 1);
+        if (len > 0)
+            oldTarget.assign(buf, len);
+    }
+
+    // populate a new directory next to the target
+    string newDir = dir + ".XXXXXX";
+    if (!mkdtemp(&newDir[0])) {
+        fprintf(stderr, "%s: could not create directory next to '%s': %s\n", argv0, dir.c_str(), strerror(errno));
+        return 1;
+    }
+    chmod(newDir.c_str(), 0755);
+
+    for (const char *const *tool = knownTools; *tool; ++tool) {
+        // sdk.hasTool() would look in the unexpanded path
+        const string toolPath = toolsPath + PATH_SEP + *tool;
+        if (access(toolPath.c_str(), X_OK) != 0)
+            continue;
+
+        // don't link to tools that are themselves qtchooser
+        char resolved[PATH_MAX];
+        if (!realpath(toolPath.c_str(), resolved) || endsWith(resolved, PATH_SEP "qtchooser"))
+            continue;
+
+        if (symlink(toolPath.c_str(), (newDir + PATH_SEP + *tool).c_str()) != 0) {
+            fprintf(stderr, "%s: could not create symlink for %s: %s\n", argv0, *tool, strerror(errno));
+            removeMaterializedDir(newDir);
+            return 1;
+        }
+    }
+
+    const string newStampName = newDir + PATH_SEP ".qtchooser-stamp";
+    int fd = ::open(newStampName.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1 || ::write(fd, stamp.data(), stamp.size()) != ssize_t(stamp.size())) {
+        fprintf(stderr, "%s: error writing to \"%s\": %s\n", argv0, newStampName.c_str(), strerror(errno));
+        if (fd != -1)
+            ::close(fd);
+        removeMaterializedDir(newDir);
+        return 1;
+    }
+    ::close(fd);
+
+    // atomically point targetDir at it; the link is relative, so the pair can be moved
+    const string newLink = dir + ".new." + to_number(getpid());
+    const string linkTarget = newDir.substr(newDir.rfind('/') + 1);
+    if (symlink(linkTarget.c_str(), newLink.c_str()) != 0 || rename(newLink.c_str(), dir.c_str()) != 0) {
+        fprintf(stderr, "%s: could not replace '%s': %s\n", argv0, dir.c_str(), strerror(errno));
+        unlink(newLink.c_str());
+        removeMaterializedDir(newDir);
+        return 1;
+    }
+
+    // clean up the directory we replaced, if it's one of ours
+    const string dirName = dir.substr(dir.rfind('/') + 1);
+    if (oldTarget.find('/') == string::npos && beginsWith(oldTarget.c_str(), (dirName + '.').c_str())) {
+        removeMaterializedDir(dir.substr(0, dir.size() - dirName.size()) + oldTarget);
+    }
+    return 0;
+}
+
+struct QmakeQuery
+{
+    string qmake;
+    pid_t pid;
+    int fd;     // reading end of its stdout
+};
+
+// Starts "qmake -query" without waiting for it to finish
+static bool startQuery(const string &qmake, QmakeQuery *query)
+{
+    query->qmake = qmake;
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+    char *argv[] = { const_cast<char *>(qmake.c_str()), const_cast<char *>("-query"), 0 };
+    int error = posix_spawnp(&query->pid, qmake.c_str(), &actions, 0, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(fds[1]);
+    if (error != 0) {
+        ::close(fds[0]);
+        errno = error;
+        return false;
+    }
+    query->fd = fds[0];
+    return true;
+}
+
+// Collects the output of a query started with startQuery, as property names
+// and values. Returns false if qmake failed.
+static bool finishQuery(const QmakeQuery &query, map<string, string> *properties)
+{
+    string output;
+    char buf[4096];
+    ssize_t len;
+    while ((len = ::read(query.fd, buf, sizeof buf)) > 0 || (len == -1 && errno == EINTR)) {
+        if (len > 0)
+            output.append(buf, len);
+    }
+    ::close(query.fd);
+
+    int status;
+    while (waitpid(query.pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+
+    // each line is "NAME:value"
+    size_t pos = 0;
+    while (pos < output.size()) {
+        size_t nl = output.find('\n', pos);
+        if (nl == string::npos)
+            nl = output.size();
+        size_t colon = output.find(':', pos);
+        if (colon < nl)
+            (*properties)[output.substr(pos, colon - pos)] = output.substr(colon + 1, nl - colon - 1);
+        pos = nl + 1;
+    }
+    return true;
+}
+
+// The config file of the installation described by the output of a query
+static string queryConfigContents(map<string, string> &properties)
+{
+    Sdk sdk;
+    sdk.toolsPath = properties["QT_INSTALL_BINS"];
+    sdk.librariesPath = properties["QT_INSTALL_LIBS"];
+    sdk.prefix = properties["QT_INSTALL_PREFIX"];
+    sdk.headersPath = properties["QT_INSTALL_HEADERS"];
+    sdk.pluginsPath = properties["QT_INSTALL_PLUGINS"];
+    return configFileContents(sdk);
+}
+
+int ToolWrapper::install(const string &sdkName, const string &qmake, int installOptions)
+{
+    if (qmake.size() == 0) {
+        fprintf(stderr, "%s: missing option: path to qmake\n", argv0);
+        return 1;
+    }
+
+    if ((installOptions & ForceOverwrite) == 0) {
+        Sdk matchedSdk = findSdk(sdkName);
+        if (matchedSdk.isValid()) {
+            fprintf(stderr, "%s: SDK \"%s\" already exists\n", argv0, sdkName.c_str());
+            return 1;
+        }
+    }
+
+    // first of all, get the directories and the prefix from qmake
+    QmakeQuery query;
+    if (!startQuery(qmake, &query)) {
+        fprintf(stderr, "%s: error running %s: %s\n", argv0, qmake.c_str(), strerror(errno));
+        return 1;
+    }
+    map<string, string> properties;
+    if (!finishQuery(query, &properties) || properties["QT_INSTALL_BINS"].empty()) {
+        fprintf(stderr, "%s: error running %s -query\n", argv0, qmake.c_str());
+        return 1;
+    }
+
+    const string fileContents = queryConfigContents(properties);
+    string sdkFullPath;
+    if (writeSdk(sdkName, fileContents, installOptions, &sdkFullPath))
+        return 0;   // success
+
+    // if we got here, we failed to create the file
+    if (errno == EEXIST) {
+        // another install created it since we checked
+        fprintf(stderr, "%s: SDK \"%s\" already exists\n", argv0, sdkName.c_str());
+        return 1;
+    }
+    fprintf(stderr, "%s: could not create SDK: %s: %s\n", argv0, sdkFullPath.c_str(), strerror(errno));
+    return 1;
+}
+
+// Writes a config file for sdkName into the last search path, or with
+// LocalInstall into the first one, creating it atomically and durably; only
+// ForceOverwrite replaces an existing file, and with DeferSync the caller
+// syncs the directory. On failure, sdkFullPath is the file that couldn't be
+// written and errno says why.
+bool ToolWrapper::writeSdk(const string &sdkName, const string &fileContents, int installOptions,
+                           string *sdkFullPath) const
+{
+    const string sdkFileName = sdkName + confSuffix;
+
+    // get the list of paths to try and install the SDK on the first we are able to;
+    // since the list is sorted in search order, we need to try in the reverse order
+    const vector<string> paths = searchPaths();
+    vector<string>::const_iterator it = paths.end();
+    vector<string>::const_iterator prev = it - 1;
+    for ( ; it != paths.begin(); it = prev--) {
+        *sdkFullPath = *prev + sdkFileName;
+
+        // are we trying to install here?
+        bool installHere = (installOptions & LocalInstall) == 0 || prev == paths.begin();
+        if (!installHere)
+            continue;
+
+#ifdef QTCHOOSER_TEST_MODE
+        puts(sdkFullPath->c_str());
+        puts(fileContents.c_str());
+        return true;
+#else
+        // when many installs run at once, each one either wins or finds the
+        // file that another one created, never a partial one
+        if (writeFileDurably(*sdkFullPath, fileContents, installOptions & ForceOverwrite,
+                             (installOptions & DeferSync) == 0))
+            return true;
+        if (errno == EEXIST)
+            return false;
+#endif
+    }
+
+    return false;
+}
+
+// Work shared by the threads of a scan: a queue of directories still to be
+// listed and the qmake binaries found so far.
+struct ScanQueue
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    vector<string> dirs;
+    size_t busy;            // threads listing a directory
+    vector<string> qmakes;
+};
+
+// Returns true if path is an executable qmake, but not qtchooser itself
+static bool isQmake(const string &path)
+{
+    if (access(path.c_str(), X_OK) != 0)
+        return false;
+    char resolved[PATH_MAX];
+    if (!realpath(path.c_str(), resolved))
+        return false;
+    struct stat st;
+    if (stat(resolved, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    const char *name = strrchr(resolved, '/');
+    return !beginsWith(name ? name + 1 : resolved, "qtchooser");
+}
+
+static void *scanThread(void *arg)
+{
+    ScanQueue *queue = static_cast<ScanQueue *>(arg);
+    vector<string> dirs, qmakes;
+    pthread_mutex_lock(&queue->mutex);
+    while (true) {
+        while (queue->dirs.empty() && queue->busy)
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        if (queue->dirs.empty())
+            break;      // nothing left to list and no one to add more
+        const string path = queue->dirs.back();
+        queue->dirs.pop_back();
+        ++queue->busy;
+        pthread_mutex_unlock(&queue->mutex);
+
+        // symlinks to directories aren't followed, so there can't be loops
+        dirs.clear();
+        qmakes.clear();
+        if (DIR *dir = opendir(path.c_str())) {
+            while (struct dirent *d = readdir(dir)) {
+                if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                    continue;
+                const string entry = path + PATH_SEP + d->d_name;
+                bool isDir = false;
+#ifdef _DIRENT_HAVE_D_TYPE
+                if (d->d_type != DT_UNKNOWN)
+                    isDir = d->d_type == DT_DIR;
+                else
+#endif
+                {
+                    struct stat st;
+                    isDir = lstat(entry.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+                }
+                if (isDir)
+                    dirs.push_back(entry);
+                else if (strcmp(d->d_name, "qmake") == 0 && isQmake(entry))
+                    qmakes.push_back(entry);
+            }
+            closedir(dir);
+        }
+
+        pthread_mutex_lock(&queue->mutex);
+        queue->dirs.insert(queue->dirs.end(), dirs.begin(), dirs.end());
+        queue->qmakes.insert(queue->qmakes.end(), qmakes.begin(), qmakes.end());
+        --queue->busy;
+        pthread_cond_broadcast(&queue->cond);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+// Lists the trees under roots with a pool of threads and returns the qmake
+// binaries found in them, sorted.
+static vector<string> findQmakes(const vector<string> &roots)
+{
+    ScanQueue queue;
+    pthread_mutex_init(&queue.mutex, 0);
+    pthread_cond_init(&queue.cond, 0);
+    queue.dirs = roots;
+    queue.busy = 0;
+
+    // listing directories mostly waits for the disk, so use more threads than CPUs
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    threadCount = max(2L, min(threadCount, 32L));
+    vector<pthread_t> threads;
+    for (long i = 0; i < threadCount; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, scanThread, &queue) == 0)
+            threads.push_back(thread);
+    }
+    if (threads.empty())
+        scanThread(&queue);
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], 0);
+
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.mutex);
+    sort(queue.qmakes.begin(), queue.qmakes.end());
+    return queue.qmakes;
+}
+
+// Registers every Qt installation found under roots, named after its version
+// and its install prefix. All the qmake queries run at the same time.
+int ToolWrapper::scan(const vector<string> &roots, int installOptions)
+{
+    if (roots.empty()) {
+        fprintf(stderr, "%s: missing option: directory to scan\n", argv0);
+        return 1;
+    }
+
+    const vector<string> qmakes = findQmakes(roots);
+    vector<QmakeQuery> queries;
+    for (vector<string>::const_iterator it = qmakes.begin(); it != qmakes.end(); ++it) {
+        QmakeQuery query;
+        if (startQuery(*it, &query))
+            queries.push_back(query);
+        else
+            fprintf(stderr, "%s: error running %s: %s\n", argv0, it->c_str(), strerror(errno));
+    }
+
+    int result = queries.size() == qmakes.size() ? 0 : 1;
+    set<string> names;
+    for (vector<QmakeQuery>::const_iterator it = queries.begin(); it != queries.end(); ++it) {
+        map<string, string> properties;
+        if (!finishQuery(*it, &properties) || properties["QT_VERSION"].empty()
+                || properties["QT_INSTALL_BINS"].empty()) {
+            fprintf(stderr, "%s: error running %s -query\n", argv0, it->qmake.c_str());
+            result = 1;
+            continue;
+        }
+
+        // e.g. "5.15.2-opt-qt-5.15.2-gcc_64"
+        string name = properties["QT_VERSION"];
+        const string &prefix = properties["QT_INSTALL_PREFIX"];
+        for (size_t i = 0; i < prefix.size(); ++i) {
+            const char c = prefix[i];
+            if (isalnum((unsigned char)c) || c == '.' || c == '_' || c == '+')
+                name += c;
+            else if (name[name.size() - 1] != '-')
+                name += '-';
+        }
+        if (name[name.size() - 1] == '-')
+            name.erase(name.size() - 1);
+        if (!names.insert(name).second)
+            continue;   // another qmake of the same installation
+
+        string sdkFullPath;
+        if (!registerSdk(name, properties["QT_INSTALL_BINS"], queryConfigContents(properties), installOptions,
+                         &sdkFullPath))
+            result = 1;
+#ifndef QTCHOOSER_TEST_MODE
+        else if (!sdkFullPath.empty())
+            printf("%s: %s\n", name.c_str(), it->qmake.c_str());
+#endif
+    }
+    return result;
+}
+
+// Writes the config file of an SDK found by -scan or listed for -import. An
+// existing SDK of that name is left alone if it has the same binaries
+// directory, and sdkFullPath is then empty. Returns false after reporting an
+// error.
+bool ToolWrapper::registerSdk(const string &sdkName, const string &toolsPath, const string &fileContents,
+                              int installOptions, string *sdkFullPath)
+{
+    sdkFullPath->clear();
+    if ((installOptions & ForceOverwrite) == 0) {
+        Sdk matchedSdk = findSdk(sdkName);
+        if (matchedSdk.isValid()) {
+            if (matchedSdk.toolsPath == toolsPath)
+                return true;
+            fprintf(stderr, "%s: SDK \"%s\" already exists\n", argv0, sdkName.c_str());
+            return false;
+        }
+    }
+
+    if (writeSdk(sdkName, fileContents, installOptions, sdkFullPath))
+        return true;
+    if (errno == EEXIST) {
+        // another process created it since we checked, maybe the same way
+        sdkFullPath->clear();
+        if (findSdk(sdkName).toolsPath == toolsPath)
+            return true;
+        fprintf(stderr, "%s: SDK \"%s\" already exists\n", argv0, sdkName.c_str());
+        return false;
+    }
+    fprintf(stderr, "%s: could not create SDK: %s: %s\n", argv0, sdkFullPath->c_str(), strerror(errno));
+    return false;
+}
+
+static bool sdkNameLessThan(const Sdk &a, const Sdk &b)
+{
+    return a.name < b.name;
+}
+
+// Writes every visible SDK to a manifest that -import reads back, sorted by
+// name so that it can be kept under version control: to fileName, or to
+// stdout if that is empty or "-".
+int ToolWrapper::exportManifest(const string &fileName)
+{
+    vector<Sdk> sdks = allSdks();
+    sort(sdks.begin(), sdks.end(), sdkNameLessThan);
+
+    int result = 0;
+    string manifest;
+    for (vector<Sdk>::iterator sdk = sdks.begin(); sdk != sdks.end(); ++sdk) {
+        if (sdk->state == Unparsed)
+            readConfigFile(*sdk);
+        if (sdk->state == Unreadable) {
+            fprintf(stderr, "%s: could not open config file '%s': %s\n",
+                    argv0, sdk->configFile.c_str(), strerror(sdk->error));
+            result = 1;
+            continue;
+        }
+        if (sdk->state == Malformed) {
+            fprintf(stderr, "%s: malformed config file '%s'\n", argv0, sdk->configFile.c_str());
+            result = 1;
+            continue;
+        }
+
+        // the key=value lines of the config file are copied as they are
+        const string contents = configFileContents(*sdk);
+        const size_t keys = contents.find('\n', contents.find('\n') + 1) + 1;
+        if (!manifest.empty())
+            manifest += '\n';
+        manifest += '[' + sdk->name + "]\n"
+                    "bin=" + sdk->toolsPath + "\n"
+                    "lib=" + sdk->librariesPath + '\n' + contents.substr(keys);
+    }
+
+    if (fileName.empty() || fileName == "-") {
+        fwrite(manifest.data(), 1, manifest.size(), stdout);
+    } else if (!writeFileAtomically(fileName, manifest)) {
+        fprintf(stderr, "%s: error writing to \"%s\": %s\n", argv0, fileName.c_str(), strerror(errno));
+        return 1;
+    }
+    return result;
+}
+
+// An SDK listed in a manifest
+struct ManifestEntry
+{
+    Sdk sdk;
+    string qmake;
+    int lineNumber;
+};
+
+// Parses a manifest: a "[name]" line starts the entry of an SDK, and the
+// "key=value" lines after it are the entry's bin and lib directories, the
+// qmake to query for those, and the optional keys of config files. Empty
+// lines, lines starting with '#' and unknown keys are ignored. Returns false
+// after reporting the errors.
+static bool parseManifest(const string &fileName, FILE *f, vector<ManifestEntry> *entries)
+{
+    bool valid = true;
+    bool inEntry = false;
+    bool invalidName = false;   // the lines after it are skipped silently
+    set<string> names;
+    char *line = 0;
+    size_t size = 0;
+    ssize_t len;
+    for (int lineNumber = 1; (len = getline(&line, &size, f)) >= 0; ++lineNumber) {
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (!len || *line == '#')
+            continue;
+
+        if (*line == '[') {
+            const string name(line + 1, line + len - 1);
+            inEntry = false;
+            invalidName = true;
+            if (line[len - 1] != ']' || name.empty() || name.find('/') != string::npos) {
+                fprintf(stderr, "%s: %s:%d: invalid SDK name\n", argv0, fileName.c_str(), lineNumber);
+                valid = false;
+            } else if (!names.insert(name).second) {
+                fprintf(stderr, "%s: %s:%d: SDK \"%s\" listed twice\n", argv0, fileName.c_str(),
+                        lineNumber, name.c_str());
+                valid = false;
+            } else {
+                entries->push_back(ManifestEntry());
+                entries->back().sdk.name = name;
+                entries->back().lineNumber = lineNumber;
+                inEntry = true;
+                invalidName = false;
+            }
+            continue;
+        }
+
+        const char *eq = strchr(line, '=');
+        if (!eq) {
+            fprintf(stderr, "%s: %s:%d: expected \"[name]\" or \"key=value\"\n", argv0, fileName.c_str(), lineNumber);
+            valid = false;
+            continue;
+        }
+        if (!inEntry) {
+            if (!invalidName)
+                fprintf(stderr, "%s: %s:%d: \"%s\" is not in an SDK entry\n", argv0, fileName.c_str(),
+                        lineNumber, line);
+            valid = false;
+            continue;
+        }
+
+        ManifestEntry &entry = entries->back();
+        const string key(line, eq - line);
+        const string value(eq + 1);
+        if (key == "bin")
+            entry.sdk.toolsPath = value;
+        else if (key == "lib")
+            entry.sdk.librariesPath = value;
+        else if (key == "qmake")
+            entry.qmake = value;
+        else
+            setConfigValue(entry.sdk, key, value);
+    }
+    free(line);
+
+    for (vector<ManifestEntry>::const_iterator it = entries->begin(); it != entries->end(); ++it) {
+        if (it->sdk.toolsPath.empty() && it->qmake.empty()) {
+            fprintf(stderr, "%s: %s:%d: SDK \"%s\" has neither bin nor qmake\n", argv0, fileName.c_str(),
+                    it->lineNumber, it->sdk.name.c_str());
+            valid = false;
+        }
+    }
+    return valid;
+}
+
+// A config file written by -import, to be undone if a later one fails
+struct ImportedConfig
+{
+    string fileName;
+    bool existed;           // and was replaced with -f
+    string oldContents;
+};
+
+static void undoImport(const vector<ImportedConfig> &imported)
+{
+    for (vector<ImportedConfig>::const_reverse_iterator it = imported.rbegin(); it != imported.rend(); ++it) {
+        if (it->existed)
+            writeFileDurably(it->fileName, it->oldContents, true, false);
+        else
+            unlink(it->fileName.c_str());
+    }
+}
+
+// Registers the SDKs listed in a manifest, all in the same directory. qmake
+// is only run for the entries without a bin directory, all at the same time,
+// and the directory is synced once at the end instead of after each file.
+// Nothing is written if the manifest has errors, if a query fails or if an
+// SDK already exists with another bin directory. If writing a file fails,
+// the files written before it are removed, or restored if -f replaced them.
+int ToolWrapper::importManifest(const string &fileName, int installOptions)
+{
+    if (fileName.empty()) {
+        fprintf(stderr, "%s: missing option: manifest file\n", argv0);
+        return 1;
+    }
+    FILE *f = fileName == "-" ? stdin : fopen(fileName.c_str(), "r");
+    if (!f) {
+        fprintf(stderr, "%s: could not open manifest '%s': %s\n", argv0, fileName.c_str(), strerror(errno));
+        return 1;
+    }
+    vector<ManifestEntry> entries;
+    bool valid = parseManifest(fileName, f, &entries);
+    if (f != stdin)
+        fclose(f);
+    if (!valid)
+        return 1;
+
+    int result = 0;
+    vector<QmakeQuery> queries;
+    vector<ManifestEntry *> queried;
+    for (vector<ManifestEntry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (!it->sdk.toolsPath.empty())
+            continue;
+        QmakeQuery query;
+        if (startQuery(it->qmake, &query)) {
+            queries.push_back(query);
+            queried.push_back(&*it);
+        } else {
+            fprintf(stderr, "%s: error running %s: %s\n", argv0, it->qmake.c_str(), strerror(errno));
+            result = 1;
+        }
+    }
+    for (size_t i = 0; i < queries.size(); ++i) {
+        map<string, string> properties;
+        if (!finishQuery(queries[i], &properties) || properties["QT_INSTALL_BINS"].empty()) {
+            fprintf(stderr, "%s: error running %s -query\n", argv0, queries[i].qmake.c_str());
+            result = 1;
+            continue;
+        }
+
+        // what the manifest says takes precedence
+        Sdk &sdk = queried[i]->sdk;
+        sdk.toolsPath = properties["QT_INSTALL_BINS"];
+        if (sdk.librariesPath.empty())
+            sdk.librariesPath = properties["QT_INSTALL_LIBS"];
+        if (sdk.prefix.empty())
+            sdk.prefix = properties["QT_INSTALL_PREFIX"];
+        if (sdk.headersPath.empty())
+            sdk.headersPath = properties["QT_INSTALL_HEADERS"];
+        if (sdk.pluginsPath.empty())
+            sdk.pluginsPath = properties["QT_INSTALL_PLUGINS"];
+    }
+
+    if (result)
+        return result;
+
+    // check every entry before writing any
+    vector<const Sdk *> sdks;
+    for (vector<ManifestEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        if ((installOptions & ForceOverwrite) == 0) {
+            Sdk matchedSdk = findSdk(it->sdk.name);
+            if (matchedSdk.isValid()) {
+                if (matchedSdk.toolsPath != it->sdk.toolsPath) {
+                    fprintf(stderr, "%s: SDK \"%s\" already exists\n", argv0, it->sdk.name.c_str());
+                    result = 1;
+                }
+                continue;
+            }
+        }
+        sdks.push_back(&it->sdk);
+    }
+    if (result)
+        return result;
+
+    // remember what each file that may be written had, so that the import
+    // can be undone
+    const vector<string> paths = searchPaths();
+    vector<ImportedConfig> imported;
+    set<string> dirs;
+    for (vector<const Sdk *>::const_iterator it = sdks.begin(); it != sdks.end(); ++it) {
+        const Sdk &sdk = **it;
+        map<string, string> oldContents;
+        for (vector<string>::const_iterator path = paths.begin(); path != paths.end(); ++path) {
+            string contents;
+            if (readFile(*path + sdk.name + confSuffix, &contents))
+                oldContents[*path + sdk.name + confSuffix] = contents;
+        }
+
+        string sdkFullPath;
+        if (!registerSdk(sdk.name, sdk.toolsPath, configFileContents(sdk), installOptions | DeferSync,
+                         &sdkFullPath)) {
+            undoImport(imported);
+            result = 1;
+            break;
+        }
+        if (sdkFullPath.empty())
+            continue;   // created by someone else in the meantime
+        ImportedConfig config;
+        config.fileName = sdkFullPath;
+        map<string, string>::const_iterator old = oldContents.find(sdkFullPath);
+        config.existed = old != oldContents.end();
+        if (config.existed)
+            config.oldContents = old->second;
+        imported.push_back(config);
+        dirs.insert(sdkFullPath.substr(0, sdkFullPath.rfind('/')));
+    }
+
+#ifndef QTCHOOSER_TEST_MODE
+    for (set<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+        if (!syncDir(*it)) {
+            fprintf(stderr, "%s: could not sync directory '%s': %s\n", argv0, it->c_str(), strerror(errno));
+            result = 1;
+        }
+    }
+#endif
+    return result;
+}
+
+// Quotes a value so that the shell reads it back literally
+static string shellQuote(const string &value, bool fish)
+{
+    string result = "'";
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '\'')
+            result += fish ? "\\'" : "'\\''";
+        else if (value[i] == '\\' && fish)
+            result += "\\\\";
+        else
+            result += value[i];
+    }
+    return result + '\'';
+}
+
+// Prints the commands that export name with the given value, or unset it if
+// there are no values. Lists are joined with colons, except for fish, which
+// keeps them as lists and joins them when exporting.
+static void printShellVariable(const char *name, const vector<string> &values, bool fish)
+{
+    if (values.empty()) {
+        printf(fish ? "set -e %s;\n" : "unset %s;\n", name);
+        return;
+    }
+
+    string value;
+    for (vector<string>::const_iterator it = values.begin(); it != values.end(); ++it) {
+        if (fish)
+            value += ' ' + shellQuote(*it, fish);
+        else
+            value += (it == values.begin() ? "" : ":") + *it;
+    }
+    if (fish)
+        printf("set -gx %s%s;\n", name, value.c_str());
+    else
+        printf("export %s=%s;\n", name, shellQuote(value, fish).c_str());
+}
+
+static void printShellVariable(const char *name, const string &value, bool fish)
+{
+    printShellVariable(name, value.empty() ? vector<string>() : vector<string>(1, value), fish);
+}
+
+// Prints the path list in the environment variable name, without the
+// entries equal to oldEntry and with newEntry first, if not empty.
+static void printShellPathList(const char *name, const string &oldEntry, const string &newEntry, bool fish)
+{
+    vector<string> entries;
+    if (!newEntry.empty())
+        entries.push_back(newEntry);
+
+    const vector<string> current = stringSplit(qgetenv(name).c_str());
+    for (vector<string>::const_iterator it = current.begin(); it != current.end(); ++it) {
+        if (!it->empty() && *it != oldEntry && *it != newEntry)
+            entries.push_back(*it);
+    }
+    printShellVariable(name, entries, fish);
 }
 
-static bool readLine(FILE *f, string *result)
+// Returns the source dir of an uninstalled Qt build in buildDir, taken from
+// the "Project:" line that qmake writes at the top of the Makefiles, or an
+// empty string.
+static string sourceDirOfBuild(const string &buildDir)
 {
-#if _POSIX_VERSION >= 200809L
-    size_t len = 0;
-    char *line = 0;
-    ssize_t read = getline(&line, &len, f);
-    if (read < 0) {
-        free(line);
-        return false;
+    int fd = ::open((buildDir + PATH_SEP "Makefile").c_str(), O_RDONLY);
+    if (fd == -1)
+        return string();
+    char buf[4096];
+    ssize_t len = ::read(fd, buf, sizeof buf - 1);
+    ::close(fd);
+    if (len <= 0)
+        return string();
+    buf[len] = '\0';
+
+    const char *project = strstr(buf, "Project:");
+    if (!project)
+        return string();
+    project += strlen("Project:");
+    project += strspn(project, " \t");
+    string path(project, strcspn(project, "\r\n"));
+    size_t slash = path.rfind('/');
+    path.erase(slash == string::npos ? 0 : slash);
+    if (path.empty() || path[0] != '/')
+        path = buildDir + (path.empty() ? "" : PATH_SEP + path);
+    return path;
+}
+
+// Prints the commands that switch a shell from the Qt version it is using,
+// according to QTLIBDIR and QTDIR in its environment, to targetSdk, or to no
+// version at all if targetSdk is "none". This covers everything the
+// qt_select shell function sets, so that it needs only one eval.
+int ToolWrapper::printShellEnvironment(const string &targetSdk, const string &shell)
+{
+    bool fish = shell == "fish";
+    if (!fish && shell != "sh" && shell != "bash" && shell != "zsh") {
+        fprintf(stderr, "%s: unknown shell: %s\n", argv0, shell.c_str());
+        return 1;
     }
 
-    line[strlen(line) - 1] = '\0';
-    *result = line;
-    free(line);
-#elif defined(PATH_MAX)
-    char buf[PATH_MAX];
-    if (!fgets(buf, PATH_MAX - 1, f))
-        return false;
+    Sdk sdk;
+    string qtDir, qtSourceDir;
+    if (targetSdk != "none") {
+        sdk = selectSdk(targetSdk);
+        if (!sdk.isValid())
+            return 1;
 
-    buf[PATH_MAX - 1] = '\0';
-    buf[strlen(buf) - 1] = '\0';
-    *result = buf;
-#else
-# error "POSIX < 2008 and no PATH_MAX, fix me"
-#endif
-    return true;
+        // -install and -scan record the prefix; for config files written
+        // without one, the last resort is to assume the usual layout with the
+        // binaries in <prefix>/bin, which is wrong for layouts like
+        // /usr/lib/qt5/bin
+        qtDir = sdk.prefix;
+        if (qtDir.empty()) {
+            string toolsPath = sdk.toolsPath;
+            if (toolsPath[0] == '~')
+                toolsPath = userHome() + toolsPath.substr(1);
+            size_t slash = toolsPath.find_last_not_of('/');
+            slash = toolsPath.rfind('/', slash);
+            qtDir = slash == 0 || slash == string::npos ? string("/") : toolsPath.substr(0, slash);
+        }
+        qtSourceDir = sourceDirOfBuild(qtDir);
+        if (qtSourceDir.empty())
+            qtSourceDir = qtDir;
+    }
+
+    const string oldLibDir = qgetenv("QTLIBDIR");
+    const string newLibDir = sdk.librariesPath;
+    printShellPathList("LD_LIBRARY_PATH", oldLibDir, newLibDir, fish);
+    printShellPathList("PKG_CONFIG_PATH",
+                       oldLibDir.empty() ? string() : oldLibDir + "/pkgconfig",
+                       newLibDir.empty() ? string() : newLibDir + "/pkgconfig", fish);
+    printShellPathList("CMAKE_PREFIX_PATH", qgetenv("QTDIR"), qtDir, fish);
+    printShellVariable("QT_SELECT", sdk.isValid() ? sdk.name : string(), fish);
+    printShellVariable("QTLIBDIR", newLibDir, fish);
+    printShellVariable("QTDIR", qtDir, fish);
+    printShellVariable("QTSRCDIR", qtSourceDir, fish);
+    return 0;
 }
 
-static bool mkparentdir(string name)
+// Finds a displacement for each bucket, biggest first, so that every name
+// lands in a slot of its own. Returns false if some bucket can't be placed.
+static bool buildPerfectHash(const vector<Sdk> &sdks, uint32_t bucketCount, uint32_t slotCount,
+                             vector<uint32_t> *buckets, vector<uint32_t> *slots)
 {
-    // create the dir containing this dir
-    size_t pos = name.rfind('/');
-    if (pos == string::npos)
-        return false;
-    name.erase(pos);
-    if (mkdir(name.c_str(), 0777) == -1) {
-        if (errno != ENOENT)
-            return false;
-        // try this dir's parent too
-        if (!mkparentdir(name))
+    vector<vector<uint32_t> > members(bucketCount);
+    for (size_t i = 0; i < sdks.size(); ++i)
+        members[registryHash(sdks[i].name, 0) % bucketCount].push_back(i);
+    vector<pair<size_t, uint32_t> > order;
+    for (uint32_t i = 0; i < bucketCount; ++i)
+        order.push_back(make_pair(members[i].size(), i));
+    sort(order.rbegin(), order.rend());
+
+    buckets->assign(bucketCount, 0);
+    slots->assign(slotCount, RegistryNoEntry);
+    vector<uint32_t> taken;
+    for (size_t i = 0; i < order.size() && order[i].first; ++i) {
+        const vector<uint32_t> &bucket = members[order[i].second];
+        uint32_t displacement = 1;
+        for ( ; displacement < MaxDisplacement; ++displacement) {
+            taken.clear();
+            for (size_t j = 0; j < bucket.size(); ++j) {
+                uint32_t slot = registryHash(sdks[bucket[j]].name, displacement) % slotCount;
+                if ((*slots)[slot] != RegistryNoEntry || find(taken.begin(), taken.end(), slot) != taken.end())
+                    break;
+                taken.push_back(slot);
+            }
+            if (taken.size() == bucket.size())
+                break;
+        }
+        if (displacement == MaxDisplacement)
             return false;
+        (*buckets)[order[i].second] = displacement;
+        for (size_t j = 0; j < bucket.size(); ++j)
+            (*slots)[taken[j]] = bucket[j];
     }
     return true;
 }
 
-int ToolWrapper::runTool(const string &targetSdk, const string &targetTool, char **argv)
+static uint32_t appendRegistryString(string &contents, const string &s)
 {
-    Sdk sdk = selectSdk(targetSdk, targetTool);
-    if (!sdk.isValid())
-        return 1;
+    uint32_t offset = contents.size();
+    contents.append(s.c_str(), s.size() + 1);
+    return offset;
+}
 
-    string tool = sdk.toolsPath + PATH_SEP + targetTool;
-    if (tool[0] == '~')
-        tool = userHome() + tool.substr(1);
+static bool fileNameLessThan(const char *a, const char *b)
+{
+    return strcmp(a, b) < 0;
+}
 
-    // check if the tool is a symlink to ourselves
-    if (linksBackToSelf(tool.c_str(), argv0))
-        return 1;
+int ToolWrapper::listVersions()
+{
+    SdkNameSet names;
+    vector<string> paths = searchPaths();
+    for (vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+        TraceScope trace("listVersions", it->c_str());
+        listSdkNames(*it, &names);
+    }
 
-    argv[0] = &tool[0];
-#ifdef QTCHOOSER_TEST_MODE
-    while (*argv)
-        printf("%s\n", *argv++);
-    return 0;
-#else
-    execv(argv[0], argv);
-#ifdef __APPLE__
-    // failed; see if we have a .app package by the same name
-    {
-        char appPath[PATH_MAX];
-        snprintf(appPath, PATH_MAX, "%s.app/Contents/MacOS/%s",
-                 argv[0], basename(argv[0]));
-        execv(appPath, argv);
+    // sorted by file name, so "a.conf" comes after "a-b.conf"
+    vector<const char *> sorted = names.fileNames();
+    sort(sorted.begin(), sorted.end(), fileNameLessThan);
+    for (vector<const char *>::const_iterator it = sorted.begin(); it != sorted.end(); ++it) {
+        // strip the .conf suffix
+        fwrite(*it, 1, strlen(*it) + 1 - sizeof confSuffix, stdout);
+        putchar('\n');
     }
-#endif
-    fprintf(stderr, "%s: could not exec '%s': %s\n",
-            argv0, argv[0], strerror(errno));
-    return 1;
-#endif
+    return 0;
 }
 
-static const char *to_number(int number)
+// Writes the registry of the config files in dir to dir.registry.
+int ToolWrapper::compile(const string &dir)
 {
-    // obviously not thread-safe
-    static char buffer[sizeof "2147483647"];
-    snprintf(buffer, sizeof buffer, "%d", number);
-    return buffer;
-}
+    if (dir.empty()) {
+        fprintf(stderr, "%s: missing option: config directory\n", argv0);
+        return 1;
+    }
 
-int ToolWrapper::install(const string &sdkName, const string &qmake, int installOptions)
-{
-    if (qmake.size() == 0) {
-        fprintf(stderr, "%s: missing option: path to qmake\n", argv0);
+    // take the stamp first, so that a change made while we list the
+    // directory makes the registry stale instead of wrong
+    const string path = dir[dir.size() - 1] == '/' ? dir : dir + '/';
+    const string stamp = fileStamp(path);
+    if (stamp == "-") {
+        fprintf(stderr, "%s: could not open directory '%s': %s\n", argv0, dir.c_str(), strerror(errno));
         return 1;
     }
 
-    if ((installOptions & ForceOverwrite) == 0) {
-        Sdk matchedSdk = iterateSdks(sdkName, &ToolWrapper::matchSdk);
-        if (matchedSdk.isValid()) {
-            fprintf(stderr, "%s: SDK \"%s\" already exists\n", argv0, sdkName.c_str());
+    // read the files directly, not through an existing registry
+    vector<Sdk> sdks;
+    listSdks(path, &sdks, false);
+    for (vector<Sdk>::iterator it = sdks.begin(); it != sdks.end(); ++it) {
+        if (!matchSdk(it->name, *it) && it->state == Unreadable) {
+            fprintf(stderr, "%s: could not open config file '%s': %s\n",
+                    argv0, it->configFile.c_str(), strerror(it->error));
             return 1;
         }
     }
 
-    // first of all, get the bin and lib dirs from qmake
-    string bindir, libdir;
-    FILE *bin, *lib;
-    bin = popen(("'" + qmake + "' -query QT_INSTALL_BINS").c_str(), "r");
-    lib = popen(("'" + qmake + "' -query QT_INSTALL_LIBS").c_str(), "r");
+    uint32_t bucketCount = sdks.size() / 4 + 1;
+    uint32_t slotCount = sdks.size() + sdks.size() / 4 + 1;
+    vector<uint32_t> buckets, slots;
+    while (!buildPerfectHash(sdks, bucketCount, slotCount, &buckets, &slots)) {
+        bucketCount *= 2;
+        slotCount += slotCount / 4 + 1;
+    }
 
-    if (!readLine(bin, &bindir) || !readLine(lib, &libdir)\
-            || pclose(bin) == -1 || pclose(lib) == -1) {
-        fprintf(stderr, "%s: error running %s: %s\n", argv0, qmake.c_str(), strerror(errno));
+    RegistryHeader header;
+    memset(&header, 0, sizeof header);
+    header.magic = registryMagic;
+    header.version = registryVersion;
+    header.entryCount = sdks.size();
+    header.bucketCount = bucketCount;
+    header.slotCount = slotCount;
+
+    string contents(sizeof header + (bucketCount + slotCount) * sizeof(uint32_t)
+                    + sdks.size() * sizeof(RegistryEntry), '\0');
+    header.stamp = appendRegistryString(contents, stamp);
+    vector<RegistryEntry> entries(sdks.size());
+    for (size_t i = 0; i < sdks.size(); ++i) {
+        entries[i].flags = sdks[i].state == Parsed ? 0 : uint32_t(RegistryMalformed);
+        entries[i].name = appendRegistryString(contents, sdks[i].name);
+        entries[i].toolsPath = appendRegistryString(contents, sdks[i].toolsPath);
+        entries[i].librariesPath = appendRegistryString(contents, sdks[i].librariesPath);
+        entries[i].prefix = appendRegistryString(contents, sdks[i].prefix);
+        entries[i].headersPath = appendRegistryString(contents, sdks[i].headersPath);
+        entries[i].pluginsPath = appendRegistryString(contents, sdks[i].pluginsPath);
+        entries[i].libraryPathMode = appendRegistryString(contents, sdks[i].libraryPathMode);
+    }
+    header.fileSize = contents.size();
+    if (contents.size() > 0x7fffffff) {
+        fprintf(stderr, "%s: too many config files in '%s'\n", argv0, dir.c_str());
         return 1;
     }
 
-    const string sdkFileName = sdkName + confSuffix;
-    const string fileContents = bindir + "\n" + libdir + "\n";
-    string sdkFullPath;
+    char *data = &contents[0];
+    memcpy(data, &header, sizeof header);
+    data += sizeof header;
+    memcpy(data, &buckets[0], bucketCount * sizeof(uint32_t));
+    data += bucketCount * sizeof(uint32_t);
+    memcpy(data, &slots[0], slotCount * sizeof(uint32_t));
+    data += slotCount * sizeof(uint32_t);
+    if (!entries.empty())
+        memcpy(data, &entries[0], entries.size() * sizeof(RegistryEntry));
+
+    const string fileName = registryFileName(path);
+    if (!writeFileAtomically(fileName, contents)) {
+        fprintf(stderr, "%s: could not write '%s': %s\n", argv0, fileName.c_str(), strerror(errno));
+        return 1;
+    }
+    return 0;
+}
 
-    // get the list of paths to try and install the SDK on the first we are able to;
-    // since the list is sorted in search order, we need to try in the reverse order
-    const vector<string> paths = searchPaths();
-    vector<string>::const_iterator it = paths.end();
-    vector<string>::const_iterator prev = it - 1;
-    for ( ; it != paths.begin(); it = prev--) {
-        sdkFullPath = *prev + sdkFileName;
+// Reads lines of "<sdk> <tool>" from stdin and prints the path of the tool
+// that -run-tool would run for each, or a line starting with "error: ". An
+// SDK of "-" means none was selected, like an empty QT_SELECT, so the
+// project pin applies. The search paths are listed only once for the whole
+// batch and each config file is read at most once.
+int ToolWrapper::resolveBatch()
+{
+    preloadSdks();
+    const string pinnedSdk = projectSdk();
 
-        // are we trying to install here?
-        bool installHere = (installOptions & LocalInstall) == 0 || prev == paths.begin();
-        if (!installHere)
+    string home;
+    char *line = 0;
+    size_t len = 0;
+    while (getline(&line, &len, stdin) >= 0) {
+        char *sdkName = strtok(line, " \t\r\n");
+        if (!sdkName)
+            continue;   // blank line
+        char *toolName = strtok(0, " \t\r\n");
+        if (!toolName || strtok(0, " \t\r\n")) {
+            puts("error: expected \"<sdk> <tool>\"");
+            fflush(stdout);
             continue;
-
-#ifdef QTCHOOSER_TEST_MODE
-        puts(sdkFullPath.c_str());
-        puts(fileContents.c_str());
-        return 0;
-#else
-        // we're good, create the SDK name
-        string tempname = sdkFullPath + "." + to_number(rand());
-        int fd;
-        // create a temporary file here
-        while (true) {
-            fd = ::open(tempname.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
-            if (fd == -1 && errno == EEXIST)
-                continue;
-            if (fd == -1 && errno == ENOENT) {
-                // could be because the dir itself doesn't exist
-                if (mkparentdir(tempname))
-                    continue;
-            }
-            break;
         }
-        if (fd == -1)
-            continue;
 
-        size_t bytesWritten = 0;
-        while (bytesWritten < fileContents.size()) {
-            ssize_t written = ::write(fd, fileContents.data() + bytesWritten, fileContents.size() - bytesWritten);
-            if (written == -1) {
-                fprintf(stderr, "%s: error writing to \"%s\": %s\n", argv0, tempname.c_str(), strerror(errno));
-                ::close(fd);
-                return 1;
+        const string targetSdk = strcmp(sdkName, "-") == 0 ? pinnedSdk : string(sdkName);
+        const Sdk sdk = Resolver::selectSdk(targetSdk, toolName);
+        if (sdk.state == Unreadable) {
+            printf("error: could not open config file '%s': %s\n", sdk.configFile.c_str(), strerror(sdk.error));
+        } else if (!sdk.isValid()) {
+            printf("error: could not find a Qt installation of '%s'\n", targetSdk.c_str());
+        } else {
+            string tool = sdk.toolsPath + PATH_SEP + toolName;
+            if (tool[0] == '~') {
+                if (home.empty())
+                    home = userHome();
+                tool = home + tool.substr(1);
             }
-
-            bytesWritten += written;
+            puts(tool.c_str());
         }
 
-        // atomic rename
-        ::close(fd);
-        if (rename(tempname.c_str(), sdkFullPath.c_str()) == 0)
-            return 0;   // success
-#endif
+        // stream the answers, the caller may be waiting for each one
+        fflush(stdout);
     }
-
-    // if we got here, we failed to create the file
-    fprintf(stderr, "%s: could not create SDK: %s: %s\n", argv0, sdkFullPath.c_str(), strerror(errno));
-    return 1;
+    free(line);
+    return 0;
 }
 
-static vector<string> stringSplit(const char *source)
+// One tool invocation of -exec-batch
+struct BatchJob
 {
-#if defined(_WIN32) || defined(__WIN32__)
-    char listSeparator = ';';
-#else
-    char listSeparator = ':';
-#endif
+    BatchJob() : pid(-1), outFd(-1), errFd(-1), status(0), finished(false), start(0) {}
+
+    vector<string> args;        // the tool name, then its arguments
+    pid_t pid;
+    int outFd;                  // reading ends of its stdout and stderr, -1 after EOF
+    int errFd;
+    string out;                 // output not yet passed on
+    string err;
+    int status;                 // from waitpid, or -1 if it could not be started
+    bool finished;
+    double start;
+};
 
-    vector<string> result;
-    if (!*source)
-        return result;
+enum { MaxBatchJobs = 256 };
 
-    while (true) {
-        const char *p = strchr(source, listSeparator);
-        if (!p) {
-            result.push_back(source);
-            return result;
-        }
+// Splits a line of a job file into words separated by blanks. Quotes and
+// backslashes protect blanks as in the shell, but nothing is expanded. A word
+// starting with '#' starts a comment. Returns false on an unterminated quote.
+static bool splitJobLine(const char *p, vector<string> *args)
+{
+    for (;;) {
+        while (*p && isspace((unsigned char)*p))
+            ++p;
+        if (!*p || *p == '#')
+            return true;
 
-        result.push_back(string(source, p - source));
-        source = p + 1;
+        string word;
+        char quote = 0;
+        for ( ; *p && (quote || !isspace((unsigned char)*p)); ++p) {
+            if (*p == quote)
+                quote = 0;
+            else if (!quote && (*p == '\'' || *p == '"'))
+                quote = *p;
+            else if (*p == '\\' && quote != '\'' && p[1])
+                word += *++p;
+            else
+                word += *p;
+        }
+        if (quote)
+            return false;
+        args->push_back(word);
     }
-    return result;
 }
 
-static string qgetenv(const char *env, const string &defaultValue = string())
+// A client of the GNU make jobserver named in MAKEFLAGS. Every job but the
+// first needs a token read from it, to be written back once the job is done.
+// Tokens are read from a non-blocking file description of our own, so that
+// make and the other jobs sharing the jobserver are not affected.
+struct JobServer
+{
+    JobServer() : readFd(-1), writeFd(-1) {}
+    ~JobServer();
+
+    bool open();
+    bool acquire();
+    void release();
+
+    int readFd;
+    int writeFd;
+    string tokens;      // held, to be returned as they were read
+};
+
+JobServer::~JobServer()
 {
-    const char *value = getenv(env);
-    return value ? string(value) : defaultValue;
+    while (!tokens.empty())
+        release();
+    if (readFd != -1)
+        ::close(readFd);
+    if (writeFd != -1)
+        ::close(writeFd);
 }
 
-vector<string> ToolWrapper::searchPaths() const
+bool JobServer::open()
 {
-    vector<string> paths;
+    // the last option wins; makes before 4.2 used --jobserver-fds
+    string auth;
+    for (const char *p = getenv("MAKEFLAGS"); p && *p; ) {
+        const char *end = strchr(p, ' ');
+        if (!end)
+            end = p + strlen(p);
+        if (beginsWith(p, "--jobserver-auth="))
+            auth.assign(p + strlen("--jobserver-auth="), end);
+        else if (beginsWith(p, "--jobserver-fds="))
+            auth.assign(p + strlen("--jobserver-fds="), end);
+        p = *end ? end + 1 : end;
+    }
+    if (auth.empty())
+        return false;
+
+    if (beginsWith(auth.c_str(), "fifo:")) {
+        const string path = auth.substr(strlen("fifo:"));
+        readFd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        writeFd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    } else {
+        // the pipe is only passed on to commands make knows to be recursive
+        int r, w;
+        char c;
+        if (sscanf(auth.c_str(), "%d,%d%c", &r, &w, &c) != 2
+                || fcntl(r, F_GETFD) == -1 || fcntl(w, F_GETFD) == -1)
+            return false;
+        char path[64];
+        snprintf(path, sizeof path, "/proc/self/fd/%d", r);
+        readFd = ::open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        writeFd = fcntl(w, F_DUPFD_CLOEXEC, 0);
+    }
+    return readFd != -1 && writeFd != -1;
+}
 
-    string localDir = qgetenv("XDG_CONFIG_HOME", userHome() + PATH_SEP ".config");
-    paths.push_back(localDir);
+// Takes a token if one is available right now
+bool JobServer::acquire()
+{
+    char token;
+    if (::read(readFd, &token, 1) != 1)
+        return false;
+    tokens += token;
+    return true;
+}
 
-    // search the XDG config location directories
-    vector<string> xdgPaths = stringSplit(qgetenv("XDG_CONFIG_DIRS", "/etc/xdg").c_str());
-    paths.insert(paths.end(), xdgPaths.begin(), xdgPaths.end());
+void JobServer::release()
+{
+    const char token = tokens[tokens.size() - 1];
+    while (::write(writeFd, &token, 1) == -1 && errno == EINTR)
+        ;
+    tokens.erase(tokens.size() - 1);
+}
 
-#if defined(QTCHOOSER_GLOBAL_DIR)
-    if (qgetenv("QTCHOOSER_NO_GLOBAL_DIR").empty()) {
-        vector<string> globalPaths = stringSplit(QTCHOOSER_GLOBAL_DIR);
-        paths.insert(paths.end(), globalPaths.begin(), globalPaths.end());
+static void startBatchJob(BatchJob &job, const string &tool)
+{
+    job.finished = true;
+    job.status = -1;
+    if (tool.empty())
+        return;     // already reported
+
+    int out[2], err[2];
+    if (pipe(out) != 0)
+        out[0] = out[1] = -1;
+    if (out[0] == -1 || pipe(err) != 0)
+        err[0] = err[1] = -1;
+    int error = errno;
+    if (err[0] != -1) {
+        // don't let the jobs started later inherit the reading ends
+        fcntl(out[0], F_SETFD, FD_CLOEXEC);
+        fcntl(err[0], F_SETFD, FD_CLOEXEC);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+        posix_spawn_file_actions_addclose(&actions, out[1]);
+        posix_spawn_file_actions_addclose(&actions, err[1]);
+
+        vector<char *> argv;
+        argv.push_back(const_cast<char *>(tool.c_str()));
+        for (size_t i = 1; i < job.args.size(); ++i)
+            argv.push_back(&job.args[i][0]);
+        argv.push_back(0);
+
+        if (traceFile)
+            job.start = traceTimestamp();
+        error = posix_spawn(&job.pid, tool.c_str(), &actions, 0, &argv[0], environ);
+        posix_spawn_file_actions_destroy(&actions);
+        ::close(out[1]);
+        ::close(err[1]);
+        if (error == 0) {
+            job.outFd = out[0];
+            job.errFd = err[0];
+            job.finished = false;
+            job.status = 0;
+            return;
+        }
+        ::close(out[0]);
+        ::close(err[0]);
+    } else if (out[0] != -1) {
+        ::close(out[0]);
+        ::close(out[1]);
     }
-#endif
+    job.err = string(argv0) + ": could not run '" + tool + "': " + strerror(error) + '\n';
+}
 
-    for (vector<string>::iterator it = paths.begin(); it != paths.end(); ++it)
-        *it += "/qtchooser/";
+// Reads what is available from one of the job's pipes
+static void readBatchJob(int *fd, string *output)
+{
+    char buf[65536];
+    ssize_t len = ::read(*fd, buf, sizeof buf);
+    if (len > 0) {
+        output->append(buf, len);
+    } else if (len == 0 || errno != EINTR) {
+        ::close(*fd);
+        *fd = -1;
+    }
+}
 
-    return paths;
+static void writeAll(int fd, string *data)
+{
+    size_t pos = 0;
+    while (pos < data->size()) {
+        ssize_t len = ::write(fd, data->data() + pos, data->size() - pos);
+        if (len > 0)
+            pos += len;
+        else if (errno != EINTR)
+            break;
+    }
+    data->clear();
 }
 
-Sdk ToolWrapper::iterateSdks(const string &targetSdk, VisitFunction visit, FinishFunction finish,
-                             const string &targetTool)
+// Runs the tool invocations listed in jobFile, one per line, up to jobCount
+// of them at a time. Each tool is resolved once for the whole batch. The
+// output of the jobs is passed on in the order of the file: a job's stdout
+// and stderr are held until the jobs before it have finished, then streamed.
+// Returns 1 if any job failed.
+int ToolWrapper::execBatch(const string &targetSdk, const string &jobFile, long jobCount)
 {
-    vector<string> paths = searchPaths();
-    set<string> seenNames;
-    Sdk sdk;
-    for (vector<string>::iterator it = paths.begin(); it != paths.end(); ++it) {
-        const string &path = *it;
+    if (jobFile.empty()) {
+        fprintf(stderr, "%s: missing option: job file\n", argv0);
+        return 1;
+    }
+    FILE *f = jobFile == "-" ? stdin : fopen(jobFile.c_str(), "r");
+    if (!f) {
+        fprintf(stderr, "%s: could not open job file '%s': %s\n", argv0, jobFile.c_str(), strerror(errno));
+        return 1;
+    }
 
-        // no ISO C++ or ISO C API for listing directories, so use POSIX
-        DIR *dir = opendir(path.c_str());
-        if (!dir)
-            continue;  // no such dir or not a dir, doesn't matter
+    vector<BatchJob> jobs;
+    bool valid = true;
+    char *line = 0;
+    size_t len = 0;
+    for (int lineNumber = 1; getline(&line, &len, f) >= 0; ++lineNumber) {
+        BatchJob job;
+        if (!splitJobLine(line, &job.args)) {
+            fprintf(stderr, "%s: %s:%d: unterminated quote\n", argv0, jobFile.c_str(), lineNumber);
+            valid = false;
+        } else if (!job.args.empty()) {
+            jobs.push_back(job);
+        }
+    }
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    if (!valid)
+        return 1;
 
-        while (struct dirent *d = readdir(dir)) {
-#ifdef _DIRENT_HAVE_D_TYPE
-            if (d->d_type == DT_DIR)
-                continue;
-#endif
+    // resolve each tool once, an empty path if that failed
+    map<string, string> tools;
+    for (vector<BatchJob>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        const string &name = it->args[0];
+        if (tools.find(name) != tools.end())
+            continue;
+        string &tool = tools[name];
+        Resolution resolution;
+        if (name.find('/') != string::npos)
+            fprintf(stderr, "%s: not a tool name: %s\n", argv0, name.c_str());
+        else if (!resolve(targetSdk, name, &resolution))
+            reportMissingSdk(targetSdk, resolution.sdk);
+        else if (!linksBackToSelf(resolution.tool.c_str(), argv0))
+            tool = resolution.tool;
+    }
 
-            size_t fnamelen = strlen(d->d_name);
-            if (fnamelen < sizeof(confSuffix))
-                continue;
-            if (memcmp(d->d_name + fnamelen + 1 - sizeof(confSuffix), confSuffix, sizeof confSuffix - 1) != 0)
+    JobServer jobServer;
+    const bool useJobServer = jobServer.open();
+    if (jobCount <= 0)
+        jobCount = useJobServer ? long(MaxBatchJobs) : max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+    size_t next = 0;        // the next job to start
+    size_t head = 0;        // the first job whose output is not all passed on
+    long running = 0;
+    unsigned long failed = 0;
+    vector<pollfd> fds;
+    vector<size_t> owners;
+    for (;;) {
+        // start jobs while there are slots; our own token covers the first
+        while (next < jobs.size() && running < jobCount) {
+            if (useJobServer && jobServer.tokens.size() < size_t(running) && !jobServer.acquire())
+                break;
+            BatchJob &job = jobs[next++];
+            startBatchJob(job, tools[job.args[0]]);
+            if (!job.finished)
+                ++running;
+        }
+        while (useJobServer && jobServer.tokens.size() > size_t(max(running - 1, 0L)))
+            jobServer.release();
+
+        // pass on the output in order
+        for ( ; head < next; ++head) {
+            BatchJob &job = jobs[head];
+            writeAll(STDOUT_FILENO, &job.out);
+            writeAll(STDERR_FILENO, &job.err);
+            if (!job.finished)
+                break;
+            if (job.status == 0)
                 continue;
+            ++failed;
+            if (WIFEXITED(job.status))
+                fprintf(stderr, "%s: job %lu (%s) exited with code %d\n", argv0,
+                        (unsigned long)(head + 1), job.args[0].c_str(), WEXITSTATUS(job.status));
+            else if (WIFSIGNALED(job.status))
+                fprintf(stderr, "%s: job %lu (%s) was killed by signal %d\n", argv0,
+                        (unsigned long)(head + 1), job.args[0].c_str(), WTERMSIG(job.status));
+        }
+        if (head == jobs.size())
+            break;
 
-            if (seenNames.find(d->d_name) != seenNames.end())
+        // wait for output, for the jobs that closed theirs to exit, or for a token
+        fds.clear();
+        owners.clear();
+        bool exiting = false;
+        for (size_t i = head; i < next; ++i) {
+            const BatchJob &job = jobs[i];
+            if (job.finished)
                 continue;
-
-            seenNames.insert(d->d_name);
-            if (targetTool.empty()) {
-                sdk.name = d->d_name;
-                sdk.name.resize(fnamelen + 1 - sizeof confSuffix);
-            } else {
-                // To make the check in matchSdk() succeed
-                sdk.name = "default";
-            }
-            sdk.configFile = path + PATH_SEP + d->d_name;
-            if (visit && visit(targetSdk, sdk)) {
-                // If a tool was requested, but not found here, skip this sdk
-                if (!targetTool.empty() && !sdk.hasTool(targetTool))
+            const int jobFds[] = { job.outFd, job.errFd };
+            for (int j = 0; j < 2; ++j) {
+                if (jobFds[j] == -1)
                     continue;
-                return sdk;
+                pollfd pfd = { jobFds[j], POLLIN, 0 };
+                fds.push_back(pfd);
+                owners.push_back(i);
             }
+            exiting = exiting || (job.outFd == -1 && job.errFd == -1);
+        }
+        if (useJobServer && next < jobs.size() && running < jobCount) {
+            pollfd pfd = { jobServer.readFd, POLLIN, 0 };
+            fds.push_back(pfd);
+            owners.push_back(jobs.size());
+        }
+        if (poll(fds.empty() ? 0 : &fds[0], fds.size(), exiting ? 10 : -1) == -1 && errno != EINTR) {
+            fprintf(stderr, "%s: poll: %s\n", argv0, strerror(errno));
+            return 1;
         }
 
-        closedir(dir);
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (!fds[i].revents || owners[i] == jobs.size())
+                continue;
+            BatchJob &job = jobs[owners[i]];
+            if (fds[i].fd == job.outFd)
+                readBatchJob(&job.outFd, &job.out);
+            else
+                readBatchJob(&job.errFd, &job.err);
+        }
+        for (size_t i = head; i < next; ++i) {
+            BatchJob &job = jobs[i];
+            if (job.finished || job.outFd != -1 || job.errFd != -1)
+                continue;
+            if (waitpid(job.pid, &job.status, WNOHANG) > 0) {
+                job.finished = true;
+                --running;
+                if (traceFile)
+                    traceEvent(job.args[0].c_str(), 'X', job.start, traceTimestamp(), tools[job.args[0]].c_str());
+            }
+        }
     }
 
-    if (finish)
-        finish(seenNames);
-
-    return Sdk();
+    if (failed)
+        fprintf(stderr, "%s: %lu of %lu jobs failed\n", argv0, failed, (unsigned long)jobs.size());
+    return failed ? 1 : 0;
 }
 
-// All tools that exist for only one Qt version should be
-// here. Other tools in this list are qdbus and qmlscene.
-bool fallbackAllowed(const string &tool)
+// The result of checking one SDK for -list-versions -verbose
+struct SdkHealth
+{
+    Sdk sdk;
+    vector<string> tools;           // known tools that are present and executable
+    vector<string> problems;
+};
+
+struct HealthQueue
+{
+    pthread_mutex_t mutex;
+    vector<SdkHealth> *results;
+    size_t next;
+    string home;
+};
+
+static bool isDirectory(const string &path)
 {
-    return tool == "qdbus" ||
-           tool == "qml" ||
-           tool == "qmlimportscanner" ||
-           tool == "qmlscene" ||
-           tool == "qtdiag" ||
-           tool == "qtpaths" ||
-           tool == "qtplugininfo";
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
 }
 
-Sdk ToolWrapper::selectSdk(const string &targetSdk, const string &targetTool)
+static void checkSdk(SdkHealth &health, const string &home)
 {
-    // First, try the requested SDK
-    Sdk matchedSdk = iterateSdks(targetSdk, &ToolWrapper::matchSdk);
-    if (targetSdk.empty() && !matchedSdk.hasTool(targetTool) && fallbackAllowed(targetTool)) {
-        // If a tool was requested, fall back to any SDK that has it
-        matchedSdk = iterateSdks(string(), &ToolWrapper::matchSdk, 0, targetTool);
+    Sdk &sdk = health.sdk;
+    if (sdk.state == Unparsed && !readConfigFile(sdk)) {
+        health.problems.push_back(string("unreadable: ") + strerror(sdk.error));
+        return;
     }
-    if (!matchedSdk.isValid()) {
-        fprintf(stderr, "%s: could not find a Qt installation of '%s'\n", argv0, targetSdk.c_str());
+    if (sdk.state == Malformed) {
+        health.problems.push_back("malformed");
+        return;
+    }
+
+    string toolsPath = sdk.toolsPath;
+    string librariesPath = sdk.librariesPath;
+    if (!toolsPath.empty() && toolsPath[0] == '~')
+        toolsPath = home + toolsPath.substr(1);
+    if (!librariesPath.empty() && librariesPath[0] == '~')
+        librariesPath = home + librariesPath.substr(1);
+    if (!isDirectory(librariesPath))
+        health.problems.push_back("no lib dir");
+
+    // list the bin dir once and stat only the known tools in it, which is
+    // much cheaper on network filesystems than trying each of them
+    DIR *dir = toolsPath.empty() ? 0 : opendir(toolsPath.c_str());
+    if (!dir) {
+        health.problems.push_back("no bin dir");
+        return;
+    }
+    set<string> entries;
+    while (struct dirent *d = readdir(dir))
+        entries.insert(d->d_name);
+    closedir(dir);
+
+    string notExecutable;
+    for (const char *const *tool = knownTools; *tool; ++tool) {
+        if (!entries.count(*tool))
+            continue;
+        struct stat st;
+        const string path = toolsPath + PATH_SEP + *tool;
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IXUSR))
+            health.tools.push_back(*tool);
+        else
+            notExecutable += string(notExecutable.empty() ? "" : ",") + *tool;
     }
-    return matchedSdk;
+    if (!notExecutable.empty())
+        health.problems.push_back("not executable: " + notExecutable);
+    if (find(health.tools.begin(), health.tools.end(), string("qmake")) == health.tools.end())
+        health.problems.push_back("no qmake");
 }
 
-void ToolWrapper::printSdks(const set<string> &seenNames)
+static void *healthThread(void *arg)
 {
-    vector<string> sorted;
-    copy(seenNames.begin(), seenNames.end(), back_inserter(sorted));
-    sort(sorted.begin(), sorted.end());
-    vector<string>::const_iterator it = sorted.begin();
-    for ( ; it != sorted.end(); ++it) {
-        // strip the .conf suffix
-        string s = *it;
-        s.resize(s.size() - sizeof confSuffix + 1);
-        printf("%s\n", s.c_str());
+    HealthQueue *queue = static_cast<HealthQueue *>(arg);
+    while (true) {
+        pthread_mutex_lock(&queue->mutex);
+        size_t i = queue->next++;
+        pthread_mutex_unlock(&queue->mutex);
+        if (i >= queue->results->size())
+            return 0;
+        checkSdk(queue->results->at(i), queue->home);
     }
 }
 
-bool ToolWrapper::matchSdk(const string &targetSdk, Sdk &sdk)
+static string jsonQuote(const string &value)
 {
-    if (targetSdk == sdk.name || (targetSdk.empty() && sdk.name == "default")) {
-        FILE *f = fopen(sdk.configFile.c_str(), "r");
-        if (!f) {
-            fprintf(stderr, "%s: could not open config file '%s': %s\n",
-                    argv0, sdk.configFile.c_str(), strerror(errno));
-            exit(1);
+    string result = "\"";
+    for (size_t i = 0; i < value.size(); ++i) {
+        unsigned char c = value[i];
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (c < 0x20) {
+            char buf[sizeof "\\u0000"];
+            snprintf(buf, sizeof buf, "\\u%04x", c);
+            result += buf;
+        } else {
+            result += c;
         }
+    }
+    return result + '"';
+}
 
-        // read the first two lines.
-        // 1) the first line contains the path to the Qt tools like qmake
-        // 2) the second line contains the path to the Qt libraries
-        // further lines are reserved for future enhancement
-        if (!readLine(f, &sdk.toolsPath) || !readLine(f, &sdk.librariesPath)) {
-            fclose(f);
-            return false;
-        }
+static string jsonList(const vector<string> &values)
+{
+    string result = "[";
+    for (size_t i = 0; i < values.size(); ++i)
+        result += (i ? ", " : "") + jsonQuote(values[i]);
+    return result + ']';
+}
 
-        fclose(f);
-        return true;
+static bool sdkHealthLessThan(const SdkHealth &a, const SdkHealth &b)
+{
+    return a.sdk.name < b.sdk.name;
+}
+
+// Checks every visible SDK on a pool of threads: that its config file can be
+// parsed, that its bin and lib dirs exist and which of the known tools its
+// bin dir has. Returns 1 if any problem was found.
+int ToolWrapper::listVersionsVerbose(bool json)
+{
+    const vector<Sdk> sdks = allSdks();
+    vector<SdkHealth> results(sdks.size());
+    for (size_t i = 0; i < sdks.size(); ++i)
+        results[i].sdk = sdks[i];
+
+    HealthQueue queue;
+    pthread_mutex_init(&queue.mutex, 0);
+    queue.results = &results;
+    queue.next = 0;
+    // getpwuid() isn't thread-safe, so look the home dir up front
+    queue.home = userHome();
+
+    // the checks mostly wait for the filesystem, so use more threads than CPUs
+    long threadCount = min(long(sdks.size()), max(2L, min(sysconf(_SC_NPROCESSORS_ONLN) * 4, 64L)));
+    vector<pthread_t> threads;
+    for (long i = 0; i < threadCount; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, healthThread, &queue) == 0)
+            threads.push_back(thread);
+    }
+    healthThread(&queue);
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], 0);
+    pthread_mutex_destroy(&queue.mutex);
+
+    sort(results.begin(), results.end(), sdkHealthLessThan);
+    int nameWidth = strlen("SDK"), toolsWidth = strlen("BIN DIR"), librariesWidth = strlen("LIB DIR");
+    for (size_t i = 0; i < results.size(); ++i) {
+        nameWidth = max(nameWidth, int(results[i].sdk.name.size()));
+        toolsWidth = max(toolsWidth, int(results[i].sdk.toolsPath.size()));
+        librariesWidth = max(librariesWidth, int(results[i].sdk.librariesPath.size()));
     }
 
-    return false;
+    bool healthy = true;
+    if (json)
+        puts("[");
+    else
+        printf("%-*s %5s  %-*s  %-*s  %s\n", nameWidth, "SDK", "TOOLS", toolsWidth, "BIN DIR",
+               librariesWidth, "LIB DIR", "STATUS");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const SdkHealth &health = results[i];
+        healthy = healthy && health.problems.empty();
+        if (json) {
+            printf("  {\"name\": %s, \"config\": %s, \"bin\": %s, \"lib\": %s,\n"
+                   "   \"tools\": %s,\n"
+                   "   \"problems\": %s}%s\n",
+                   jsonQuote(health.sdk.name).c_str(), jsonQuote(health.sdk.configFile).c_str(),
+                   jsonQuote(health.sdk.toolsPath).c_str(), jsonQuote(health.sdk.librariesPath).c_str(),
+                   jsonList(health.tools).c_str(), jsonList(health.problems).c_str(),
+                   i + 1 < results.size() ? "," : "");
+        } else {
+            string status;
+            for (size_t j = 0; j < health.problems.size(); ++j)
+                status += (j ? "; " : "") + health.problems[j];
+            printf("%-*s %5u  %-*s  %-*s  %s\n", nameWidth, health.sdk.name.c_str(),
+                   unsigned(health.tools.size()), toolsWidth, health.sdk.toolsPath.c_str(),
+                   librariesWidth, health.sdk.librariesPath.c_str(), status.empty() ? "ok" : status.c_str());
+        }
+    }
+    if (json)
+        puts("]");
+    return healthy ? 0 : 1;
 }
 
+#ifdef QTCHOOSER_TEST_MODE
+// defined by test/libmalloccount.so when the test preloads it
+extern "C" void qtchooser_malloc_count_reset() __attribute__((weak));
+#endif
+
 int main(int argc, char **argv)
 {
+#ifdef QTCHOOSER_TEST_MODE
+    if (qtchooser_malloc_count_reset)
+        qtchooser_malloc_count_reset();
+#endif
+
     // search the environment for defaults
     Mode operatingMode = Unknown;
     argv0 = basename(argv[0]);
+    statsFile = getenv("QTCHOOSER_STATS");
+    if (statsFile && !*statsFile)
+        statsFile = 0;
+    traceFile = getenv("QTCHOOSER_TRACE");
+    if (traceFile && *traceFile) {
+        traceStart = traceTimestamp();
+        atexit(traceFinish);
+    } else {
+        traceFile = 0;
+    }
     const char *targetSdk = getenv("QT_SELECT");
 
     // the default tool is the one in argv[0]
@@ -648,9 +2368,7 @@ int main(int argc, char **argv)
             fprintf(stderr, "%s: no tool selected. Stop.\n", argv0);
             return 1;
         }
-        return wrapper.runTool(targetSdk,
-                               targetTool,
-                               argv + optind - 1);
+        return wrapper.runTool(targetSdk, targetTool, argv + optind - 1);
     }
 
     // running qtchooser itself
@@ -659,9 +2377,18 @@ int main(int argc, char **argv)
     int installOptions = 0;
     string sdkName;
     string qmakePath;
+    string targetDir;
+    bool prometheus = false;
+    vector<string> roots;
+    string shell;
+    bool verbose = false;
+    bool json = false;
+    long jobCount = 0;
     for ( ; optind < argc; ++optind) {
         char *arg = argv[optind];
-        if (*arg == '-') {
+        // "-" is a file name for -exec-batch, -export and -import, meaning stdin or stdout
+        if (*arg == '-' && (arg[1] || (operatingMode != ExecBatch && operatingMode != Export
+                                       && operatingMode != Import))) {
             ++arg;
             if (*arg == '-')
                 ++arg;
@@ -674,10 +2401,53 @@ int main(int argc, char **argv)
                 installOptions |= ForceOverwrite;
             } else if (strcmp(arg, "list-versions") == 0 || strcmp(arg, "l") == 0) {
                 operatingMode = ListVersions;
+            } else if (operatingMode == ListVersions && (strcmp(arg, "verbose") == 0 || strcmp(arg, "v") == 0)) {
+                verbose = true;
+            } else if (operatingMode == ListVersions && strcmp(arg, "json") == 0) {
+                json = verbose = true;
             } else if (operatingMode == Install && strcmp(arg, "local") == 0) {
                 installOptions |= LocalInstall;
             } else if (beginsWith(arg, "print-env")) {
                 operatingMode = PrintEnvironment;
+                if (arg[strlen("print-env")] == '=')
+                    shell = arg + strlen("print-env=");
+            } else if (strcmp(arg, "stats") == 0) {
+                operatingMode = Stats;
+            } else if (operatingMode == Stats && strcmp(arg, "prometheus") == 0) {
+                prometheus = true;
+            } else if (strcmp(arg, "materialize") == 0) {
+                operatingMode = Materialize;
+            } else if (strcmp(arg, "scan") == 0) {
+                operatingMode = Scan;
+            } else if (operatingMode == Scan && (strcmp(arg, "force") == 0 || strcmp(arg, "f") == 0)) {
+                installOptions |= ForceOverwrite;
+            } else if (operatingMode == Scan && strcmp(arg, "local") == 0) {
+                installOptions |= LocalInstall;
+            } else if (strcmp(arg, "export") == 0) {
+                operatingMode = Export;
+            } else if (strcmp(arg, "import") == 0) {
+                operatingMode = Import;
+            } else if (operatingMode == Import && (strcmp(arg, "force") == 0 || strcmp(arg, "f") == 0)) {
+                installOptions |= ForceOverwrite;
+            } else if (operatingMode == Import && strcmp(arg, "local") == 0) {
+                installOptions |= LocalInstall;
+            } else if (strcmp(arg, "compile") == 0) {
+                operatingMode = Compile;
+            } else if (strcmp(arg, "resolve-batch") == 0) {
+                operatingMode = ResolveBatch;
+            } else if (strcmp(arg, "output-cache-stats") == 0) {
+                operatingMode = OutputCacheStats;
+            } else if (strcmp(arg, "exec-batch") == 0) {
+                operatingMode = ExecBatch;
+            } else if (operatingMode == ExecBatch && *arg == 'j') {
+                // -j N or -jN
+                const char *value = arg[1] ? arg + 1 : optind + 1 < argc ? argv[++optind] : "";
+                char *end;
+                jobCount = strtol(value, &end, 10);
+                if (!*value || *end || jobCount < 1) {
+                    fprintf(stderr, "%s: invalid number of jobs: %s\n", argv0, value);
+                    return 1;
+                }
             } else if (strcmp(arg, "help") != 0) {
                 fprintf(stderr, "%s: unknown option: %s\n", argv0, arg - 1);
                 return 1;
@@ -692,6 +2462,43 @@ int main(int argc, char **argv)
             } else {
                 sdkName = strlen(arg) ? arg : "default";
             }
+        } else if (operatingMode == Stats) {
+            if (targetDir.size()) {
+                fprintf(stderr, "%s: stats mode takes at most one argument; unknown option: %s\n", argv0, arg);
+                return 1;
+            }
+            targetDir = arg;
+        } else if (operatingMode == Scan) {
+            roots.push_back(arg);
+        } else if (operatingMode == Export || operatingMode == Import) {
+            if (targetDir.size()) {
+                fprintf(stderr, "%s: %s mode takes exactly one argument; unknown option: %s\n", argv0,
+                        operatingMode == Export ? "export" : "import", arg);
+                return 1;
+            }
+            targetDir = arg;
+        } else if (operatingMode == Compile) {
+            if (targetDir.size()) {
+                fprintf(stderr, "%s: compile mode takes exactly one argument; unknown option: %s\n", argv0, arg);
+                return 1;
+            }
+            targetDir = arg;
+        } else if (operatingMode == ExecBatch) {
+            if (targetDir.size()) {
+                fprintf(stderr, "%s: exec-batch mode takes exactly one argument; unknown option: %s\n", argv0, arg);
+                return 1;
+            }
+            targetDir = arg;
+        } else if (operatingMode == Materialize) {
+            if (targetDir.size()) {
+                fprintf(stderr, "%s: materialize mode takes exactly two arguments; unknown option: %s\n", argv0, arg);
+                return 1;
+            }
+            if (sdkName.size()) {
+                targetDir = arg;
+            } else {
+                sdkName = strlen(arg) ? arg : "default";
+            }
         } else {
             fprintf(stderr, "%s: unknown argument: %s\n", argv0, arg);
             return 1;
@@ -710,12 +2517,39 @@ int main(int argc, char **argv)
         return wrapper.printHelp();
 
     case PrintEnvironment:
-        return wrapper.printEnvironment(targetSdk);
+        return wrapper.printEnvironment(*targetSdk ? string(targetSdk) : projectSdk(), shell);
 
     case ListVersions:
-        return wrapper.listVersions();
+        return verbose ? wrapper.listVersionsVerbose(json) : wrapper.listVersions();
 
     case Install:
         return wrapper.install(sdkName, qmakePath, installOptions);
+
+    case ResolveBatch:
+        return wrapper.resolveBatch();
+
+    case Materialize:
+        return wrapper.materialize(sdkName, targetDir);
+
+    case Scan:
+        return wrapper.scan(roots, installOptions);
+
+    case Export:
+        return wrapper.exportManifest(targetDir);
+
+    case Import:
+        return wrapper.importManifest(targetDir, installOptions);
+
+    case Compile:
+        return wrapper.compile(targetDir);
+
+    case ExecBatch:
+        return wrapper.execBatch(*targetSdk ? string(targetSdk) : projectSdk(), targetDir, jobCount);
+
+    case OutputCacheStats:
+        return printOutputCacheStats();
+
+    case Stats:
+        return wrapper.printStats(targetDir.empty() && statsFile ? string(statsFile) : targetDir, prometheus);
     }
 }
@@ -0,0 +1,134 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Intel Corporation.
+** Contact: http://www.qt-project.org/legal
+**
+** This file is part of the Qt tool chooser of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and Digia.  For licensing terms and
+** conditions see http://qt.digia.com/licensing.  For further information
+** use the contact form at http://qt.digia.com/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** In addition, as a special exception, Digia gives you certain additional
+** rights.  These rights are described in the Digia Qt LGPL Exception
+** version 1.1, included in the file LGPL_EXCEPTION.txt in this package.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+/*
+ * Counts the heap allocations of a program, for the test that running a tool
+ * the caches can answer allocates no memory. It is loaded with LD_PRELOAD
+ * into test/qtchooser, which calls qtchooser_malloc_count_reset() at the
+ * start of main(), so allocations made while loading the program don't
+ * count. The count is written on exit to the file named by
+ * QTCHOOSER_MALLOC_COUNT.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* glibc's allocator, under the names that it exports for this purpose */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static int counting;
+static unsigned long count;
+
+__attribute__((visibility("default"))) void qtchooser_malloc_count_reset(void)
+{
+    __sync_lock_test_and_set(&count, 0);
+    counting = 1;
+}
+
+static void countAllocation(void)
+{
+    if (counting)
+        __sync_fetch_and_add(&count, 1);
+}
+
+void *malloc(size_t size)
+{
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    countAllocation();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    countAllocation();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    countAllocation();
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+__attribute__((destructor)) static void writeCount(void)
+{
+    const char *fileName = getenv("QTCHOOSER_MALLOC_COUNT");
+    char buf[32];
+    int fd, len;
+    if (!fileName || !counting)
+        return;
+
+    counting = 0;
+    len = snprintf(buf, sizeof buf, "%lu\n", count);
+    fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        return;
+    if (write(fd, buf, len) != len)
+        fprintf(stderr, "malloccount: error writing to '%s': %s\n", fileName, strerror(errno));
+    close(fd);
+}
@@ -0,0 +1,801 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Intel Corporation.
+** Contact: http://www.qt-project.org/legal
+**
+** This file is part of the QtCore module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and Digia.  For licensing terms and
+** conditions see http://qt.digia.com/licensing.  For further information
+** use the contact form at http://qt.digia.com/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** In addition, as a special exception, Digia gives you certain additional
+** rights.  These rights are described in the Digia Qt LGPL Exception
+** version 1.1, included in the file LGPL_EXCEPTION.txt in this package.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+/*
+ * The output cache lets the wrapper answer a run of moc, uic or rcc from an
+ * earlier run with the same inputs, like ccache does for compilers. It is
+ * enabled by setting QTCHOOSER_OUTPUT_CACHE.
+ *
+ * An entry's key is a SHA-256 hash of the tool binary, of the working
+ * directory and the arguments, and of the contents of the input files. For
+ * moc, those include the headers that the input includes, found next to it
+ * or in the -I directories; headers in the SDK's headers directory and
+ * those of the system are assumed to only change together with the tool
+ * binary. Only runs using options we know the effect of are cached;
+ * anything else, such as writing a dependency file, runs the tool as usual.
+ *
+ * An entry is one file holding the output and the standard error of a
+ * successful run. Entries are written atomically, their mtime records their
+ * last use, and the least recently used ones are evicted when the cache
+ * grows beyond QTCHOOSER_OUTPUT_CACHE_SIZE. The counters in the "stats" file
+ * are updated under a lock, for -output-cache-stats.
+ */
+
+#include "qtchooser_p.h"
+
+#include <sys/time.h>
+
+#if !defined(_WIN32) && !defined(__WIN32__)
+extern char **environ;
+#endif
+
+namespace QtChooser {
+
+static const char entryMagic[] = "qtchooser-output 1";
+static const unsigned long long defaultCacheSize = 1024 * 1024 * 1024;
+enum { MaxScannedHeaders = 1024 };
+
+// SHA-256, as specified in FIPS 180-4
+class Sha256
+{
+public:
+    Sha256();
+    void add(const void *data, size_t len);
+    // adds a string with its terminating NUL, to separate it from the next
+    void add(const string &s) { add(s.c_str(), s.size() + 1); }
+    string hexDigest();
+
+private:
+    void block(const unsigned char *p);
+
+    uint32_t h[8];
+    unsigned char buffer[64];
+    size_t used;
+    uint64_t length;
+};
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256()
+    : used(0), length(0)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(h, initial, sizeof h);
+}
+
+void Sha256::block(const unsigned char *p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+        w[i] = uint32_t(p[4 * i]) << 24 | uint32_t(p[4 * i + 1]) << 16 | uint32_t(p[4 * i + 2]) << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = k + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+void Sha256::add(const void *data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    length += len;
+    if (used) {
+        size_t n = min(len, sizeof buffer - used);
+        memcpy(buffer + used, p, n);
+        used += n;
+        p += n;
+        len -= n;
+        if (used < sizeof buffer)
+            return;
+        block(buffer);
+        used = 0;
+    }
+    for ( ; len >= sizeof buffer; p += sizeof buffer, len -= sizeof buffer)
+        block(p);
+    memcpy(buffer, p, len);
+    used = len;
+}
+
+string Sha256::hexDigest()
+{
+    const uint64_t bits = length * 8;
+    unsigned char padding[72] = { 0x80 };
+    size_t padLen = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; ++i)
+        padding[padLen + i] = (unsigned char)(bits >> (56 - 8 * i));
+    add(padding, padLen + 8);
+
+    char hex[65];
+    for (int i = 0; i < 8; ++i)
+        snprintf(hex + 8 * i, 9, "%08x", h[i]);
+    return string(hex, 64);
+}
+
+// The tools whose output is cached, with the options they take. A run using
+// an option not listed here or a response file is not cached, since it may
+// have inputs or outputs that the key would miss.
+struct CacheableTool
+{
+    const char *name;
+    const char *valueOptions;   // taking a value, each surrounded by spaces
+    const char *flagOptions;
+};
+
+static const CacheableTool cacheableTools[] = {
+    { "moc", " o I F D U M p b f include compiler-flavor ",
+      " i E nn nw no-notes no-warnings ignore-option-clashes " },
+    { "uic", " o output tr translate postfix include g generator c connections ",
+      " a no-autoconnection p no-protection n no-implicit-includes idbased from-imports star-imports rc-prefix " },
+    { "rcc", " o output t temp name root compress threshold compress-algo g generator pass format-version ",
+      " binary no-compress no-zstd namespace no-namespace " },
+};
+
+static const CacheableTool *findCacheableTool(const char *targetTool)
+{
+    for (size_t i = 0; i < sizeof cacheableTools / sizeof cacheableTools[0]; ++i) {
+        if (strcmp(targetTool, cacheableTools[i].name) == 0)
+            return &cacheableTools[i];
+    }
+    return 0;
+}
+
+static bool hasOption(const char *list, const string &option)
+{
+    return strstr(list, (' ' + option + ' ').c_str()) != 0;
+}
+
+// What a cacheable run reads and writes
+struct ToolRun
+{
+    vector<string> inputs;      // in the order they are hashed
+    vector<string> includePaths;
+    string output;              // the -o file, or empty for stdout
+    string temp;                // rcc's -temp file, which its second pass reads
+};
+
+// Parses the arguments of a run. Returns false if it can't be cached.
+static bool parseToolRun(const CacheableTool &tool, char **argv, ToolRun *run)
+{
+    for (char **arg = argv + 1; *arg; ++arg) {
+        const char *p = *arg;
+        if (*p == '@' || strcmp(p, "-") == 0)
+            return false;       // a response file or stdin
+        if (*p != '-') {
+            run->inputs.push_back(p);
+            continue;
+        }
+
+        // -name, --name, -name=value, -name value, or -Xvalue for the
+        // compiler-like options such as -I
+        const bool singleDash = p[1] != '-';
+        p += singleDash ? 1 : 2;
+        string name = p;
+        const char *value = 0;
+        if (singleDash && isupper((unsigned char)*p) && p[1] && hasOption(tool.valueOptions, name.substr(0, 1))) {
+            name.erase(1);
+            value = p + 1;
+        } else if (const char *eq = strchr(p, '=')) {
+            name.erase(eq - p);
+            value = eq + 1;
+        }
+        if (!value && hasOption(tool.flagOptions, name))
+            continue;
+        if (!hasOption(tool.valueOptions, name))
+            return false;
+        if (!value) {
+            if (!arg[1])
+                return false;
+            value = *++arg;
+        }
+
+        if (name == "o" || name == "output") {
+            run->output = value;
+        } else if (name == "I") {
+            run->includePaths.push_back(value);
+        } else if ((name == "t" || name == "temp") && strcmp(tool.name, "rcc") == 0) {
+            run->temp = value;
+        } else if (name == "include" && strcmp(tool.name, "moc") == 0) {
+            // parsed as if included by the input
+            run->inputs.push_back(value);
+        }
+    }
+    return !run->inputs.empty();
+}
+
+static bool isRegularFile(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static string dirName(const string &path)
+{
+    size_t slash = path.rfind('/');
+    return slash == string::npos ? string(".") : path.substr(0, slash + 1);
+}
+
+// Adds the headers that a moc input includes, recursively. Headers that
+// can't be found are left for moc to complain about.
+static void addIncludes(const string &fileName, const string &contents, const ToolRun &run,
+                        const vector<string> &ignoredPrefixes, set<string> *seen, vector<string> *headers)
+{
+    size_t pos = 0;
+    while ((pos = contents.find("include", pos + 1)) != string::npos) {
+        // only "#  include" at the start of a line
+        size_t hash = contents.find_last_not_of(" \t", pos - 1);
+        if (hash == string::npos || contents[hash] != '#')
+            continue;
+        size_t before = hash ? contents.find_last_not_of(" \t", hash - 1) : string::npos;
+        if (before != string::npos && contents[before] != '\n')
+            continue;
+        pos += strlen("include");
+        size_t open = contents.find_first_not_of(" \t", pos);
+        if (open == string::npos || (contents[open] != '"' && contents[open] != '<'))
+            continue;
+        size_t close = contents.find(contents[open] == '"' ? '"' : '>', open + 1);
+        if (close == string::npos || contents.find('\n', open) < close)
+            continue;
+        const string name = contents.substr(open + 1, close - open - 1);
+
+        vector<string> candidates;
+        if (contents[open] == '"')
+            candidates.push_back(dirName(fileName) + name);
+        for (vector<string>::const_iterator it = run.includePaths.begin(); it != run.includePaths.end(); ++it)
+            candidates.push_back(*it + '/' + name);
+        for (vector<string>::const_iterator it = candidates.begin(); it != candidates.end(); ++it) {
+            if (!isRegularFile(*it))
+                continue;
+            bool ignored = false;
+            for (size_t i = 0; i < ignoredPrefixes.size() && !ignored; ++i)
+                ignored = it->compare(0, ignoredPrefixes[i].size(), ignoredPrefixes[i]) == 0;
+            if (!ignored && seen->insert(*it).second)
+                headers->push_back(*it);
+            break;
+        }
+    }
+}
+
+// Returns the value of an XML attribute-free element's text, with the
+// predefined entities decoded
+static string xmlText(const string &text)
+{
+    static const char *const entities[][2] = {
+        { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" }, { "&amp;", "&" }
+    };
+    string result;
+    for (size_t i = 0; i < text.size(); ++i) {
+        size_t e = 0;
+        if (text[i] == '&') {
+            for ( ; e < sizeof entities / sizeof entities[0]; ++e) {
+                if (text.compare(i, strlen(entities[e][0]), entities[e][0]) == 0)
+                    break;
+            }
+        }
+        if (text[i] == '&' && e < sizeof entities / sizeof entities[0]) {
+            result += entities[e][1];
+            i += strlen(entities[e][0]) - 1;
+        } else {
+            result += text[i];
+        }
+    }
+    return result;
+}
+
+// Adds the files listed in an rcc input. Returns false if one can't be
+// hashed, such as a directory.
+static bool addResourceFiles(const string &fileName, const string &contents, vector<string> *files)
+{
+    size_t pos = 0;
+    while ((pos = contents.find("<file", pos)) != string::npos) {
+        pos += strlen("<file");
+        if (contents[pos] != '>' && contents[pos] != ' ' && contents[pos] != '\t')
+            continue;       // <files>, for instance
+        size_t start = contents.find('>', pos);
+        size_t end = contents.find("</file>", pos);
+        if (start == string::npos || end == string::npos || end < start)
+            return false;
+        string path = xmlText(contents.substr(start + 1, end - start - 1));
+        if (path.empty())
+            return false;
+        if (path[0] != '/')
+            path = dirName(fileName) + path;
+        if (!isRegularFile(path))
+            return false;
+        files->push_back(path);
+        pos = end;
+    }
+    return true;
+}
+
+static string cacheDir()
+{
+    const string dir = qgetenv("QTCHOOSER_OUTPUT_CACHE");
+    if (dir.empty() || dir[0] == '/')
+        return dir;
+    return qgetenv("XDG_CACHE_HOME", userHome() + PATH_SEP ".cache") + PATH_SEP "qtchooser" PATH_SEP "output";
+}
+
+static unsigned long long maximumCacheSize()
+{
+    const string value = qgetenv("QTCHOOSER_OUTPUT_CACHE_SIZE");
+    char *end;
+    unsigned long long size = strtoull(value.c_str(), &end, 10);
+    switch (*end) {
+    case 'G':
+        size *= 1024;
+        // fall through
+    case 'M':
+        size *= 1024;
+        // fall through
+    case 'K':
+        size *= 1024;
+        break;
+    }
+    return size ? size : defaultCacheSize;
+}
+
+// The hash of a tool binary, remembered until the binary changes
+static string toolHash(const string &dir, const string &tool)
+{
+    char name[sizeof "/tools/0123456789abcdef"];
+    snprintf(name, sizeof name, "/tools/%016llx", fnv1a(tool.c_str(), tool.size()));
+    const string fileName = dir + name;
+    const string stamp = fileStamp(tool);
+
+    string contents;
+    if (readSmallFile(fileName, &contents) && contents.size() == stamp.size() + 1 + 64 + 1
+            && contents.compare(0, stamp.size() + 1, stamp + '\n') == 0)
+        return contents.substr(stamp.size() + 1, 64);
+
+    string binary;
+    if (!readFile(tool, &binary))
+        return string();
+    Sha256 sha;
+    sha.add(binary.data(), binary.size());
+    const string hash = sha.hexDigest();
+    writeFileAtomically(fileName, stamp + '\n' + hash + '\n');
+    return hash;
+}
+
+// Returns the headers directory of the SDK, with a trailing slash, or an
+// empty string if its config file doesn't name one
+static string qtHeadersPath(const string &configFile)
+{
+    Sdk sdk;
+    sdk.configFile = configFile;
+    if (!readConfigFile(sdk) || sdk.state != Parsed || sdk.headersPath.empty())
+        return string();
+    string path = sdk.headersPath;
+    if (path[0] == '~')
+        path = userHome() + path.substr(1);
+    if (path[path.size() - 1] != '/')
+        path += '/';
+    return path;
+}
+
+// Computes the key of a run. Returns an empty string if it can't be cached.
+static string cacheKey(const string &dir, const string &targetTool, const string &tool,
+                       const string &configFile, char **argv, const ToolRun &run)
+{
+    TraceScope trace("outputCacheKey", tool.c_str());
+    const string binaryHash = toolHash(dir, tool);
+    char *cwd = getcwd(0, 0);
+    if (binaryHash.empty() || !cwd)
+        return string();
+
+    Sha256 sha;
+    sha.add(string(entryMagic));
+    sha.add(binaryHash);
+    sha.add(string(cwd));
+    free(cwd);
+    for (char **arg = argv + 1; *arg; ++arg)
+        sha.add(string(*arg));
+
+    // headers of the Qt version and of the system are not hashed. Only the
+    // SDK's own headers directory counts as the former, since the prefix of
+    // a Qt built from source or installed in /usr holds other headers too.
+    vector<string> ignoredPrefixes;
+    if (targetTool == "moc") {
+        const string qtHeaders = qtHeadersPath(configFile);
+        if (!qtHeaders.empty())
+            ignoredPrefixes.push_back(qtHeaders);
+    }
+    ignoredPrefixes.push_back("/usr/include/");
+
+    // the object file compiled from the first pass changes with the
+    // compiler flags, so it must exist and is hashed like an input
+    vector<string> files = run.inputs;
+    if (!run.temp.empty())
+        files.push_back(run.temp);
+    set<string> seen(files.begin(), files.end());
+    for (size_t i = 0; i < files.size(); ++i) {
+        string contents;
+        if (!isRegularFile(files[i]) || !readFile(files[i], &contents))
+            return string();
+        sha.add(files[i]);
+        sha.add(to_number(int(contents.size())));
+        sha.add(contents.data(), contents.size());
+
+        if (targetTool == "moc")
+            addIncludes(files[i], contents, run, ignoredPrefixes, &seen, &files);
+        else if (targetTool == "rcc" && i < run.inputs.size() && !addResourceFiles(files[i], contents, &files))
+            return string();
+        if (files.size() > MaxScannedHeaders)
+            return string();
+    }
+    return sha.hexDigest();
+}
+
+enum { StatHits, StatMisses, StatUncacheable, StatEntries, StatBytes, StatCount };
+static const char *const statNames[StatCount] = { "hits", "misses", "uncacheable", "entries", "bytes" };
+
+static void readStats(int fd, unsigned long long *stats)
+{
+    char buf[512];
+    ssize_t len = pread(fd, buf, sizeof buf - 1, 0);
+    buf[len > 0 ? len : 0] = '\0';
+    for (char *line = strtok(buf, "\n"); line; line = strtok(0, "\n")) {
+        char *space = strchr(line, ' ');
+        if (!space)
+            continue;
+        *space = '\0';
+        for (int i = 0; i < StatCount; ++i) {
+            if (strcmp(line, statNames[i]) == 0)
+                stats[i] = strtoull(space + 1, 0, 10);
+        }
+    }
+}
+
+static void writeStats(int fd, const unsigned long long *stats)
+{
+    string contents;
+    for (int i = 0; i < StatCount; ++i) {
+        char line[64];
+        snprintf(line, sizeof line, "%s %llu\n", statNames[i], stats[i]);
+        contents += line;
+    }
+    if (pwrite(fd, contents.data(), contents.size(), 0) == ssize_t(contents.size())
+            && ftruncate(fd, contents.size()) == 0)
+        return;
+}
+
+struct CacheEntry
+{
+    time_t lastUse;
+    off_t size;
+    string path;
+    bool operator<(const CacheEntry &other) const { return lastUse < other.lastUse; }
+};
+
+// Removes the least recently used entries until the cache is back to 90% of
+// its maximum size, and counts what remains
+static void evict(const string &dir, unsigned long long maximum, unsigned long long *stats)
+{
+    TraceScope trace("outputCacheEvict", dir.c_str());
+    vector<CacheEntry> entries;
+    for (int i = 0; i < 256; ++i) {
+        char sub[4];
+        snprintf(sub, sizeof sub, "/%02x", i);
+        const string subdir = dir + sub;
+        DIR *d = opendir(subdir.c_str());
+        if (!d)
+            continue;
+        while (struct dirent *ent = readdir(d)) {
+            CacheEntry entry;
+            entry.path = subdir + '/' + ent->d_name;
+            struct stat st;
+            if (strlen(ent->d_name) != 64 || stat(entry.path.c_str(), &st) != 0)
+                continue;   // ".", "..", or someone's temporary file
+            entry.lastUse = st.st_mtime;
+            entry.size = st.st_size;
+            entries.push_back(entry);
+        }
+        closedir(d);
+    }
+
+    sort(entries.begin(), entries.end());
+    unsigned long long bytes = 0;
+    for (vector<CacheEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        bytes += it->size;
+    size_t removed = 0;
+    for ( ; removed < entries.size() && bytes > maximum / 10 * 9; ++removed) {
+        unlink(entries[removed].path.c_str());
+        bytes -= entries[removed].size;
+    }
+    stats[StatEntries] = entries.size() - removed;
+    stats[StatBytes] = bytes;
+}
+
+// Updates the counters, and evicts entries if an entry of entrySize bytes
+// was added
+static void updateStats(const string &dir, int counter, off_t entrySize)
+{
+    const string fileName = dir + "/stats";
+    int fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd == -1 && errno == ENOENT && mkparentdir(fileName))
+        fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd == -1)
+        return;
+
+    struct flock lock;
+    memset(&lock, 0, sizeof lock);
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &lock) == -1 && errno == EINTR)
+        ;
+
+    unsigned long long stats[StatCount] = { 0 };
+    readStats(fd, stats);
+    ++stats[counter];
+    if (entrySize) {
+        ++stats[StatEntries];
+        stats[StatBytes] += entrySize;
+        const unsigned long long maximum = maximumCacheSize();
+        if (stats[StatBytes] > maximum)
+            evict(dir, maximum, stats);
+    }
+    writeStats(fd, stats);
+    ::close(fd);    // releases the lock
+}
+
+static bool writeAll(int fd, const char *data, size_t size)
+{
+    while (size) {
+        ssize_t len = ::write(fd, data, size);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return false;
+        data += len;
+        size -= len;
+    }
+    return true;
+}
+
+// Writes the outputs recorded in an entry as if the tool had run
+static bool replayEntry(const string &contents, const ToolRun &run)
+{
+    unsigned long outSize, errSize;
+    int headerSize = 0;
+    if (sscanf(contents.c_str(), "qtchooser-output 1 %lu %lu\n%n", &outSize, &errSize, &headerSize) != 2
+            || headerSize == 0 || contents.size() != headerSize + outSize + errSize)
+        return false;
+
+    const string out = contents.substr(headerSize, outSize);
+    if (run.output.empty() ? !writeAll(STDOUT_FILENO, out.data(), out.size())
+                           : !writeFileAtomically(run.output, out))
+        return false;
+    writeAll(STDERR_FILENO, contents.data() + headerSize + outSize, errSize);
+    return true;
+}
+
+// Runs the tool, passing its stdout and stderr on as they come and keeping a
+// copy. Returns its exit status as from waitpid, or -1 if it couldn't start.
+static int spawnAndCapture(const string &tool, char **argv, bool captureStdout, string *out, string *err)
+{
+    int outPipe[2] = { -1, -1 }, errPipe[2];
+    if (pipe(errPipe) != 0 || (captureStdout && pipe(outPipe) != 0))
+        return -1;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, errPipe[1], STDERR_FILENO);
+    posix_spawn_file_actions_addclose(&actions, errPipe[0]);
+    posix_spawn_file_actions_addclose(&actions, errPipe[1]);
+    if (captureStdout) {
+        posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, outPipe[0]);
+        posix_spawn_file_actions_addclose(&actions, outPipe[1]);
+    }
+    pid_t pid;
+    int error = posix_spawn(&pid, tool.c_str(), &actions, 0, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(errPipe[1]);
+    if (captureStdout)
+        ::close(outPipe[1]);
+    if (error != 0) {
+        ::close(errPipe[0]);
+        if (captureStdout)
+            ::close(outPipe[0]);
+        errno = error;
+        return -1;
+    }
+
+    pollfd fds[2] = { { errPipe[0], POLLIN, 0 }, { outPipe[0], POLLIN, 0 } };
+    string *buffers[2] = { err, out };
+    const int outFds[2] = { STDERR_FILENO, STDOUT_FILENO };
+    int openPipes = captureStdout ? 2 : 1;
+    while (openPipes) {
+        if (poll(fds, captureStdout ? 2 : 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i].fd == -1 || !fds[i].revents)
+                continue;
+            char buf[65536];
+            ssize_t len = ::read(fds[i].fd, buf, sizeof buf);
+            if (len > 0) {
+                buffers[i]->append(buf, len);
+                writeAll(outFds[i], buf, len);
+            } else if (len == 0 || errno != EINTR) {
+                ::close(fds[i].fd);
+                fds[i].fd = -1;
+                --openPipes;
+            }
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (fds[i].fd != -1)
+            ::close(fds[i].fd);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return status;
+}
+
+bool outputCacheEnabled(const char *targetTool)
+{
+    // without allocating, as runTool asks before every exec
+    const char *dir = getenv("QTCHOOSER_OUTPUT_CACHE");
+    return dir && *dir && findCacheableTool(targetTool);
+}
+
+// Answers a run of the tool with the arguments in argv from the cache, or
+// runs command, which is argv unless the tool is started by its loader, and
+// caches the outputs. configFile is that of the SDK the tool belongs to.
+bool runToolCached(const string &targetTool, const string &tool, const string &configFile, char **argv,
+                   char **command, int *exitCode)
+{
+    TraceScope trace("outputCache", tool.c_str());
+    const CacheableTool *cacheable = findCacheableTool(targetTool.c_str());
+    const string dir = cacheDir();
+    ToolRun run;
+    string key;
+    if (cacheable && parseToolRun(*cacheable, argv, &run))
+        key = cacheKey(dir, targetTool, tool, configFile, argv, run);
+    if (key.empty()) {
+        updateStats(dir, StatUncacheable, 0);
+        return false;
+    }
+
+    const string entryName = dir + '/' + key.substr(0, 2) + '/' + key;
+    string contents;
+    if (readFile(entryName, &contents) && replayEntry(contents, run)) {
+        utimes(entryName.c_str(), 0);   // for the LRU eviction
+        updateStats(dir, StatHits, 0);
+        *exitCode = 0;
+        return true;
+    }
+
+    string out, err;
+    const int status = spawnAndCapture(command[0], command, run.output.empty(), &out, &err);
+    if (status == -1)
+        return false;       // let the caller try and report the error
+    if (WIFSIGNALED(status)) {
+        *exitCode = 128 + WTERMSIG(status);
+        return true;
+    }
+    *exitCode = WEXITSTATUS(status);
+
+    // only successful runs are cached
+    off_t entrySize = 0;
+    if (*exitCode == 0 && (run.output.empty() || readFile(run.output, &out))) {
+        char header[64];
+        snprintf(header, sizeof header, "%s %lu %lu\n", entryMagic,
+                 (unsigned long)out.size(), (unsigned long)err.size());
+        contents = header + out + err;
+        if (writeFileAtomically(entryName, contents))
+            entrySize = contents.size();
+    }
+    updateStats(dir, StatMisses, entrySize);
+    return true;
+}
+
+int printOutputCacheStats()
+{
+    const string dir = cacheDir().empty()
+            ? qgetenv("XDG_CACHE_HOME", userHome() + PATH_SEP ".cache") + PATH_SEP "qtchooser" PATH_SEP "output"
+            : cacheDir();
+    unsigned long long stats[StatCount] = { 0 };
+    int fd = ::open((dir + "/stats").c_str(), O_RDONLY);
+    if (fd != -1) {
+        readStats(fd, stats);
+        ::close(fd);
+    }
+
+    const unsigned long long lookups = stats[StatHits] + stats[StatMisses];
+    printf("cache directory: %s%s\n", dir.c_str(),
+           qgetenv("QTCHOOSER_OUTPUT_CACHE").empty() ? " (disabled)" : "");
+    printf("hits:            %llu (%.1f%%)\n", stats[StatHits],
+           lookups ? 100.0 * stats[StatHits] / lookups : 0.0);
+    printf("misses:          %llu\n", stats[StatMisses]);
+    printf("uncacheable:     %llu\n", stats[StatUncacheable]);
+    printf("entries:         %llu\n", stats[StatEntries]);
+    printf("size:            %.1f of %.1f MB\n", stats[StatBytes] / 1048576.0,
+           maximumCacheSize() / 1048576.0);
+    return 0;
+}
+
+} // namespace QtChooser
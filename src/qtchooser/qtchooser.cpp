@@ -0,0 +1,1891 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Intel Corporation.
+** Contact: http://www.qt-project.org/legal
+**
+** This file is part of the QtCore module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and Digia.  For licensing terms and
+** conditions see http://qt.digia.com/licensing.  For further information
+** use the contact form at http://qt.digia.com/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** In addition, as a special exception, Digia gives you certain additional
+** rights.  These rights are described in the Digia Qt LGPL Exception
+** version 1.1, included in the file LGPL_EXCEPTION.txt in this package.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qtchooser_p.h"
+#include "qtchooser.h"
+
+/*
+ * The resolution logic of qtchooser: searching the config directories,
+ * parsing config files, selecting an SDK and the caches that make that fast.
+ * It is built as libqtchooser, which the qtchooser executable links to and
+ * other programs use through the C API in qtchooser.h. Nothing in here may
+ * print, exit or keep state that isn't safe to share between threads.
+ */
+
+// O_TMPFILE is only declared with _GNU_SOURCE
+#if defined(__linux__) && !defined(O_TMPFILE) && defined(__O_TMPFILE)
+#  define O_TMPFILE __O_TMPFILE
+#endif
+
+namespace QtChooser {
+
+// set by the executable only; the library never traces on its own
+const char *traceFile;
+static char traceBuffer[16384];
+static size_t traceUsed;
+
+double traceTimestamp()
+{
+    // CLOCK_MONOTONIC is shared by all processes, so parallel jobs line up
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void traceFlush()
+{
+    if (!traceFile || !traceUsed)
+        return;
+
+    int fd = ::open(traceFile, O_WRONLY | O_APPEND);
+    if (fd == -1 && errno == ENOENT) {
+        // the file must start with '[': create it with that contents under a
+        // temporary name and link it into place, so that a concurrent job can
+        // never append before it
+        char tempName[PATH_MAX];
+        snprintf(tempName, sizeof tempName, "%s.%d", traceFile, int(getpid()));
+        int tmp = ::open(tempName, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (tmp != -1) {
+            bool ok = ::write(tmp, "[\n", 2) == 2;
+            ::close(tmp);
+            if (ok)
+                link(tempName, traceFile);
+            unlink(tempName);
+        }
+        fd = ::open(traceFile, O_WRONLY | O_APPEND);
+    }
+    if (fd != -1) {
+        if (::write(fd, traceBuffer, traceUsed) != ssize_t(traceUsed))
+            fprintf(stderr, "qtchooser: error writing to trace file '%s': %s\n", traceFile, strerror(errno));
+        ::close(fd);
+    }
+    traceUsed = 0;
+}
+
+void traceEvent(const char *name, char phase, double start, double end, const char *path)
+{
+    char event[PATH_MAX + 256];
+    int pid = getpid();
+    int len = snprintf(event, sizeof event,
+                       "{\"name\":\"%s\",\"cat\":\"qtchooser\",\"ph\":\"%c\",\"ts\":%.3f,",
+                       name, phase, start);
+    if (phase == 'X')
+        len += snprintf(event + len, sizeof event - len, "\"dur\":%.3f,", end - start);
+    len += snprintf(event + len, sizeof event - len, "\"pid\":%d,\"tid\":%d", pid, pid);
+
+    if (path) {
+        // JSON-escape the path; truncate it if it doesn't fit
+        len += snprintf(event + len, sizeof event - len, ",\"args\":{\"path\":\"");
+        for ( ; *path && len < int(sizeof event) - 16; ++path) {
+            unsigned char c = *path;
+            if (c == '"' || c == '\\')
+                event[len++] = '\\';
+            if (c < 0x20)
+                len += snprintf(event + len, sizeof event - len, "\\u%04x", c);
+            else
+                event[len++] = c;
+        }
+        len += snprintf(event + len, sizeof event - len, "\"}");
+    }
+    len += snprintf(event + len, sizeof event - len, "},\n");
+
+    // -scan and -list-versions -verbose record events from several threads
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mutex);
+    if (traceUsed + len > sizeof traceBuffer)
+        traceFlush();
+    memcpy(traceBuffer + traceUsed, event, len);
+    traceUsed += len;
+    pthread_mutex_unlock(&mutex);
+}
+
+bool Sdk::hasTool(const string &targetTool) const
+{
+    struct stat st;
+    if (toolsPath.empty())
+        return false;
+    const string path = toolsPath + PATH_SEP + targetTool;
+    TraceScope trace("hasTool", path.c_str());
+    if (stat(path.c_str(), &st))
+        return false;
+#ifdef S_IEXEC
+    return (st.st_mode & S_IEXEC);
+#endif
+    return true;
+}
+
+// Returns the user's home directory, which may be stored in buffer
+const char *userHome(char *buffer, size_t size)
+{
+    const char *value = getenv("HOME");
+    if (value)
+        return value;
+
+    TraceScope trace("userHome");
+#if defined(_WIN32) || defined(__WIN32__)
+    // ### FIXME: some Windows-specific code to get the user's home directory
+    // using GetUserProfileDirectory (userenv.h / dll)
+    return "C:";
+#else
+    struct passwd pw;
+    struct passwd *pwd = 0;
+    if (getpwuid_r(getuid(), &pw, buffer, size, &pwd) == 0 && pwd && pwd->pw_dir)
+        return pwd->pw_dir;
+    return "";
+#endif
+}
+
+string userHome()
+{
+    char buf[4096];
+    return userHome(buf, sizeof buf);
+}
+
+bool mkparentdir(string name)
+{
+    // create the dir containing this dir
+    size_t pos = name.rfind('/');
+    if (pos == string::npos)
+        return false;
+    name.erase(pos);
+    if (mkdir(name.c_str(), 0777) == -1) {
+        if (errno == EEXIST)
+            return true;    // someone else created it
+        if (errno != ENOENT)
+            return false;
+        // try this dir's parent too, then this dir again
+        if (!mkparentdir(name))
+            return false;
+        if (mkdir(name.c_str(), 0777) == -1 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+// Returns a string that changes whenever the file or directory is modified
+// or replaced: its modification time, size and inode number. Paths that do
+// not exist get the stamp "-".
+const char *fileStamp(const char *path, char *stamp)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return strcpy(stamp, "-");
+
+    long nsec = 0;
+#if defined(__linux__)
+    nsec = st.st_mtim.tv_nsec;
+#endif
+    snprintf(stamp, MaxStampLength, "%lld.%09ld:%lld:%llu", (long long)st.st_mtime, nsec,
+             (long long)st.st_size, (unsigned long long)st.st_ino);
+    return stamp;
+}
+
+string fileStamp(const string &path)
+{
+    char stamp[MaxStampLength];
+    return fileStamp(path.c_str(), stamp);
+}
+
+// Reads a file that fits in buffer. Returns its size, or -1 if it can't be
+// read or is larger than the buffer.
+ssize_t readSmallFile(const char *path, char *buffer, size_t size)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    ssize_t len = ::read(fd, buffer, size);
+    ::close(fd);
+    if (len == ssize_t(size))
+        return -1;
+    return len;
+}
+
+// Reads a file of up to 64 kB into contents. Returns false if it can't be
+// read or is larger than that.
+bool readSmallFile(const string &path, string *contents)
+{
+    char buf[65536];
+    ssize_t len = readSmallFile(path.c_str(), buf, sizeof buf);
+    if (len < 0)
+        return false;
+    contents->assign(buf, len);
+    return true;
+}
+
+// Reads a whole file of any size into contents.
+bool readFile(const string &path, string *contents)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    contents->resize(st.st_size);
+    size_t used = 0;
+    while (used < contents->size()) {
+        ssize_t len = ::read(fd, &(*contents)[used], contents->size() - used);
+        if (len <= 0)
+            break;
+        used += len;
+    }
+    ::close(fd);
+    contents->resize(used);
+    return used == size_t(st.st_size);
+}
+
+unsigned long long fnv1a(const char *data, size_t len, unsigned long long hash)
+{
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+string to_number(int number)
+{
+    char buffer[sizeof "-2147483648"];
+    snprintf(buffer, sizeof buffer, "%d", number);
+    return buffer;
+}
+
+#if defined(_WIN32) || defined(__WIN32__)
+static const char listSeparator = ';';
+#else
+static const char listSeparator = ':';
+#endif
+
+vector<string> stringSplit(const char *source)
+{
+    vector<string> result;
+    if (!*source)
+        return result;
+
+    while (true) {
+        const char *p = strchr(source, listSeparator);
+        if (!p) {
+            result.push_back(source);
+            return result;
+        }
+
+        result.push_back(string(source, p - source));
+        source = p + 1;
+    }
+    return result;
+}
+
+string qgetenv(const char *env, const string &defaultValue)
+{
+    const char *value = getenv(env);
+    return value ? string(value) : defaultValue;
+}
+
+// Splits a list of directories like stringSplit()
+template <typename Sink> static void addSearchPaths(Sink &sink, const char *list)
+{
+    if (!*list)
+        return;
+    while (true) {
+        const char *p = strchr(list, listSeparator);
+        if (!p) {
+            sink.add(list, strlen(list), "/qtchooser/");
+            return;
+        }
+        sink.add(list, p - list, "/qtchooser/");
+        list = p + 1;
+    }
+}
+
+// Passes each search path to sink.add(), as a directory and a suffix to
+// append to it, for both forms of Resolver::searchPaths()
+template <typename Sink> static void listSearchPaths(Sink &sink)
+{
+    const char *localDir = getenv("XDG_CONFIG_HOME");
+    if (localDir) {
+        sink.add(localDir, strlen(localDir), "/qtchooser/");
+    } else {
+        char buf[4096];
+        const char *home = userHome(buf, sizeof buf);
+        sink.add(home, strlen(home), PATH_SEP ".config/qtchooser/");
+    }
+
+    // search the XDG config location directories
+    const char *xdgPaths = getenv("XDG_CONFIG_DIRS");
+    addSearchPaths(sink, xdgPaths ? xdgPaths : "/etc/xdg");
+
+#if defined(QTCHOOSER_GLOBAL_DIR)
+    const char *noGlobalDir = getenv("QTCHOOSER_NO_GLOBAL_DIR");
+    if (!noGlobalDir || !*noGlobalDir)
+        addSearchPaths(sink, QTCHOOSER_GLOBAL_DIR);
+#endif
+}
+
+struct SearchPathVector
+{
+    vector<string> paths;
+    void add(const char *dir, size_t len, const char *suffix)
+    { paths.push_back(string(dir, len) + suffix); }
+};
+
+struct SearchPathListSink
+{
+    SearchPathList *list;
+    void add(const char *dir, size_t len, const char *suffix)
+    {
+        if (list->count == MaxSearchPaths) {
+            list->buffer.overflow = true;
+            return;
+        }
+        list->offsets[list->count++] = list->buffer.length;
+        list->buffer.append(dir, len).append(suffix).append("", 1);
+    }
+};
+
+vector<string> Resolver::searchPaths() const
+{
+    SearchPathVector sink;
+    listSearchPaths(sink);
+    return sink.paths;
+}
+
+// Returns false if the paths don't fit in the list
+bool Resolver::searchPaths(SearchPathList *paths) const
+{
+    SearchPathListSink sink = { paths };
+    listSearchPaths(sink);
+    return !paths->buffer.overflow;
+}
+
+// A name next to fileName for a temporary file that no other writer uses:
+// the pid, which repeats across containers sharing the directory, a counter
+// that is unique per thread too, for the threads of a program using
+// libqtchooser, and the time.
+static string tempFileName(const string &fileName)
+{
+    static unsigned counter;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    char suffix[64];
+    snprintf(suffix, sizeof suffix, ".%d.%u.%lx", int(getpid()), __sync_fetch_and_add(&counter, 1),
+             (unsigned long)ts.tv_nsec);
+    return fileName + suffix;
+}
+
+// Creates a new temporary file next to fileName, creating its directory if
+// needed. Gives up after MaxTempFileAttempts names that are taken. Returns
+// the descriptor, or -1 with errno set.
+static int createTempFile(const string &fileName, string *tempName)
+{
+    for (int attempt = 0; attempt < MaxTempFileAttempts; ++attempt) {
+        *tempName = tempFileName(fileName);
+        int fd = ::open(tempName->c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd == -1 && errno == ENOENT && mkparentdir(fileName))
+            fd = ::open(tempName->c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd != -1 || errno != EEXIST)
+            return fd;
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+static bool writeAll(int fd, const string &contents)
+{
+    for (size_t written = 0; written < contents.size(); ) {
+        ssize_t len = ::write(fd, contents.data() + written, contents.size() - written);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return false;
+        written += len;
+    }
+    return true;
+}
+
+// Writes to a temporary file and renames it into place, so that concurrent
+// readers never see a partial file. Returns false and sets errno on failure.
+bool writeFileAtomically(const string &fileName, const string &contents)
+{
+    if (fileName.empty()) {
+        errno = ENOENT;
+        return false;
+    }
+
+    string tempName;
+    int fd = createTempFile(fileName, &tempName);
+    if (fd == -1)
+        return false;
+
+    bool ok = writeAll(fd, contents);
+    if (::close(fd) != 0)
+        ok = false;
+    if (ok && rename(tempName.c_str(), fileName.c_str()) == 0)
+        return true;
+
+    int savedErrno = errno;
+    unlink(tempName.c_str());
+    errno = savedErrno;
+    return false;
+}
+
+bool syncDir(const string &dir)
+{
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return false;
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// Like writeFileAtomically(), but durable: the contents are on disk before
+// the file gets its name, and the name is on disk when this returns. Unless
+// replace is set, it fails with EEXIST if the file exists, so that of any
+// number of processes creating the same file at once exactly one succeeds.
+// Without syncDirectory, the caller syncs the directory instead, say once
+// after writing many files into it. Where possible, the file is written
+// without a name using O_TMPFILE and then linked into place. A crash then
+// leaves no temporary files behind.
+bool writeFileDurably(const string &fileName, const string &contents, bool replace, bool syncDirectory)
+{
+    const size_t slash = fileName.rfind('/');
+    const string dir = slash == string::npos ? string(".") : fileName.substr(0, slash ? slash : 1);
+    string tempName;
+    int fd = -1;
+#if defined(O_TMPFILE)
+    // linking an anonymous file needs its /proc/self/fd entry
+    if (access("/proc/self/fd", X_OK) == 0) {
+        fd = ::open(dir.c_str(), O_TMPFILE | O_WRONLY, 0666);
+        if (fd == -1 && errno == ENOENT && mkparentdir(fileName))
+            fd = ::open(dir.c_str(), O_TMPFILE | O_WRONLY, 0666);
+    }
+#endif
+    if (fd == -1) {
+        // no O_TMPFILE, or not on this filesystem
+        fd = createTempFile(fileName, &tempName);
+        if (fd == -1)
+            return false;
+    }
+
+    bool ok = writeAll(fd, contents) && fsync(fd) == 0;
+    if (ok && tempName.empty()) {
+        // name the anonymous file: directly, which fails if the file exists,
+        // or with a temporary name to rename over it
+        char path[64];
+        snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+        if (!replace) {
+            ok = linkat(AT_FDCWD, path, AT_FDCWD, fileName.c_str(), AT_SYMLINK_FOLLOW) == 0;
+            int savedErrno = errno;
+            ::close(fd);
+            errno = savedErrno;
+            return ok && (!syncDirectory || syncDir(dir));
+        }
+        ok = false;
+        for (int attempt = 0; !ok && attempt < MaxTempFileAttempts; ++attempt) {
+            tempName = tempFileName(fileName);
+            ok = linkat(AT_FDCWD, path, AT_FDCWD, tempName.c_str(), AT_SYMLINK_FOLLOW) == 0;
+            if (!ok && errno != EEXIST)
+                break;
+        }
+        if (!ok)
+            tempName.clear();
+    }
+    int savedErrno = errno;
+    if (::close(fd) != 0 && ok) {
+        savedErrno = errno;
+        ok = false;
+    }
+
+    // unlike rename(), link() fails if the file exists
+    if (ok) {
+        ok = (replace ? rename(tempName.c_str(), fileName.c_str())
+                      : link(tempName.c_str(), fileName.c_str())) == 0;
+        savedErrno = errno;
+    }
+    if (!tempName.empty() && !(ok && replace))
+        unlink(tempName.c_str());
+    if (ok)
+        return !syncDirectory || syncDir(dir);
+    errno = savedErrno;
+    return false;
+}
+
+uint32_t registryHash(const string &name, uint32_t displacement)
+{
+    unsigned long long hash = fnv1a(name.c_str(), name.size(),
+                                    14695981039346656037ULL ^ (displacement * 0x9e3779b97f4a7c15ULL));
+    return uint32_t(hash ^ (hash >> 32));
+}
+
+string registryFileName(string dir)
+{
+    while (dir.size() > 1 && dir[dir.size() - 1] == '/')
+        dir.erase(dir.size() - 1);
+    return dir + registrySuffix;
+}
+
+// Maps the registry of a search path. Returns null if it has none or if it
+// is out of date.
+static const RegistryHeader *mapRegistry(const string &path)
+{
+    const string fileName = registryFileName(path);
+    TraceScope trace("openRegistry", fileName.c_str());
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= off_t(sizeof(RegistryHeader)) && st.st_size <= 0x7fffffff)
+        data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    const RegistryHeader *header = static_cast<const RegistryHeader *>(data);
+    const unsigned long long tablesEnd = sizeof(RegistryHeader)
+            + (0ULL + header->bucketCount + header->slotCount) * sizeof(uint32_t)
+            + 1ULL * header->entryCount * sizeof(RegistryEntry);
+    if (header->magic != registryMagic || header->version != registryVersion || header->fileSize != st.st_size
+            || static_cast<const char *>(data)[st.st_size - 1] != '\0' || tablesEnd > header->fileSize
+            || (header->entryCount && (!header->bucketCount || !header->slotCount))
+            || fileStamp(path) != registryString(header, header->stamp)) {
+        munmap(data, st.st_size);
+        return 0;
+    }
+    return header;
+}
+
+// The registry mapped for each search path, shared by the callers of
+// openRegistry(). A mapping that was replaced is unmapped when the last
+// caller using it closes it.
+struct CachedRegistry
+{
+    const RegistryHeader *header;   // null if the path has no usable registry
+    string dirStamp;                // both taken before mapping it
+    string registryStamp;
+};
+static map<string, CachedRegistry> registries;
+static map<const RegistryHeader *, int> registryRefs;  // the cache's and the callers'
+static pthread_mutex_t registriesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Called with registriesMutex locked
+static void releaseRegistry(const RegistryHeader *registry)
+{
+    map<const RegistryHeader *, int>::iterator it = registryRefs.find(registry);
+    if (--it->second)
+        return;
+    registryRefs.erase(it);
+    munmap(const_cast<RegistryHeader *>(registry), registry->fileSize);
+}
+
+// Returns the registry of a search path, like mapRegistry(), which stays
+// mapped until closeRegistry(). The stamps are checked on every call, so a
+// long-lived process sees the changes made to the directory and the
+// registries compiled later.
+const RegistryHeader *openRegistry(const string &path)
+{
+    const string dirStamp = fileStamp(path);
+    const string registryStamp = fileStamp(registryFileName(path));
+
+    pthread_mutex_lock(&registriesMutex);
+    map<string, CachedRegistry>::iterator it = registries.find(path);
+    if (it == registries.end() || it->second.dirStamp != dirStamp
+            || it->second.registryStamp != registryStamp) {
+        if (it == registries.end())
+            it = registries.insert(make_pair(path, CachedRegistry())).first;
+        else if (it->second.header)
+            releaseRegistry(it->second.header);
+        it->second.header = mapRegistry(path);
+        it->second.dirStamp = dirStamp;
+        it->second.registryStamp = registryStamp;
+        if (it->second.header)
+            registryRefs[it->second.header] = 1;
+    }
+    const RegistryHeader *registry = it->second.header;
+    if (registry)
+        ++registryRefs[registry];
+    pthread_mutex_unlock(&registriesMutex);
+    return registry;
+}
+
+void closeRegistry(const RegistryHeader *registry)
+{
+    if (!registry)
+        return;
+    pthread_mutex_lock(&registriesMutex);
+    releaseRegistry(registry);
+    pthread_mutex_unlock(&registriesMutex);
+}
+
+const RegistryEntry *findRegistryEntry(const RegistryHeader *registry, const string &name)
+{
+    if (!registry->entryCount)
+        return 0;
+    uint32_t bucket = registryHash(name, 0) % registry->bucketCount;
+    uint32_t slot = registryHash(name, registryBuckets(registry)[bucket]) % registry->slotCount;
+    uint32_t index = registrySlots(registry)[slot];
+    if (index >= registry->entryCount)
+        return 0;
+    const RegistryEntry *entry = registryEntries(registry) + index;
+    return name == registryString(registry, entry->name) ? entry : 0;
+}
+
+void loadRegistryEntry(const RegistryHeader *registry, const RegistryEntry *entry, Sdk &sdk)
+{
+    sdk.toolsPath = registryString(registry, entry->toolsPath);
+    sdk.librariesPath = registryString(registry, entry->librariesPath);
+    sdk.prefix = registryString(registry, entry->prefix);
+    sdk.headersPath = registryString(registry, entry->headersPath);
+    sdk.pluginsPath = registryString(registry, entry->pluginsPath);
+    sdk.libraryPathMode = registryString(registry, entry->libraryPathMode);
+    sdk.state = entry->flags & RegistryMalformed ? Malformed : Parsed;
+}
+
+char *SdkNameSet::allocate(size_t size)
+{
+    if (size > BlockSize / 4) {
+        // too big for the arena blocks, give it one of its own, keeping the
+        // current block last
+        char *block = static_cast<char *>(malloc(size));
+        blocks.insert(blocks.end() - (blocks.empty() ? 0 : 1), block);
+        return block;
+    }
+    if (blockUsed + size > BlockSize) {
+        blocks.push_back(static_cast<char *>(malloc(BlockSize)));
+        blockUsed = 0;
+    }
+    char *result = blocks.back() + blockUsed;
+    blockUsed += size;
+    return result;
+}
+
+void SdkNameSet::grow()
+{
+    vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    const size_t mask = slots.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i) {
+        if (!old[i].fileName)
+            continue;
+        size_t j = old[i].hash & mask;
+        while (slots[j].fileName)
+            j = (j + 1) & mask;
+        slots[j] = old[i];
+    }
+}
+
+bool SdkNameSet::insert(const char *name, size_t len)
+{
+    const uint32_t hash = uint32_t(fnv1a(name, len));
+    const size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    for ( ; slots[i].fileName; i = (i + 1) & mask) {
+        if (slots[i].hash == hash && slots[i].length == len && memcmp(slots[i].fileName, name, len) == 0)
+            return false;
+    }
+
+    char *fileName = allocate(len + sizeof confSuffix);
+    memcpy(fileName, name, len);
+    memcpy(fileName + len, confSuffix, sizeof confSuffix);
+    slots[i].fileName = fileName;
+    slots[i].hash = hash;
+    slots[i].length = len;
+    if (++count * 2 > slots.size())
+        grow();
+    return true;
+}
+
+vector<const char *> SdkNameSet::fileNames() const
+{
+    vector<const char *> result;
+    result.reserve(count);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (slots[i].fileName)
+            result.push_back(slots[i].fileName);
+    }
+    return result;
+}
+
+// Adds the names of the config files found in one search path to names,
+// without creating an Sdk for each of them.
+void listSdkNames(const string &path, SdkNameSet *names)
+{
+    OpenRegistry mapped(path);
+    if (const RegistryHeader *registry = mapped.header()) {
+        const RegistryEntry *entries = registryEntries(registry);
+        for (uint32_t i = 0; i < registry->entryCount; ++i) {
+            const char *name = registryString(registry, entries[i].name);
+            names->insert(name, strlen(name));
+        }
+        return;
+    }
+
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+        return;
+    while (struct dirent *d = readdir(dir)) {
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (d->d_type == DT_DIR)
+            continue;
+#endif
+        size_t fnamelen = strlen(d->d_name);
+        if (fnamelen < sizeof(confSuffix))
+            continue;
+        if (memcmp(d->d_name + fnamelen + 1 - sizeof(confSuffix), confSuffix, sizeof confSuffix - 1) != 0)
+            continue;
+        names->insert(d->d_name, fnamelen + 1 - sizeof confSuffix);
+    }
+    closedir(dir);
+}
+
+// Appends the config files found in one search path to sdks, in directory
+// order. Only their names and file names are set, unless they come from the
+// path's registry, in which case they are already parsed.
+void listSdks(const string &path, vector<Sdk> *sdks, bool useRegistry)
+{
+    if (useRegistry) {
+        OpenRegistry mapped(path);
+        if (const RegistryHeader *registry = mapped.header()) {
+            const RegistryEntry *entries = registryEntries(registry);
+            for (uint32_t i = 0; i < registry->entryCount; ++i) {
+                Sdk sdk;
+                sdk.name = registryString(registry, entries[i].name);
+                sdk.configFile = path + PATH_SEP + sdk.name + confSuffix;
+                loadRegistryEntry(registry, entries + i, sdk);
+                sdks->push_back(sdk);
+            }
+            return;
+        }
+    }
+
+    // no ISO C++ or ISO C API for listing directories, so use POSIX
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+        return;  // no such dir or not a dir, doesn't matter
+
+    while (struct dirent *d = readdir(dir)) {
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (d->d_type == DT_DIR)
+            continue;
+#endif
+
+        size_t fnamelen = strlen(d->d_name);
+        if (fnamelen < sizeof(confSuffix))
+            continue;
+        if (memcmp(d->d_name + fnamelen + 1 - sizeof(confSuffix), confSuffix, sizeof confSuffix - 1) != 0)
+            continue;
+
+        Sdk sdk;
+        sdk.name.assign(d->d_name, fnamelen + 1 - sizeof confSuffix);
+        sdk.configFile = path + PATH_SEP + d->d_name;
+        sdks->push_back(sdk);
+    }
+    closedir(dir);
+}
+
+Sdk Resolver::iterateSdks(const string &targetSdk, VisitFunction visit, const string &targetTool)
+{
+    vector<string> paths = searchPaths();
+    SdkNameSet seenNames;
+    vector<Sdk> sdks;
+    for (vector<string>::iterator it = paths.begin(); it != paths.end(); ++it) {
+        TraceScope trace("iterateSdks", it->c_str());
+        sdks.clear();
+        listSdks(*it, &sdks);
+
+        for (vector<Sdk>::iterator sdk = sdks.begin(); sdk != sdks.end(); ++sdk) {
+            if (!seenNames.insert(sdk->name))
+                continue;
+
+            if (!targetTool.empty()) {
+                // To make the check in matchSdk() succeed
+                sdk->name = "default";
+            }
+            if (visit && visit(targetSdk, *sdk)) {
+                // If a tool was requested, but not found here, skip this sdk
+                if (!targetTool.empty() && !sdk->hasTool(targetTool))
+                    continue;
+                return *sdk;
+            }
+        }
+    }
+
+    return Sdk();
+}
+
+// Same as iterateSdks(targetSdk, &Resolver::matchSdk), but instead of listing
+// every search path, it tries to open <path>/<name>.conf in each of them, or
+// looks the name up in the path's registry. The first file found shadows any
+// later ones, even if it turns out to be malformed.
+Sdk Resolver::findSdk(const string &targetSdk)
+{
+    Sdk sdk;
+    sdk.name = targetSdk.empty() ? "default" : targetSdk;
+
+    // such a name can't match any file in the search paths
+    if (sdk.name.find('/') != string::npos)
+        return Sdk();
+
+    if (preloaded) {
+        map<string, size_t>::const_iterator it = preloadedNames.find(sdk.name);
+        if (it == preloadedNames.end())
+            return Sdk();
+        Sdk &found = preloadedSdks[it->second];
+        if (matchSdk(targetSdk, found) || found.state == Unreadable)
+            return found;
+        return Sdk();
+    }
+
+    vector<string> paths = searchPaths();
+    for (vector<string>::iterator it = paths.begin(); it != paths.end(); ++it) {
+        sdk.configFile = *it + PATH_SEP + sdk.name + confSuffix;
+        TraceScope trace("findSdk", sdk.configFile.c_str());
+
+        OpenRegistry mapped(*it);
+        if (const RegistryHeader *registry = mapped.header()) {
+            const RegistryEntry *entry = findRegistryEntry(registry, sdk.name);
+            if (!entry)
+                continue;
+            loadRegistryEntry(registry, entry, sdk);
+        } else {
+            // iterateSdks skips directories, so we do too
+            struct stat st;
+            if (lstat(sdk.configFile.c_str(), &st) != 0 || S_ISDIR(st.st_mode))
+                continue;
+        }
+
+        // an unreadable file is returned for the caller to report
+        if (matchSdk(targetSdk, sdk) || sdk.state == Unreadable)
+            return sdk;
+        return Sdk();
+    }
+    return Sdk();
+}
+
+// Lists the SDKs once, for answering many lookups in a row: findSdk(),
+// findSdkByVersion() and findSdkWithTool() then search that list instead of
+// the search paths, and changes made to them later aren't seen.
+void Resolver::preloadSdks()
+{
+    preloadedSdks = allSdks();
+    preloadedNames.clear();
+    for (size_t i = 0; i < preloadedSdks.size(); ++i)
+        preloadedNames[preloadedSdks[i].name] = i;
+    preloadedVersions = versionedSdks(preloadedSdks);
+    preloaded = true;
+}
+
+// Returns every SDK visible in the search paths, in the order and with the
+// shadowing used by iterateSdks. Only the name and the config file are set,
+// unless the SDK came from a registry.
+vector<Sdk> Resolver::allSdks() const
+{
+    vector<string> paths = searchPaths();
+    SdkNameSet seenNames;
+    vector<Sdk> found, sdks;
+    for (vector<string>::iterator it = paths.begin(); it != paths.end(); ++it) {
+        TraceScope trace("allSdks", it->c_str());
+        found.clear();
+        listSdks(*it, &found);
+        for (vector<Sdk>::const_iterator sdk = found.begin(); sdk != found.end(); ++sdk) {
+            if (seenNames.insert(sdk->name))
+                sdks.push_back(*sdk);
+        }
+    }
+    return sdks;
+}
+
+// All tools that exist for only one Qt version should be
+// here. Other tools in this list are qdbus and qmlscene.
+bool fallbackAllowed(const char *tool)
+{
+    return strcmp(tool, "qdbus") == 0 ||
+           strcmp(tool, "qml") == 0 ||
+           strcmp(tool, "qmlimportscanner") == 0 ||
+           strcmp(tool, "qmlscene") == 0 ||
+           strcmp(tool, "qtdiag") == 0 ||
+           strcmp(tool, "qtpaths") == 0 ||
+           strcmp(tool, "qtplugininfo") == 0;
+}
+
+// Parses the numbers at the start of s. If whole is set, nothing may follow
+// them; otherwise, they may be followed by anything but a letter.
+static bool parseVersion(const char *s, Version *version, bool whole)
+{
+    version->clear();
+    while (true) {
+        if (!isdigit((unsigned char)*s))
+            return false;
+        char *end;
+        version->push_back(strtoul(s, &end, 10));
+        s = end;
+        if (*s != '.' || !isdigit((unsigned char)s[1]))
+            break;
+        ++s;
+    }
+    return whole ? *s == '\0' : !isalpha((unsigned char)*s);
+}
+
+static bool parseSdkVersion(const string &name, Version *version)
+{
+    const char *s = name.c_str();
+    if (strncmp(s, "qt", 2) == 0)
+        s += 2;
+    return parseVersion(s, version, false);
+}
+
+bool parseVersionSelector(const string &selector, VersionSelector *result)
+{
+    static const struct {
+        const char *prefix;
+        VersionSelector::Operator op;
+    } operators[] = {
+        { ">=", VersionSelector::GreaterEqual },
+        { "<=", VersionSelector::LessEqual },
+        { ">", VersionSelector::Greater },
+        { "<", VersionSelector::Less },
+        { "", VersionSelector::Prefix }
+    };
+
+    if (selector == "latest") {
+        result->op = VersionSelector::Latest;
+        result->version.clear();
+        return true;
+    }
+    for (size_t i = 0; i < sizeof operators / sizeof operators[0]; ++i) {
+        size_t len = strlen(operators[i].prefix);
+        if (selector.compare(0, len, operators[i].prefix) == 0) {
+            result->op = operators[i].op;
+            return parseVersion(selector.c_str() + len, &result->version, true);
+        }
+    }
+    return false;
+}
+
+// Compares numerically, with missing numbers counting as 0, so 6.5 == 6.5.0
+static int compareVersions(const Version &a, const Version &b)
+{
+    for (size_t i = 0; i < a.size() || i < b.size(); ++i) {
+        unsigned long x = i < a.size() ? a[i] : 0;
+        unsigned long y = i < b.size() ? b[i] : 0;
+        if (x != y)
+            return x < y ? -1 : 1;
+    }
+    return 0;
+}
+
+bool versionMatches(const VersionSelector &selector, const Version &version)
+{
+    switch (selector.op) {
+    case VersionSelector::Latest:
+        return true;
+    case VersionSelector::Prefix:
+        return version.size() >= selector.version.size()
+                && equal(selector.version.begin(), selector.version.end(), version.begin());
+    case VersionSelector::Less:
+        return compareVersions(version, selector.version) < 0;
+    case VersionSelector::LessEqual:
+        return compareVersions(version, selector.version) <= 0;
+    case VersionSelector::Greater:
+        return compareVersions(version, selector.version) > 0;
+    case VersionSelector::GreaterEqual:
+        return compareVersions(version, selector.version) >= 0;
+    }
+    return false;
+}
+
+static string versionToString(const Version &version)
+{
+    string result;
+    for (size_t i = 0; i < version.size(); ++i) {
+        char buffer[sizeof ".18446744073709551615"];
+        snprintf(buffer, sizeof buffer, i ? ".%lu" : "%lu", version[i]);
+        result += buffer;
+    }
+    return result;
+}
+
+// Newest first; SDKs with the same version are ordered by name
+static bool versionedSdkLessThan(const VersionedSdk &a, const VersionedSdk &b)
+{
+    int cmp = compareVersions(a.version, b.version);
+    return cmp ? cmp > 0 : a.name < b.name;
+}
+
+vector<VersionedSdk> versionedSdks(const vector<Sdk> &sdks)
+{
+    vector<VersionedSdk> result;
+    for (size_t i = 0; i < sdks.size(); ++i) {
+        VersionedSdk entry;
+        entry.name = sdks[i].name;
+        if (parseSdkVersion(entry.name, &entry.version))
+            result.push_back(entry);
+    }
+    sort(result.begin(), result.end(), versionedSdkLessThan);
+    return result;
+}
+
+Sdk Resolver::selectSdk(const string &targetSdk, const string &targetTool, bool *usedFallback)
+{
+    // First, try the requested SDK, then the newest one matching it as a
+    // version selector
+    Sdk matchedSdk = findSdk(targetSdk);
+    if (matchedSdk.state == Unreadable)
+        return matchedSdk;
+    if (!matchedSdk.isValid() && !targetSdk.empty())
+        matchedSdk = findSdkByVersion(targetSdk);
+    if (targetSdk.empty() && !matchedSdk.hasTool(targetTool) && fallbackAllowed(targetTool)) {
+        // If a tool was requested, fall back to any SDK that has it
+        matchedSdk = findSdkWithTool(targetTool);
+        if (usedFallback)
+            *usedFallback = true;
+    }
+    return matchedSdk;
+}
+
+// Finds the tool that running targetTool with targetSdk selected would run,
+// through the resolution cache. Returns false if no SDK was found, with the
+// reason in result->sdk.
+bool Resolver::resolve(const string &targetSdk, const string &targetTool, Resolution *result)
+{
+    if (lookupCachedTool(targetSdk, targetTool, result)) {
+        result->cacheHit = true;
+    } else {
+        // take the directory stamps before scanning, so that any change made
+        // while we're resolving makes the cache entry stale
+        const vector<string> paths = searchPaths();
+        vector<string> stamps;
+        for (vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+            stamps.push_back(fileStamp(*it));
+
+        result->sdk = selectSdk(targetSdk, targetTool, &result->usedFallback);
+        if (!result->sdk.isValid())
+            return false;
+
+        result->tool = result->sdk.toolsPath + PATH_SEP + targetTool;
+        result->configFile = result->sdk.configFile;
+        result->librariesPath = result->sdk.librariesPath;
+        result->libraryPathMode = result->sdk.libraryPathMode;
+        cacheTool(targetSdk, targetTool, paths, stamps, *result);
+    }
+
+    if (result->tool[0] == '~')
+        result->tool = userHome() + result->tool.substr(1);
+    if (!result->librariesPath.empty() && result->librariesPath[0] == '~')
+        result->librariesPath = userHome() + result->librariesPath.substr(1);
+    return true;
+}
+
+// The resolution cache maps (search paths, requested SDK, tool) to the path
+// of the tool that was run. Each entry is a small text file:
+//
+//   qtchooser-resolve 1
+//   sdk <requested SDK>
+//   tool <tool name>
+//   dir <stamp> <search path>      (one per search path, in search order)
+//   conf <stamp> <config file>
+//   lib <libraries path>
+//   libpath <libpath= setting of the config file>
+//   exec <tool path>
+//
+// The entry is only used if all of the stamps still match, so a warm run
+// costs one open plus one stat per search path and one for the config file.
+static const char resolveCacheHeader[] = "qtchooser-resolve 2";
+enum { MaxCacheFileSize = 16384 };
+
+bool cacheEnabled()
+{
+    const char *value = getenv("QTCHOOSER_NO_CACHE");
+    return !value || !*value;
+}
+
+// Builds the name of the cache entry with this hash of its key. Returns false
+// if it doesn't fit.
+bool cacheFileName(FixedPath *name, const char *kind, unsigned long long hash)
+{
+    const char *cacheHome = getenv("XDG_CACHE_HOME");
+    if (cacheHome) {
+        name->append(cacheHome);
+    } else {
+        char buf[4096];
+        name->append(userHome(buf, sizeof buf)).append(PATH_SEP ".cache");
+    }
+
+    char suffix[sizeof "-0123456789abcdef"];
+    snprintf(suffix, sizeof suffix, "-%016llx", hash);
+    name->append(PATH_SEP "qtchooser" PATH_SEP).append(kind).append(suffix);
+    return !name->overflow;
+}
+
+// Returns an empty string if the name is too long
+string cacheFileName(const char *kind, const string &targetSdk, const string &targetTool,
+                            const vector<string> &paths)
+{
+    // hash all the components of the key, including their terminating NULs
+    unsigned long long hash = fnv1a(targetSdk.c_str(), targetSdk.size() + 1);
+    hash = fnv1a(targetTool.c_str(), targetTool.size() + 1, hash);
+    for (vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+        hash = fnv1a(it->c_str(), it->size() + 1, hash);
+
+    FixedPath name;
+    if (!cacheFileName(&name, kind, hash))
+        return string();
+    return name.c_str();
+}
+
+bool Resolver::lookupCachedTool(const string &targetSdk, const string &targetTool, Resolution *result) const
+{
+    CachedTool cached;
+    if (!lookupCachedTool(targetSdk.c_str(), targetTool.c_str(), &cached))
+        return false;
+    result->tool = cached.tool.c_str();
+    result->configFile = cached.configFile.c_str();
+    result->librariesPath = cached.librariesPath.c_str();
+    result->libraryPathMode = cached.libraryPathMode.c_str();
+    return true;
+}
+
+// Looks the tool up without allocating any memory, for runTool's fast path
+bool Resolver::lookupCachedTool(const char *targetSdk, const char *targetTool, CachedTool *result) const
+{
+    // don't cache the fallback search: its result depends on the contents of
+    // the bin dirs of every SDK, not just on the config files
+    if (!*targetSdk && fallbackAllowed(targetTool))
+        return false;
+    if (!cacheEnabled())
+        return false;
+
+    // the same hash as the string version of cacheFileName()
+    SearchPathList paths;
+    if (!searchPaths(&paths))
+        return false;
+    unsigned long long hash = fnv1a(targetSdk, strlen(targetSdk) + 1);
+    hash = fnv1a(targetTool, strlen(targetTool) + 1, hash);
+    hash = fnv1a(paths.buffer.data, paths.buffer.length, hash);
+    FixedPath fileName;
+    if (!cacheFileName(&fileName, "resolve", hash))
+        return false;
+
+    TraceScope trace("lookupCachedTool", fileName.c_str());
+    char buf[MaxCacheFileSize];
+    ssize_t len = readSmallFile(fileName.c_str(), buf, sizeof buf);
+    if (len <= 0)
+        return false;
+
+    // each line is NUL-terminated in place, then split at its spaces
+    size_t dirCount = 0;
+    bool sawSdk = false, sawTool = false, sawConf = false, sawLib = false;
+    char *end = buf + len;
+    char *line = buf;
+    char *nl = static_cast<char *>(memchr(line, '\n', end - line));
+    if (!nl)
+        return false;
+    *nl = '\0';
+    if (strcmp(line, resolveCacheHeader) != 0)
+        return false;
+
+    for (line = nl + 1; line < end; line = nl + 1) {
+        nl = static_cast<char *>(memchr(line, '\n', end - line));
+        if (!nl)
+            return false;
+        *nl = '\0';
+        char *value = strchr(line, ' ');
+        if (!value)
+            return false;
+        *value++ = '\0';
+        const char *key = line;
+
+        if (strcmp(key, "sdk") == 0) {
+            if (strcmp(value, targetSdk) != 0)
+                return false;
+            sawSdk = true;
+        } else if (strcmp(key, "tool") == 0) {
+            if (strcmp(value, targetTool) != 0)
+                return false;
+            sawTool = true;
+        } else if (strcmp(key, "dir") == 0 || strcmp(key, "conf") == 0) {
+            char *path = strchr(value, ' ');
+            if (!path)
+                return false;
+            *path++ = '\0';
+            if (*key == 'd') {
+                if (dirCount >= paths.count || strcmp(paths.at(dirCount++), path) != 0)
+                    return false;
+            } else {
+                sawConf = true;
+                result->configFile.clear();
+                result->configFile.append(path);
+            }
+            char stamp[MaxStampLength];
+            if (strcmp(fileStamp(path, stamp), value) != 0)
+                return false;
+        } else if (strcmp(key, "lib") == 0) {
+            sawLib = true;
+            result->librariesPath.clear();
+            result->librariesPath.append(value);
+        } else if (strcmp(key, "libpath") == 0) {
+            result->libraryPathMode.clear();
+            result->libraryPathMode.append(value);
+        } else if (strcmp(key, "exec") == 0) {
+            if (!sawSdk || !sawTool || !sawConf || !sawLib || dirCount != paths.count)
+                return false;
+            result->tool.clear();
+            result->tool.append(value);
+            return !result->tool.overflow && !result->configFile.overflow
+                    && !result->librariesPath.overflow && !result->libraryPathMode.overflow;
+        }
+    }
+    return false;
+}
+
+void Resolver::cacheTool(const string &targetSdk, const string &targetTool, const vector<string> &paths,
+                            const vector<string> &stamps, const Resolution &result) const
+{
+    if (targetSdk.empty() && fallbackAllowed(targetTool))
+        return;
+    if (!cacheEnabled())
+        return;
+
+    string contents = resolveCacheHeader;
+    contents += "\nsdk " + targetSdk + "\ntool " + targetTool + '\n';
+    for (size_t i = 0; i < paths.size(); ++i)
+        contents += "dir " + stamps[i] + ' ' + paths[i] + '\n';
+    contents += "conf " + fileStamp(result.configFile) + ' ' + result.configFile + '\n';
+    contents += "lib " + result.librariesPath + '\n';
+    contents += "libpath " + result.libraryPathMode + '\n';
+    contents += "exec " + result.tool + '\n';
+    if (contents.size() >= MaxCacheFileSize)
+        return;
+
+    writeFileAtomically(cacheFileName("resolve", targetSdk, targetTool, paths), contents);
+}
+
+// The fallback index lists, for each tool that fallbackAllowed() accepts,
+// the SDKs whose bin dir contains it, in search order. Building it reads
+// every config file and lists every bin dir once; it is rebuilt when any
+// search path, config file or bin dir changes. It only names the SDKs: the
+// config file of the one selected is read again for its other settings.
+//
+//   qtchooser-fallback 2
+//   dir <stamp> <search path>      (one per search path, in search order)
+//   sdk <stamp> <config file>      (one per SDK, in search order)
+//   bin <stamp> <tools path>       (only for well-formed config files)
+//   tool <name> <sdk number>...    (SDKs numbered from 0 in the order above)
+static const char fallbackIndexHeader[] = "qtchooser-fallback 2";
+
+bool Resolver::lookupFallbackIndex(const vector<string> &paths, const string &targetTool, Sdk *sdk) const
+{
+    const string fileName = cacheFileName("fallback", string(), string(), paths);
+    TraceScope trace("lookupFallbackIndex", fileName.c_str());
+    string contents;
+    if (!readFile(fileName, &contents))
+        return false;
+
+    size_t pos = contents.find('\n');
+    if (pos == string::npos || contents.compare(0, pos, fallbackIndexHeader) != 0)
+        return false;
+
+    vector<Sdk> sdks;
+    string toolSdks;
+    size_t dirCount = 0;
+    string home;
+    for (++pos; pos < contents.size(); ) {
+        size_t nl = contents.find('\n', pos);
+        if (nl == string::npos)
+            return false;
+        string key = contents.substr(pos, nl - pos);
+        pos = nl + 1;
+        size_t space = key.find(' ');
+        if (space == string::npos)
+            return false;
+        string value = key.substr(space + 1);
+        key.erase(space);
+
+        if (key == "tool") {
+            space = value.find(' ');
+            if (space != string::npos && value.compare(0, space, targetTool) == 0)
+                toolSdks = value.substr(space);
+            continue;
+        }
+
+        // the remaining keys are stamped paths
+        space = value.find(' ');
+        if (space == string::npos)
+            return false;
+        string path = value.substr(space + 1);
+        value.erase(space);
+        if (key == "dir") {
+            if (dirCount >= paths.size() || paths[dirCount++] != path)
+                return false;
+        } else if (key == "sdk") {
+            sdks.push_back(Sdk());
+            sdks.back().configFile = path;
+            size_t slash = path.rfind('/') + 1;
+            sdks.back().name = path.substr(slash, path.size() - slash - (sizeof confSuffix - 1));
+        } else if (key == "bin") {
+            if (sdks.empty())
+                return false;
+            sdks.back().toolsPath = path;
+            if (path[0] == '~') {
+                if (home.empty())
+                    home = userHome();
+                path = home + path.substr(1);
+            }
+        } else {
+            return false;
+        }
+        if (fileStamp(path) != value)
+            return false;
+    }
+    if (dirCount != paths.size())
+        return false;
+
+    // the index is current: the first SDK listed that still has the tool wins
+    *sdk = Sdk();
+    const char *p = toolSdks.c_str();
+    char *end;
+    for (unsigned long i = strtoul(p, &end, 10); end != p; i = strtoul(p, &end, 10)) {
+        p = end;
+        if (i < sdks.size() && sdks[i].hasTool(targetTool)) {
+            *sdk = sdks[i];
+            if (matchSdk(sdk->name, *sdk))
+                return true;
+            *sdk = Sdk();       // it changed after its stamp was checked
+            return false;
+        }
+    }
+    return true;
+}
+
+// Same as iterateSdks(string(), &Resolver::matchSdk, targetTool), but
+// with the fallback index in the cache directory, which is created if it is
+// missing or out of date.
+Sdk Resolver::findSdkWithTool(const string &targetTool)
+{
+    if (preloaded) {
+        for (vector<Sdk>::iterator it = preloadedSdks.begin(); it != preloadedSdks.end(); ++it) {
+            if (matchSdk(it->name, *it) && it->hasTool(targetTool))
+                return *it;
+        }
+        return Sdk();
+    }
+    if (!cacheEnabled())
+        return iterateSdks(string(), &Resolver::matchSdk, targetTool);
+
+    vector<string> paths = searchPaths();
+    Sdk result;
+    if (lookupFallbackIndex(paths, targetTool, &result))
+        return result;
+
+    // take each stamp before reading what it covers, so that a change made
+    // while we're building makes the index stale instead of wrong
+    string contents = fallbackIndexHeader;
+    contents += '\n';
+    for (vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+        contents += "dir " + fileStamp(*it) + ' ' + *it + '\n';
+
+    map<string, string> toolSdks;
+    vector<Sdk> sdks = allSdks();
+    string home;
+    for (size_t i = 0; i < sdks.size(); ++i) {
+        Sdk &sdk = sdks[i];
+        contents += "sdk " + fileStamp(sdk.configFile) + ' ' + sdk.configFile + '\n';
+        if (!matchSdk(sdk.name, sdk) || !sdk.isValid())
+            continue;
+
+        string toolsPath = sdk.toolsPath;
+        if (toolsPath[0] == '~') {
+            if (home.empty())
+                home = userHome();
+            toolsPath = home + toolsPath.substr(1);
+        }
+        contents += "bin " + fileStamp(toolsPath) + ' ' + sdk.toolsPath + '\n';
+
+        TraceScope trace("indexToolsPath", toolsPath.c_str());
+        DIR *dir = opendir(toolsPath.c_str());
+        if (!dir)
+            continue;
+        while (struct dirent *d = readdir(dir)) {
+            if (!fallbackAllowed(d->d_name))
+                continue;
+            toolSdks[d->d_name] += ' ' + string(to_number(int(i)));
+            if (!result.isValid() && targetTool == d->d_name && sdk.hasTool(targetTool))
+                result = sdk;
+        }
+        closedir(dir);
+    }
+    for (map<string, string>::const_iterator it = toolSdks.begin(); it != toolSdks.end(); ++it)
+        contents += "tool " + it->first + it->second + '\n';
+
+    writeFileAtomically(cacheFileName("fallback", string(), string(), paths), contents);
+    return result;
+}
+
+// The version index lists the names of the visible SDKs that have a
+// version, newest first. It only depends on the names of the config files,
+// so it is valid as long as none of the search paths changed:
+//
+//   qtchooser-versions 1
+//   dir <stamp> <search path>      (one per search path, in search order)
+//   sdk <version> <name>
+static const char versionIndexHeader[] = "qtchooser-versions 1";
+
+bool Resolver::lookupVersionIndex(const vector<string> &paths, vector<VersionedSdk> *index) const
+{
+    const string fileName = cacheFileName("versions", string(), string(), paths);
+    TraceScope trace("lookupVersionIndex", fileName.c_str());
+    string contents;
+    if (!readFile(fileName, &contents))
+        return false;
+
+    size_t pos = contents.find('\n');
+    if (pos == string::npos || contents.compare(0, pos, versionIndexHeader) != 0)
+        return false;
+
+    size_t dirCount = 0;
+    for (++pos; pos < contents.size(); ) {
+        size_t nl = contents.find('\n', pos);
+        if (nl == string::npos)
+            return false;
+        string line = contents.substr(pos, nl - pos);
+        pos = nl + 1;
+        size_t space = line.find(' ');
+        size_t space2 = space == string::npos ? space : line.find(' ', space + 1);
+        if (space2 == string::npos)
+            return false;
+        string value = line.substr(space + 1, space2 - space - 1);
+        string path = line.substr(space2 + 1);
+        line.erase(space);
+
+        if (line == "dir") {
+            if (dirCount >= paths.size() || paths[dirCount++] != path || fileStamp(path) != value)
+                return false;
+        } else if (line == "sdk") {
+            VersionedSdk entry;
+            entry.name = path;
+            if (!parseVersion(value.c_str(), &entry.version, true))
+                return false;
+            index->push_back(entry);
+        } else {
+            return false;
+        }
+    }
+    return dirCount == paths.size();
+}
+
+// Selects the newest SDK that matches selector, through the version index in
+// the cache directory, which is created if it is missing or out of date.
+Sdk Resolver::findSdkByVersion(const string &selector)
+{
+    VersionSelector versionSelector;
+    if (!parseVersionSelector(selector, &versionSelector))
+        return Sdk();
+
+    vector<VersionedSdk> index;
+    if (preloaded) {
+        index = preloadedVersions;
+    } else if (!cacheEnabled()) {
+        index = versionedSdks(allSdks());
+    } else {
+        const vector<string> paths = searchPaths();
+        if (!lookupVersionIndex(paths, &index)) {
+            // take the stamps before listing, so that a change made while
+            // we're building makes the index stale instead of wrong
+            string contents = versionIndexHeader;
+            contents += '\n';
+            for (vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+                contents += "dir " + fileStamp(*it) + ' ' + *it + '\n';
+
+            index = versionedSdks(allSdks());
+            for (vector<VersionedSdk>::const_iterator it = index.begin(); it != index.end(); ++it)
+                contents += "sdk " + versionToString(it->version) + ' ' + it->name + '\n';
+            writeFileAtomically(cacheFileName("versions", string(), string(), paths), contents);
+        }
+    }
+
+    // skip the matches whose config files turn out to be malformed
+    for (vector<VersionedSdk>::const_iterator it = index.begin(); it != index.end(); ++it) {
+        if (!versionMatches(versionSelector, it->version))
+            continue;
+        Sdk sdk = findSdk(it->name);
+        if (sdk.isValid())
+            return sdk;
+    }
+    return Sdk();
+}
+
+// Project pins: a .qtchooser file in the current directory or in one of its
+// parents names the SDK to use when neither -qt nor QT_SELECT is given. Its
+// first line that is not empty or a "#" comment is taken, so it may also be a
+// version selector. The search goes up at most MaxProjectDepth directories
+// and stops at the root or at a filesystem boundary.
+//
+// The result of searching the parents is cached per current directory, by
+// device and inode, with the stamp of each parent checked and of the file
+// found, so a new or removed .qtchooser anywhere makes it stale:
+//
+//   qtchooser-project 1
+//   dir <stamp> <relative path>    ("..", "../..", ... as far as searched)
+//   pin <stamp> <relative path>    (the .qtchooser file, if one was found)
+//
+// The current directory itself is not in the entry: it is usually a build
+// directory, whose stamp changes with every file written to it, so its own
+// .qtchooser is checked on every run instead.
+static const char projectPinName[] = ".qtchooser";
+static const char projectCacheHeader[] = "qtchooser-project 1";
+enum { MaxProjectDepth = 32 };
+
+static inline bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// The first line that isn't blank or a comment names the SDK
+static bool readProjectPin(const char *fileName, FixedPath *sdk)
+{
+    char buf[65536];
+    ssize_t len = readSmallFile(fileName, buf, sizeof buf);
+    if (len < 0)
+        return false;
+    TraceScope trace("readProjectPin", fileName);
+    sdk->clear();
+    for (const char *line = buf, *end = buf + len; line < end; ) {
+        const char *nl = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (!nl)
+            nl = end;
+        const char *begin = line;
+        const char *last = nl;
+        line = nl + 1;
+        while (begin < last && isBlank(*begin))
+            ++begin;
+        while (last > begin && isBlank(last[-1]))
+            --last;
+        if (begin < last && *begin != '#') {
+            sdk->append(begin, last - begin);
+            break;
+        }
+    }
+    return true;    // an empty pin selects the default
+}
+
+static bool projectCacheFileName(FixedPath *name, const struct stat &here)
+{
+    // hashed like the components of the other caches' keys: the
+    // "device:inode" of the current directory, then an empty tool name
+    char key[64];
+    int len = snprintf(key, sizeof key, "%llu:%llu", (unsigned long long)here.st_dev,
+                       (unsigned long long)here.st_ino);
+    unsigned long long hash = fnv1a(key, len + 1);
+    hash = fnv1a("", 1, hash);
+    return cacheFileName(name, "project", hash);
+}
+
+static bool lookupProjectCache(const char *fileName, FixedPath *sdk)
+{
+    char buf[65536];
+    ssize_t len = readSmallFile(fileName, buf, sizeof buf);
+    if (len < 0)
+        return false;
+    char *end = buf + len;
+    char *line = static_cast<char *>(memchr(buf, '\n', len));
+    if (!line)
+        return false;
+    *line++ = '\0';
+    if (strcmp(buf, projectCacheHeader) != 0)
+        return false;
+
+    sdk->clear();
+    while (line < end) {
+        char *nl = static_cast<char *>(memchr(line, '\n', end - line));
+        if (!nl)
+            return false;
+        *nl = '\0';
+        char *stamp = strchr(line, ' ');
+        char *path = stamp ? strchr(stamp + 1, ' ') : 0;
+        if (!path)
+            return false;
+        *stamp++ = '\0';
+        *path++ = '\0';
+        char currentStamp[MaxStampLength];
+        if (strcmp(fileStamp(path, currentStamp), stamp) != 0)
+            return false;
+        if (strcmp(line, "pin") == 0)
+            return nl + 1 == end && readProjectPin(path, sdk) && !sdk->overflow;
+        if (strcmp(line, "dir") != 0)
+            return false;
+        line = nl + 1;
+    }
+    return true;
+}
+
+// Answers projectSdk() from ./.qtchooser or from the cache, without
+// allocating any memory. Returns false if the parents must be searched.
+bool cachedProjectSdk(FixedPath *sdk)
+{
+    if (readProjectPin(projectPinName, sdk))
+        return !sdk->overflow;
+
+    struct stat here;
+    FixedPath cacheFile;
+    return cacheEnabled() && stat(".", &here) == 0 && projectCacheFileName(&cacheFile, here)
+            && lookupProjectCache(cacheFile.c_str(), sdk);
+}
+
+// Returns the SDK named by the closest .qtchooser file, or an empty string
+string projectSdk()
+{
+    TraceScope trace("projectSdk");
+    FixedPath sdk;
+    if (cachedProjectSdk(&sdk))
+        return sdk.c_str();
+
+    struct stat here;
+    if (stat(".", &here) != 0)
+        return string();
+    FixedPath cacheFile;
+    const bool useCache = cacheEnabled() && projectCacheFileName(&cacheFile, here);
+
+    // take each stamp before looking inside the directory, so that a change
+    // made while we're searching makes the entry stale instead of wrong
+    sdk.clear();
+    string contents = projectCacheHeader;
+    contents += '\n';
+    string dir = "..";
+    struct stat current = here;
+    for (int depth = 1; depth < MaxProjectDepth; ++depth, dir += "/..") {
+        struct stat st;
+        if (stat(dir.c_str(), &st) != 0 || st.st_dev != here.st_dev)
+            break;
+        if (st.st_ino == current.st_ino)
+            break;      // the root is its own parent
+        current = st;
+
+        contents += "dir " + fileStamp(dir) + ' ' + dir + '\n';
+        const string pin = dir + PATH_SEP + projectPinName;
+        const string stamp = fileStamp(pin);
+        if (readProjectPin(pin.c_str(), &sdk)) {
+            contents += "pin " + stamp + ' ' + pin + '\n';
+            break;
+        }
+    }
+
+    if (useCache)
+        writeFileAtomically(cacheFile.c_str(), contents);
+    return sdk.c_str();
+}
+
+// The "key=value" entries that may follow the first two lines of a config file
+static const struct {
+    const char *key;
+    string Sdk::*value;
+} configKeys[] = {
+    { "prefix", &Sdk::prefix },
+    { "headers", &Sdk::headersPath },
+    { "plugins", &Sdk::pluginsPath },
+    { "libpath", &Sdk::libraryPathMode }
+};
+
+// Parses the contents of a config file in place:
+// 1) the first line contains the path to the Qt tools like qmake
+// 2) the second line contains the path to the Qt libraries
+// 3) further lines are "key=value" entries from configKeys; lines without an
+//    '=', lines starting with '#' and unknown keys are ignored
+// Returns false if there is no second line.
+static bool parseConfig(const char *data, size_t len, Sdk &sdk)
+{
+    const char *end = data + len;
+    const char *nl = static_cast<const char *>(memchr(data, '\n', len));
+    if (!nl || nl + 1 == end)
+        return false;
+    sdk.toolsPath.assign(data, nl);
+
+    const char *line = nl + 1;
+    nl = static_cast<const char *>(memchr(line, '\n', end - line));
+    if (!nl)
+        nl = end;
+    sdk.librariesPath.assign(line, nl);
+
+    for (size_t i = 0; i < sizeof configKeys / sizeof configKeys[0]; ++i)
+        (sdk.*configKeys[i].value).clear();
+    for (line = nl + 1; line < end; line = nl + 1) {
+        nl = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (!nl)
+            nl = end;
+        const char *eq = static_cast<const char *>(memchr(line, '=', nl - line));
+        if (!eq || *line == '#')
+            continue;
+        for (size_t i = 0; i < sizeof configKeys / sizeof configKeys[0]; ++i) {
+            if (strlen(configKeys[i].key) == size_t(eq - line)
+                    && memcmp(configKeys[i].key, line, eq - line) == 0) {
+                (sdk.*configKeys[i].value).assign(eq + 1, nl);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+// Sets the entry named key, as a "key=value" line would; returns false if
+// there is no such key.
+bool setConfigValue(Sdk &sdk, const string &key, const string &value)
+{
+    for (size_t i = 0; i < sizeof configKeys / sizeof configKeys[0]; ++i) {
+        if (key == configKeys[i].key) {
+            sdk.*configKeys[i].value = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The contents of a config file that parseConfig() reads back as sdk
+string configFileContents(const Sdk &sdk)
+{
+    string contents = sdk.toolsPath + '\n' + sdk.librariesPath + '\n';
+    for (size_t i = 0; i < sizeof configKeys / sizeof configKeys[0]; ++i) {
+        const string &value = sdk.*configKeys[i].value;
+        if (!value.empty())
+            contents += string(configKeys[i].key) + '=' + value + '\n';
+    }
+    return contents;
+}
+
+// Reads and parses the SDK's config file, setting its state. Returns false
+// if the file can't be opened, leaving it Unreadable with errno in error.
+bool readConfigFile(Sdk &sdk)
+{
+    int fd = ::open(sdk.configFile.c_str(), O_RDONLY);
+    if (fd == -1) {
+        sdk.state = Unreadable;
+        sdk.error = errno;
+        return false;
+    }
+
+    // config files are small: read it in one go and parse it in place
+    char buf[MaxConfigSize];
+    ssize_t len = ::read(fd, buf, sizeof buf);
+    ::close(fd);
+    if (len == sizeof buf) {
+        // too long: drop the incomplete last line
+        while (len && buf[len - 1] != '\n')
+            --len;
+    }
+    sdk.state = len > 0 && parseConfig(buf, len, sdk) ? Parsed : Malformed;
+    return true;
+}
+
+bool Resolver::matchSdk(const string &targetSdk, Sdk &sdk)
+{
+    if (targetSdk == sdk.name || (targetSdk.empty() && sdk.name == "default")) {
+        if (sdk.state != Unparsed)
+            return sdk.state == Parsed;
+
+        TraceScope trace("matchSdk", sdk.configFile.c_str());
+        readConfigFile(sdk);
+        return sdk.state == Parsed;
+    }
+
+    return false;
+}
+
+} // namespace QtChooser
+
+using namespace QtChooser;
+
+static int copyResult(const string &value, char *buffer, size_t size)
+{
+    if (value.size() >= size)
+        return QTCHOOSER_ERROR_BUFFER;
+    memcpy(buffer, value.c_str(), value.size() + 1);
+    return 0;
+}
+
+static int selectError(const Sdk &sdk)
+{
+    return sdk.state == Unreadable ? QTCHOOSER_ERROR_CONFIG : QTCHOOSER_ERROR_NOT_FOUND;
+}
+
+int qtchooser_resolve(const char *sdk, const char *tool, char *buffer, size_t size)
+{
+    if (!tool || !*tool || strchr(tool, '/') || !buffer)
+        return QTCHOOSER_ERROR_INVALID;
+
+    Resolver resolver;
+    Resolution resolution;
+    if (!resolver.resolve(sdk ? sdk : "", tool, &resolution))
+        return selectError(resolution.sdk);
+    return copyResult(resolution.tool, buffer, size);
+}
+
+int qtchooser_libraries_path(const char *sdk, char *buffer, size_t size)
+{
+    if (!buffer)
+        return QTCHOOSER_ERROR_INVALID;
+
+    Resolver resolver;
+    Sdk selected = resolver.selectSdk(sdk ? sdk : "");
+    if (!selected.isValid())
+        return selectError(selected);
+    if (selected.librariesPath[0] == '~')
+        selected.librariesPath = userHome() + selected.librariesPath.substr(1);
+    return copyResult(selected.librariesPath, buffer, size);
+}
+
+const char *qtchooser_strerror(int error)
+{
+    switch (error) {
+    case 0:
+        return "Success";
+    case QTCHOOSER_ERROR_NOT_FOUND:
+        return "No matching Qt installation";
+    case QTCHOOSER_ERROR_CONFIG:
+        return "Could not read the config file of the Qt installation";
+    case QTCHOOSER_ERROR_BUFFER:
+        return "Buffer too small";
+    case QTCHOOSER_ERROR_INVALID:
+        return "Invalid argument";
+    }
+    return "Unknown error";
+}
@@ -0,0 +1,92 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Intel Corporation.
+** Contact: http://www.qt-project.org/legal
+**
+** This file is part of the QtCore module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and Digia.  For licensing terms and
+** conditions see http://qt.digia.com/licensing.  For further information
+** use the contact form at http://qt.digia.com/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** In addition, as a special exception, Digia gives you certain additional
+** rights.  These rights are described in the Digia Qt LGPL Exception
+** version 1.1, included in the file LGPL_EXCEPTION.txt in this package.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+/*
+ * libqtchooser: finds the Qt tools the way the qtchooser wrapper does, for
+ * programs that would otherwise run "qtchooser -print-env" or a wrapped tool
+ * just to learn which one would run. The same configuration files, search
+ * paths, version selectors and caches are used, so the answers are the same.
+ *
+ * Every function is reentrant and may be called from several threads at the
+ * same time. They return 0 on success or one of the QTCHOOSER_ERROR codes.
+ * Strings are written to a caller-provided buffer, NUL-terminated. An sdk of
+ * NULL or "" selects the default version, as an empty QT_SELECT does; the
+ * QT_SELECT variable and .qtchooser files are not consulted.
+ */
+
+#ifndef QTCHOOSER_H
+#define QTCHOOSER_H
+
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#  define QTCHOOSER_EXPORT __attribute__((visibility("default")))
+#else
+#  define QTCHOOSER_EXPORT
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+    QTCHOOSER_ERROR_NOT_FOUND = 1,      /* no Qt installation matches sdk */
+    QTCHOOSER_ERROR_CONFIG = 2,         /* the matching config file could not be read */
+    QTCHOOSER_ERROR_BUFFER = 3,         /* the result does not fit in the buffer */
+    QTCHOOSER_ERROR_INVALID = 4         /* invalid argument */
+};
+
+/* Stores the path of the tool that "qtchooser -qt=<sdk> -run-tool=<tool>"
+ * would run. Like the wrapper, it does not check that the tool exists,
+ * unless the default version lacks it and it may be taken from another one. */
+QTCHOOSER_EXPORT int qtchooser_resolve(const char *sdk, const char *tool, char *buffer, size_t size);
+
+/* Stores the libraries directory of the selected Qt installation */
+QTCHOOSER_EXPORT int qtchooser_libraries_path(const char *sdk, char *buffer, size_t size);
+
+/* Returns a static description of an error code */
+QTCHOOSER_EXPORT const char *qtchooser_strerror(int error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QTCHOOSER_H */
@@ -1,6 +1,7 @@
 TEMPLATE = app
 DESTDIR = ../../bin
 CONFIG -= qt
-SOURCES += main.cpp Makefile
+SOURCES += main.cpp outputcache.cpp qtchooser.cpp Makefile
+HEADERS += qtchooser.h qtchooser_p.h
 
 error("This .pro file is not meant to be used to build")
@@ -0,0 +1,449 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Intel Corporation.
+** Contact: http://www.qt-project.org/legal
+**
+** This file is part of the QtCore module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and Digia.  For licensing terms and
+** conditions see http://qt.digia.com/licensing.  For further information
+** use the contact form at http://qt.digia.com/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** In addition, as a special exception, Digia gives you certain additional
+** rights.  These rights are described in the Digia Qt LGPL Exception
+** version 1.1, included in the file LGPL_EXCEPTION.txt in this package.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+// Declarations shared by libqtchooser and the qtchooser executable. This is
+// not a public API: applications use the C functions in qtchooser.h.
+
+#ifndef QTCHOOSER_P_H
+#define QTCHOOSER_P_H
+
+#define _CRT_SECURE_NO_WARNINGS
+#define _POSIX_C_SOURCE 200809L
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(_WIN32) || defined(__WIN32__)
+#  include <process.h>
+#  define execv _execv
+#  define stat _stat
+#  define PATH_SEP "\\"
+#  define EXE_SUFFIX ".exe"
+#else
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <dirent.h>
+#  include <fcntl.h>
+#  include <libgen.h>
+#  include <poll.h>
+#  include <pthread.h>
+#  include <pwd.h>
+#  include <spawn.h>
+#  include <sys/mman.h>
+#  include <sys/uio.h>
+#  include <sys/wait.h>
+#  include <unistd.h>
+#  define PATH_SEP "/"
+#  define EXE_SUFFIX ""
+#endif
+#if defined(__linux__)
+#  include <elf.h>
+#endif
+
+namespace QtChooser {
+
+using namespace std;
+
+static const char confSuffix[] = ".conf";
+enum { MaxConfigSize = 16384, MaxTempFileAttempts = 100 };
+
+// Tracing of the resolution phases, enabled by setting QTCHOOSER_TRACE to a
+// file name. Events are buffered in the Chrome trace-event format and
+// appended to the file with a single write just before we exec or exit, so
+// traces from parallel jobs can share one file and load in chrome://tracing
+// or Perfetto. When the variable is unset, each TraceScope costs one test.
+extern const char *traceFile;
+
+double traceTimestamp();
+void traceEvent(const char *name, char phase, double start, double end, const char *path);
+void traceFlush();
+
+struct TraceScope
+{
+    const char *name;
+    const char *path;
+    double start;
+
+    TraceScope(const char *name, const char *path = 0)
+        : name(name), path(path), start(traceFile ? traceTimestamp() : 0)
+    {}
+    ~TraceScope()
+    {
+        if (traceFile)
+            traceEvent(name, 'X', start, traceTimestamp(), path);
+    }
+};
+
+// A string in a fixed-size buffer. Running a tool that the caches can answer
+// builds its paths in these, so that it allocates no memory at all; a string
+// that doesn't fit sets overflow and the slow path is taken instead.
+enum { MaxPathLength = 4096, MaxStampLength = 96, MaxSearchPaths = 64 };
+
+template <size_t Size> struct FixedString
+{
+    FixedString() : length(0), overflow(false) { data[0] = '\0'; }
+
+    char data[Size];
+    size_t length;
+    bool overflow;
+
+    const char *c_str() const { return data; }
+    void clear() { length = 0; overflow = false; data[0] = '\0'; }
+    FixedString &append(const char *s, size_t len)
+    {
+        if (overflow || len >= Size - length) {
+            overflow = true;
+            return *this;
+        }
+        memcpy(data + length, s, len);
+        length += len;
+        data[length] = '\0';
+        return *this;
+    }
+    FixedString &append(const char *s) { return append(s, strlen(s)); }
+};
+typedef FixedString<MaxPathLength> FixedPath;
+
+// The search paths of Resolver::searchPaths(), NUL-separated in one buffer
+struct SearchPathList
+{
+    SearchPathList() : count(0) {}
+
+    FixedString<4 * MaxPathLength> buffer;
+    size_t offsets[MaxSearchPaths];
+    size_t count;
+
+    const char *at(size_t i) const { return buffer.data + offsets[i]; }
+};
+
+string to_number(int number);
+unsigned long long fnv1a(const char *data, size_t len, unsigned long long hash = 14695981039346656037ULL);
+string userHome();
+const char *userHome(char *buffer, size_t size);
+string qgetenv(const char *env, const string &defaultValue = string());
+vector<string> stringSplit(const char *source);
+bool mkparentdir(string name);
+string fileStamp(const string &path);
+const char *fileStamp(const char *path, char *stamp);    // stamp has MaxStampLength chars
+bool readSmallFile(const string &path, string *contents);
+ssize_t readSmallFile(const char *path, char *buffer, size_t size);
+bool readFile(const string &path, string *contents);
+bool writeFileAtomically(const string &fileName, const string &contents);
+bool writeFileDurably(const string &fileName, const string &contents, bool replace,
+                      bool syncDirectory = true);
+bool syncDir(const string &dir);
+bool cacheEnabled();
+string cacheFileName(const char *kind, const string &targetSdk, const string &targetTool,
+                     const vector<string> &paths);
+bool cacheFileName(FixedPath *name, const char *kind, unsigned long long hash);
+bool fallbackAllowed(const char *tool);
+static inline bool fallbackAllowed(const string &tool) { return fallbackAllowed(tool.c_str()); }
+
+// The output cache of deterministic tools, see outputcache.cpp
+bool outputCacheEnabled(const char *targetTool);
+bool runToolCached(const string &targetTool, const string &tool, const string &configFile, char **argv,
+                   char **command, int *exitCode);
+int printOutputCacheStats();
+
+// How much of an SDK's config file is known
+enum ParseState { Unparsed, Parsed, Malformed, Unreadable };
+
+struct Sdk
+{
+    Sdk() : state(Unparsed), error(0) {}
+
+    string name;
+    string configFile;
+    string toolsPath;
+    string librariesPath;
+
+    // optional "key=value" entries of the config file
+    string prefix;
+    string headersPath;
+    string pluginsPath;
+    string libraryPathMode;         // how the tools find librariesPath, see execTool
+
+    ParseState state;
+    int error;                      // errno, if the config file is Unreadable
+
+    bool isValid() const { return !toolsPath.empty(); }
+    bool hasTool(const string &targetTool) const;
+};
+
+bool readConfigFile(Sdk &sdk);
+bool setConfigValue(Sdk &sdk, const string &key, const string &value);
+string configFileContents(const Sdk &sdk);
+
+// An SDK's version, as parsed from its name, for the -qt= version selectors
+typedef vector<unsigned long> Version;
+struct VersionedSdk
+{
+    Version version;
+    string name;
+};
+
+// Version selectors, accepted by -qt= when no SDK has that exact name:
+//   latest         the SDK with the highest version
+//   5, 5.12        the highest version starting with these numbers
+//   >=5.12, >5.12, <=5.12, <6
+// An SDK's version comes from its name: an optional "qt" followed by numbers
+// separated by dots, as in "5.15.2-gcc_64" or "qt5-x86_64-linux-gnu". SDKs
+// whose names have no version are never selected this way.
+struct VersionSelector
+{
+    enum Operator { Latest, Prefix, Less, LessEqual, Greater, GreaterEqual } op;
+    Version version;
+};
+
+bool parseVersionSelector(const string &selector, VersionSelector *result);
+bool versionMatches(const VersionSelector &selector, const Version &version);
+vector<VersionedSdk> versionedSdks(const vector<Sdk> &sdks);
+
+// A registry is a compiled config directory: "-compile <dir>" writes
+// <dir>.registry next to it, and as long as the directory's stamp matches the
+// one recorded in it, the SDKs are taken from the registry instead of listing
+// the directory and reading its files. Editing a config file in place does
+// not change the directory's stamp, so the registry must be compiled again
+// after doing that.
+//
+// The file is mapped into memory as is. It has a RegistryHeader, then the
+// buckets and the slots of a perfect hash table of the SDK names, then one
+// RegistryEntry per config file in directory order, then the NUL-terminated
+// strings that the header and the entries point to. A name's hash selects a
+// bucket, whose displacement reseeds the hash to select the slot holding the
+// index of the name's entry (the "hash and displace" construction).
+static const uint32_t registryMagic = 0x52435451;
+static const uint16_t registryVersion = 2;
+static const char registrySuffix[] = ".registry";
+enum { RegistryNoEntry = 0xffffffff, RegistryMalformed = 1, MaxDisplacement = 1 << 16 };
+
+struct RegistryHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t fileSize;
+    uint32_t stamp;             // of the directory, taken before listing it
+    uint32_t entryCount;
+    uint32_t bucketCount;
+    uint32_t slotCount;
+};
+
+struct RegistryEntry
+{
+    uint32_t flags;
+    // offsets of the strings from the start of the file
+    uint32_t name;
+    uint32_t toolsPath;
+    uint32_t librariesPath;
+    uint32_t prefix;
+    uint32_t headersPath;
+    uint32_t pluginsPath;
+    uint32_t libraryPathMode;
+};
+
+uint32_t registryHash(const string &name, uint32_t displacement);
+
+static inline const uint32_t *registryBuckets(const RegistryHeader *registry)
+{
+    return reinterpret_cast<const uint32_t *>(registry + 1);
+}
+
+static inline const uint32_t *registrySlots(const RegistryHeader *registry)
+{
+    return registryBuckets(registry) + registry->bucketCount;
+}
+
+static inline const RegistryEntry *registryEntries(const RegistryHeader *registry)
+{
+    return reinterpret_cast<const RegistryEntry *>(registrySlots(registry) + registry->slotCount);
+}
+
+static inline const char *registryString(const RegistryHeader *registry, uint32_t offset)
+{
+    // the file ends in a NUL, so every offset inside it starts a string
+    if (offset >= registry->fileSize)
+        return "";
+    return reinterpret_cast<const char *>(registry) + offset;
+}
+
+string registryFileName(string dir);
+const RegistryHeader *openRegistry(const string &path);
+void closeRegistry(const RegistryHeader *registry);
+
+// Keeps the registry of a search path mapped while in scope
+class OpenRegistry
+{
+public:
+    explicit OpenRegistry(const string &path) : registry(openRegistry(path)) {}
+    ~OpenRegistry() { closeRegistry(registry); }
+    const RegistryHeader *header() const { return registry; }
+
+private:
+    OpenRegistry(const OpenRegistry &);
+    OpenRegistry &operator=(const OpenRegistry &);
+    const RegistryHeader *registry;
+};
+const RegistryEntry *findRegistryEntry(const RegistryHeader *registry, const string &name);
+void loadRegistryEntry(const RegistryHeader *registry, const RegistryEntry *entry, Sdk &sdk);
+
+// The names of the SDKs seen so far, for shadowing. Each name is copied once,
+// as its file name, into a bump arena that is freed as a whole, and found
+// again through an open-addressing hash table of pointers into the arena.
+class SdkNameSet
+{
+public:
+    SdkNameSet() : count(0), blockUsed(BlockSize) { slots.resize(256); }
+    ~SdkNameSet()
+    {
+        for (size_t i = 0; i < blocks.size(); ++i)
+            free(blocks[i]);
+    }
+
+    // Returns false if the name was already in the set
+    bool insert(const char *name, size_t len);
+    bool insert(const string &name) { return insert(name.data(), name.size()); }
+
+    // The "<name>.conf" strings, in no particular order
+    vector<const char *> fileNames() const;
+
+private:
+    struct Slot {
+        const char *fileName;
+        uint32_t hash;
+        uint32_t length;    // of the name, without the suffix
+    };
+    enum { BlockSize = 65536 };
+
+    char *allocate(size_t size);
+    void grow();
+
+    vector<Slot> slots;     // a power of two, at most half full
+    size_t count;
+    vector<char *> blocks;
+    size_t blockUsed;
+
+    SdkNameSet(const SdkNameSet &);
+    SdkNameSet &operator=(const SdkNameSet &);
+};
+
+void listSdkNames(const string &path, SdkNameSet *names);
+void listSdks(const string &path, vector<Sdk> *sdks, bool useRegistry = true);
+string projectSdk();
+bool cachedProjectSdk(FixedPath *sdk);
+
+// The outcome of resolving a tool with Resolver::resolve()
+struct Resolution
+{
+    Resolution() : cacheHit(false), usedFallback(false) {}
+
+    Sdk sdk;                // the SDK selected, unless the cache answered
+    string tool;            // the path of the tool, with "~" expanded
+    string configFile;
+    string librariesPath;   // with "~" expanded too
+    string libraryPathMode;
+    bool cacheHit;
+    bool usedFallback;
+};
+
+// What the resolution cache has for a tool, for runTool's fast path
+struct CachedTool
+{
+    FixedPath tool;
+    FixedPath configFile;
+    FixedPath librariesPath;
+    FixedString<16> libraryPathMode;
+};
+
+// Finds SDKs and tools the way the wrapper does. Unless preloadSdks() was
+// called, it has no state, so any number of threads may use it at the same
+// time.
+class Resolver
+{
+public:
+    Resolver() : preloaded(false) {}
+
+    void preloadSdks();
+    vector<string> searchPaths() const;
+    bool searchPaths(SearchPathList *paths) const;
+    vector<Sdk> allSdks() const;
+
+    typedef bool (*VisitFunction)(const string &targetSdk, Sdk &item);
+    Sdk iterateSdks(const string &targetSdk, VisitFunction visit, const string &targetTool = "");
+    Sdk findSdk(const string &targetSdk);
+    Sdk selectSdk(const string &targetSdk, const string &targetTool = "", bool *usedFallback = 0);
+    bool resolve(const string &targetSdk, const string &targetTool, Resolution *result);
+
+    bool lookupCachedTool(const string &targetSdk, const string &targetTool, Resolution *result) const;
+    bool lookupCachedTool(const char *targetSdk, const char *targetTool, CachedTool *result) const;
+    void cacheTool(const string &targetSdk, const string &targetTool, const vector<string> &paths,
+                   const vector<string> &stamps, const Resolution &result) const;
+    Sdk findSdkWithTool(const string &targetTool);
+    Sdk findSdkByVersion(const string &selector);
+    bool lookupVersionIndex(const vector<string> &paths, vector<VersionedSdk> *index) const;
+    bool lookupFallbackIndex(const vector<string> &paths, const string &targetTool, Sdk *sdk) const;
+
+    static bool matchSdk(const string &targetSdk, Sdk &sdk);
+
+private:
+    // the SDKs listed by preloadSdks(), with the config files read as needed
+    bool preloaded;
+    vector<Sdk> preloadedSdks;
+    map<string, size_t> preloadedNames;
+    vector<VersionedSdk> preloadedVersions;
+};
+
+} // namespace QtChooser
+
+#endif // QTCHOOSER_P_H
@@ -0,0 +1,241 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Intel Corporation.
+** Contact: http://www.qt-project.org/legal
+**
+** This file is part of the Qt tool chooser of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and Digia.  For licensing terms and
+** conditions see http://qt.digia.com/licensing.  For further information
+** use the contact form at http://qt.digia.com/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** In addition, as a special exception, Digia gives you certain additional
+** rights.  These rights are described in the Digia Qt LGPL Exception
+** version 1.1, included in the file LGPL_EXCEPTION.txt in this package.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+/*
+ * Measures how many resolutions per second libqtchooser answers as more
+ * threads call it at the same time, with and without the resolution cache.
+ * It creates a synthetic tree of config files in a temporary directory and
+ * checks every answer against the one expected.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "qtchooser.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char root[] = "/tmp/qtchooser-resolve-bench.XXXXXX";
+static int configCount = 100;
+static double duration = 0.5;           /* seconds per measurement */
+
+struct Worker
+{
+    pthread_t thread;
+    int index;
+    int *running;
+    long count;
+    long errors;
+};
+
+static void die(const char *what, const char *path)
+{
+    fprintf(stderr, "qtchooser-resolve-bench: %s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+}
+
+static void makeDir(const char *path)
+{
+    if (mkdir(path, 0755) == -1 && errno != EEXIST)
+        die("could not create", path);
+}
+
+static void writeConfig(const char *name, int sdk)
+{
+    char path[512];
+    FILE *f;
+    snprintf(path, sizeof path, "%s/config/qtchooser/%s.conf", root, name);
+    f = fopen(path, "w");
+    if (!f)
+        die("could not write", path);
+    fprintf(f, "%s/sdk%d/bin\n%s/sdk%d/lib\n", root, sdk, root, sdk);
+    fclose(f);
+}
+
+static void createTree(void)
+{
+    char path[512];
+    int i;
+    if (!mkdtemp(root))
+        die("could not create", root);
+    snprintf(path, sizeof path, "%s/config", root);
+    makeDir(path);
+    snprintf(path, sizeof path, "%s/config/qtchooser", root);
+    makeDir(path);
+    snprintf(path, sizeof path, "%s/cache", root);
+    makeDir(path);
+
+    writeConfig("default", 0);
+    for (i = 0; i < configCount; ++i) {
+        char name[32];
+        snprintf(name, sizeof name, "qt5.%d", i);
+        writeConfig(name, i);
+    }
+
+    snprintf(path, sizeof path, "%s/config", root);
+    setenv("XDG_CONFIG_HOME", path, 1);
+    setenv("XDG_CONFIG_DIRS", path, 1);
+    snprintf(path, sizeof path, "%s/cache", root);
+    setenv("XDG_CACHE_HOME", path, 1);
+    setenv("QTCHOOSER_NO_GLOBAL_DIR", "1", 1);
+}
+
+static void removeTree(void)
+{
+    char command[600];
+    snprintf(command, sizeof command, "rm -rf '%s'", root);
+    if (system(command) != 0)
+        fprintf(stderr, "qtchooser-resolve-bench: could not remove %s\n", root);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *work(void *arg)
+{
+    struct Worker *w = arg;
+    char sdk[32], expected[512], buffer[512];
+    unsigned i = w->index;
+    int sdkIndex, error;
+
+    while (__sync_fetch_and_add(w->running, 0)) {
+        /* alternate between the default and a named SDK */
+        i = i * 1103515245 + 12345;
+        sdkIndex = (i >> 8) % (configCount + 1) - 1;
+        if (sdkIndex < 0)
+            sdk[0] = '\0';
+        else
+            snprintf(sdk, sizeof sdk, "qt5.%d", sdkIndex);
+        snprintf(expected, sizeof expected, "%s/sdk%d/bin/moc", root, sdkIndex < 0 ? 0 : sdkIndex);
+
+        error = qtchooser_resolve(sdk, "moc", buffer, sizeof buffer);
+        if (error || strcmp(buffer, expected) != 0)
+            ++w->errors;
+        ++w->count;
+    }
+    return 0;
+}
+
+static void measure(const char *name, int threads)
+{
+    struct Worker *workers = calloc(threads, sizeof(struct Worker));
+    int running = 1;
+    long count = 0, errors = 0;
+    double start, elapsed;
+    int i;
+
+    start = now();
+    for (i = 0; i < threads; ++i) {
+        workers[i].index = i;
+        workers[i].running = &running;
+        if ((errno = pthread_create(&workers[i].thread, 0, work, &workers[i])) != 0)
+            die("could not start", "thread");
+    }
+    while (now() - start < duration) {
+        struct timespec tick = { 0, 10000000 };
+        nanosleep(&tick, 0);
+    }
+    __sync_lock_test_and_set(&running, 0);
+    for (i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, 0);
+        count += workers[i].count;
+        errors += workers[i].errors;
+    }
+    elapsed = now() - start;
+
+    printf("%-8s %7d %15.0f %7ld\n", name, threads, count / elapsed, errors);
+    fflush(stdout);
+    free(workers);
+    if (errors)
+        exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxThreads = cpus > 1 ? cpus : 1;
+    int opt, threads;
+
+    while ((opt = getopt(argc, argv, "n:d:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            configCount = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 't':
+            maxThreads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n configs] [-d seconds] [-t max threads]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (configCount < 1 || maxThreads < 1 || duration <= 0) {
+        fprintf(stderr, "qtchooser-resolve-bench: invalid option\n");
+        return 2;
+    }
+
+    createTree();
+    printf("%-8s %7s %15s %7s\n", "mode", "threads", "resolutions/s", "errors");
+
+    for (threads = 1; threads <= maxThreads; threads *= 2)
+        measure("cached", threads);
+
+    setenv("QTCHOOSER_NO_CACHE", "1", 1);
+    for (threads = 1; threads <= maxThreads; threads *= 2)
+        measure("uncached", threads);
+
+    removeTree();
+    return 0;
+}
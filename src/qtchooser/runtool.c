@@ -0,0 +1,594 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Intel Corporation.
+** Contact: http://www.qt-project.org/legal
+**
+** This file is part of the Qt tool chooser of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and Digia.  For licensing terms and
+** conditions see http://qt.digia.com/licensing.  For further information
+** use the contact form at http://qt.digia.com/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** In addition, as a special exception, Digia gives you certain additional
+** rights.  These rights are described in the Digia Qt LGPL Exception
+** version 1.1, included in the file LGPL_EXCEPTION.txt in this package.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+/*
+ * Minimal-startup variant of qtchooser, built as qtchooser-static. It only
+ * implements running a tool (the <executable name> and -run-tool forms),
+ * with the same search paths, precedence and fallback rules as main.cpp,
+ * in plain C with fixed-size buffers: no C++ runtime, no static
+ * initializers and no heap allocations, so it can be linked as a static PIE
+ * that the kernel starts without involving the dynamic loader.
+ *
+ * Anything else (-list-versions, -print-env, -install, ...) is forwarded to
+ * the full qtchooser binary by exec'ing it with the same arguments. So is
+ * running a tool with a -qt= or QT_SELECT value that isn't the name of a
+ * config file, which may be a version selector, and running a tool in the
+ * ldso library path mode, which needs the tool's ELF headers parsed. The
+ * env mode is handled here.
+ *
+ * Differences from main.cpp: $HOME is not looked up in the password database
+ * if it is unset (that requires NSS, which doesn't work in static binaries)
+ * and neither the resolution cache nor the cache of .qtchooser lookups is
+ * used, since the lookups they save are already a handful of system calls
+ * here.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE     /* for d_type, like g++ gives main.cpp */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef QTCHOOSER_BINDIR
+#  define QTCHOOSER_BINDIR "/usr/bin"
+#endif
+
+static const char confSuffix[] = ".conf";
+static const char projectPinName[] = ".qtchooser";
+enum { MaxProjectDepth = 32 };
+
+enum { MaxConfigSize = 16384 };
+
+struct Sdk
+{
+    char toolsPath[PATH_MAX];
+    char librariesPath[PATH_MAX];
+    char libraryPathMode[16];   /* the libpath= key; other keys aren't needed */
+};
+
+struct SearchPaths
+{
+    int stage;
+    const char *cursor;
+};
+
+static const char *baseName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static int beginsWith(const char *haystack, const char *needle)
+{
+    return strncmp(haystack, needle, strlen(needle)) == 0;
+}
+
+static int endsWith(const char *haystack, const char *needle)
+{
+    size_t haystackLen = strlen(haystack);
+    size_t needleLen = strlen(needle);
+    if (needleLen > haystackLen)
+        return 0;
+    return strcmp(haystack + haystackLen - needleLen, needle) == 0;
+}
+
+/* Joins up to three strings into buf; returns 0 if they don't fit. */
+static int join(char *buf, size_t size, const char *a, const char *b, const char *c)
+{
+    int n = snprintf(buf, size, "%s%s%s", a, b, c);
+    return n >= 0 && (size_t)n < size;
+}
+
+/*
+ * Iterates over the same list as ToolWrapper::searchPaths() in main.cpp:
+ * $XDG_CONFIG_HOME (or $HOME/.config), each entry of $XDG_CONFIG_DIRS (or
+ * /etc/xdg), then QTCHOOSER_GLOBAL_DIR. Each result ends in "/qtchooser/".
+ */
+static int nextSearchPath(struct SearchPaths *it, char *buf, size_t size)
+{
+    const char *value;
+    const char *end;
+    while (1) {
+        switch (it->stage) {
+        case 0:
+            it->stage = 1;
+            value = getenv("XDG_CONFIG_HOME");
+            if (value)
+                return join(buf, size, value, "/qtchooser/", "");
+            value = getenv("HOME");
+            return join(buf, size, value ? value : "", "/.config", "/qtchooser/");
+
+        case 1:
+            value = getenv("XDG_CONFIG_DIRS");
+            it->cursor = value ? value : "/etc/xdg";
+            it->stage = *it->cursor ? 2 : 3;
+            continue;
+
+        case 2:
+        case 4:
+            end = strchr(it->cursor, ':');
+            if (!end)
+                end = it->cursor + strlen(it->cursor);
+            if ((size_t)(end - it->cursor) + sizeof "/qtchooser/" > size)
+                return 0;
+            memcpy(buf, it->cursor, end - it->cursor);
+            strcpy(buf + (end - it->cursor), "/qtchooser/");
+            if (*end)
+                it->cursor = end + 1;
+            else
+                ++it->stage;
+            return 1;
+
+        case 3:
+            it->stage = 5;
+#if defined(QTCHOOSER_GLOBAL_DIR)
+            value = getenv("QTCHOOSER_NO_GLOBAL_DIR");
+            if ((!value || !*value) && *QTCHOOSER_GLOBAL_DIR) {
+                it->cursor = QTCHOOSER_GLOBAL_DIR;
+                it->stage = 4;
+            }
+#endif
+            continue;
+
+        default:
+            return 0;
+        }
+    }
+}
+
+/* Reads a config file; same rules as parseConfig() in qtchooser.cpp. */
+static int readConfig(const char *configFile, struct Sdk *sdk)
+{
+    char buf[MaxConfigSize + 1];
+    ssize_t len;
+    int fd = open(configFile, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "qtchooser: could not open config file '%s': %s\n",
+                configFile, strerror(errno));
+        exit(1);
+    }
+    len = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (len == sizeof buf - 1) {
+        /* too long: drop the incomplete last line */
+        while (len && buf[len - 1] != '\n')
+            --len;
+    }
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    char *nl = strchr(buf, '\n');
+    if (!nl || nl + 1 == buf + len)
+        return 0;   /* need at least a second line */
+    *nl = '\0';
+    char *second = nl + 1;
+    char *line = buf + len;
+    nl = strchr(second, '\n');
+    if (nl) {
+        *nl = '\0';
+        line = nl + 1;
+    }
+
+    if (strlen(buf) >= sizeof sdk->toolsPath || strlen(second) >= sizeof sdk->librariesPath)
+        return 0;
+    strcpy(sdk->toolsPath, buf);
+    strcpy(sdk->librariesPath, second);
+
+    /* of the key=value lines, only libpath= matters here */
+    sdk->libraryPathMode[0] = '\0';
+    for ( ; line < buf + len; line = nl + 1) {
+        nl = strchr(line, '\n');
+        if (!nl)
+            nl = buf + len;
+        *nl = '\0';
+        if (beginsWith(line, "libpath=")) {
+            line += strlen("libpath=");
+            if (strlen(line) < sizeof sdk->libraryPathMode)
+                strcpy(sdk->libraryPathMode, line);
+            else
+                strcpy(sdk->libraryPathMode, "-");     /* not a mode we know */
+        }
+    }
+    return 1;
+}
+
+/* Same as libraryPathMode() in main.cpp, returning the name of the mode */
+static const char *libraryPathMode(const struct Sdk *sdk)
+{
+    const char *mode = getenv("QTCHOOSER_LIBPATH");
+    if (!*sdk->librariesPath)
+        return "";
+    return mode && *mode ? mode : sdk->libraryPathMode;
+}
+
+static int hasTool(const struct Sdk *sdk, const char *targetTool)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    if (!*sdk->toolsPath || !join(path, sizeof path, sdk->toolsPath, "/", targetTool))
+        return 0;
+    if (stat(path, &st))
+        return 0;
+    return (st.st_mode & S_IXUSR) != 0;
+}
+
+/* Same as ToolWrapper::findSdk() */
+static int findSdk(const char *name, struct Sdk *sdk)
+{
+    struct SearchPaths it = { 0, 0 };
+    char path[PATH_MAX];
+    char configFile[PATH_MAX];
+    struct stat st;
+
+    sdk->toolsPath[0] = '\0';
+    if (strchr(name, '/'))
+        return 0;
+    while (nextSearchPath(&it, path, sizeof path)) {
+        if (!join(configFile, sizeof configFile, path, "/", name)
+                || strlen(configFile) + sizeof confSuffix > sizeof configFile)
+            continue;
+        strcat(configFile, confSuffix);
+        if (lstat(configFile, &st) != 0 || S_ISDIR(st.st_mode))
+            continue;
+        return readConfig(configFile, sdk);
+    }
+    return 0;
+}
+
+/* Returns true if fileName exists in one of the first count search paths. */
+static int shadowedBy(const char *fileName, int count)
+{
+    struct SearchPaths it = { 0, 0 };
+    char path[PATH_MAX];
+    char configFile[PATH_MAX];
+    struct stat st;
+    while (count-- > 0 && nextSearchPath(&it, path, sizeof path)) {
+        if (join(configFile, sizeof configFile, path, "/", fileName)
+                && lstat(configFile, &st) == 0 && !S_ISDIR(st.st_mode))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Same as the fallback pass of ToolWrapper::selectSdk(): the first SDK in
+ * search order that has the tool. Instead of remembering the names already
+ * seen, each candidate checks whether an earlier search path has a file by
+ * the same name.
+ */
+static int findSdkWithTool(const char *targetTool, struct Sdk *sdk)
+{
+    struct SearchPaths it = { 0, 0 };
+    char path[PATH_MAX];
+    char configFile[PATH_MAX];
+    int index = 0;
+
+    sdk->toolsPath[0] = '\0';
+    for ( ; nextSearchPath(&it, path, sizeof path); ++index) {
+        DIR *dir = opendir(path);
+        struct dirent *d;
+        if (!dir)
+            continue;
+
+        while ((d = readdir(dir))) {
+#ifdef _DIRENT_HAVE_D_TYPE
+            if (d->d_type == DT_DIR)
+                continue;
+#endif
+            size_t fnamelen = strlen(d->d_name);
+            if (fnamelen < sizeof(confSuffix))
+                continue;
+            if (memcmp(d->d_name + fnamelen + 1 - sizeof(confSuffix), confSuffix, sizeof confSuffix - 1) != 0)
+                continue;
+            if (shadowedBy(d->d_name, index))
+                continue;
+            if (!join(configFile, sizeof configFile, path, "/", d->d_name))
+                continue;
+            if (readConfig(configFile, sdk) && hasTool(sdk, targetTool)) {
+                closedir(dir);
+                return 1;
+            }
+        }
+        closedir(dir);
+    }
+    sdk->toolsPath[0] = '\0';
+    return 0;
+}
+
+static int isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/*
+ * Same as readProjectPin() in qtchooser.cpp: the first line that isn't blank
+ * or a comment names the SDK, and an empty pin selects the default. Returns
+ * -1 if the file can't be read, 0 if the name doesn't fit.
+ */
+static int readProjectPin(const char *fileName, char *sdk, size_t size)
+{
+    char buf[65536];
+    const char *line, *end;
+    ssize_t len;
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    len = read(fd, buf, sizeof buf);
+    close(fd);
+    if (len < 0)
+        return -1;
+
+    *sdk = '\0';
+    for (line = buf, end = buf + len; line < end; ) {
+        const char *nl = memchr(line, '\n', end - line);
+        const char *begin = line;
+        const char *last;
+        if (!nl)
+            nl = end;
+        last = nl;
+        line = nl + 1;
+        while (begin < last && isBlank(*begin))
+            ++begin;
+        while (last > begin && isBlank(last[-1]))
+            --last;
+        if (begin < last && *begin != '#') {
+            if ((size_t)(last - begin) >= size)
+                return 0;
+            memcpy(sdk, begin, last - begin);
+            sdk[last - begin] = '\0';
+            break;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Same as projectSdk() in qtchooser.cpp: reads the closest .qtchooser, in the
+ * current directory or in one of its parents on the same filesystem. Returns
+ * -1 if there is none and 0 if the full qtchooser must read it.
+ */
+static int projectSdk(char *sdk, size_t size)
+{
+    char dir[3 * MaxProjectDepth];
+    char pin[sizeof dir + sizeof projectPinName];
+    struct stat here, current, st;
+    int depth, result;
+
+    result = readProjectPin(projectPinName, sdk, size);
+    if (result != -1)
+        return result;
+    if (stat(".", &here) != 0)
+        return -1;
+
+    current = here;
+    strcpy(dir, "..");
+    for (depth = 1; depth < MaxProjectDepth; ++depth, strcat(dir, "/..")) {
+        if (stat(dir, &st) != 0 || st.st_dev != here.st_dev)
+            break;
+        if (st.st_ino == current.st_ino)
+            break;      /* the root is its own parent */
+        current = st;
+
+        join(pin, sizeof pin, dir, "/", projectPinName);
+        result = readProjectPin(pin, sdk, size);
+        if (result != -1)
+            return result;
+    }
+    return -1;
+}
+
+static int fallbackAllowed(const char *tool)
+{
+    return strcmp(tool, "qdbus") == 0 ||
+           strcmp(tool, "qml") == 0 ||
+           strcmp(tool, "qmlimportscanner") == 0 ||
+           strcmp(tool, "qmlscene") == 0 ||
+           strcmp(tool, "qtdiag") == 0 ||
+           strcmp(tool, "qtpaths") == 0 ||
+           strcmp(tool, "qtplugininfo") == 0;
+}
+
+/*
+ * Same as ToolWrapper::selectSdk(), except for version selectors. Returns 0
+ * if the full qtchooser must select the SDK instead.
+ */
+static int selectSdk(const char *targetSdk, const char *targetTool, struct Sdk *sdk)
+{
+    if (!findSdk(*targetSdk ? targetSdk : "default", sdk) && *targetSdk)
+        return 0;
+    if (!*targetSdk && !hasTool(sdk, targetTool) && fallbackAllowed(targetTool))
+        findSdkWithTool(targetTool, sdk);
+    return 1;
+}
+
+/* Execs the full qtchooser with our arguments */
+static int forward(const char *argv0, char **argv)
+{
+    /* it would take our own name for the name of the tool */
+    if (strcmp(argv0, "qtchooser-static") == 0)
+        argv[0] = (char *)QTCHOOSER_BINDIR "/qtchooser";
+    execv(QTCHOOSER_BINDIR "/qtchooser", argv);
+    fprintf(stderr, "%s: could not exec '%s': %s\n", argv0, QTCHOOSER_BINDIR "/qtchooser", strerror(errno));
+    return 1;
+}
+
+static int runTool(const char *argv0, const char *targetSdk, const char *targetTool,
+                   const struct Sdk *sdk, char **argv)
+{
+    char tool[PATH_MAX];
+    char buf[512];
+    ssize_t count;
+
+    if (!*sdk->toolsPath) {
+        fprintf(stderr, "%s: could not find a Qt installation of '%s'\n", argv0, targetSdk);
+        return 1;
+    }
+
+    if (sdk->toolsPath[0] == '~') {
+        const char *home = getenv("HOME");
+        if (!join(tool, sizeof tool, home ? home : "", sdk->toolsPath + 1, "/")
+                || strlen(tool) + strlen(targetTool) >= sizeof tool)
+            return 1;
+        strcat(tool, targetTool);
+    } else if (!join(tool, sizeof tool, sdk->toolsPath, "/", targetTool)) {
+        return 1;
+    }
+
+    /* same check as linksBackToSelf() in main.cpp */
+    count = readlink(tool, buf, sizeof(buf) - 1);
+    if (count >= 0) {
+        buf[count] = '\0';
+        if (endsWith(buf, argv0) == 0) {
+            fprintf(stderr, "%s: could not exec '%s' since it links to %s itself. Check your installation.\n",
+                    argv0, tool, argv0);
+            return 1;
+        }
+    }
+
+    /* "LD_LIBRARY_PATH=<librariesPath>:<LD_LIBRARY_PATH>" in the env mode */
+    static char libraryPath[sizeof "LD_LIBRARY_PATH=" + 2 * PATH_MAX];
+    if (strcmp(libraryPathMode(sdk), "env") == 0) {
+        const char *home = "";
+        const char *libraries = sdk->librariesPath;
+        const char *current = getenv("LD_LIBRARY_PATH");
+        int n;
+        if (*libraries == '~') {
+            home = getenv("HOME");
+            home = home ? home : "";
+            ++libraries;
+        }
+        if (!current)
+            current = "";
+        n = snprintf(libraryPath, sizeof libraryPath, "LD_LIBRARY_PATH=%s%s%s%s",
+                     home, libraries, *current ? ":" : "", current);
+        if (n >= 0 && (size_t)n < sizeof libraryPath)
+            putenv(libraryPath);
+        else
+            libraryPath[0] = '\0';
+    }
+
+    argv[0] = tool;
+#ifdef QTCHOOSER_TEST_MODE
+    for ( ; *argv; ++argv)
+        puts(*argv);
+    if (*libraryPath)
+        puts(libraryPath);
+    return 0;
+#else
+    execv(argv[0], argv);
+    fprintf(stderr, "%s: could not exec '%s': %s\n", argv0, argv[0], strerror(errno));
+    return 1;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    const char *argv0 = baseName(argv[0]);
+    const char *targetSdk = getenv("QT_SELECT");
+    const char *targetTool = argv0;
+    char pinnedSdk[PATH_MAX];
+    struct Sdk sdk;
+    int runToolMode = 0;
+    int optind = 1;
+
+    /* same argument handling as main() in main.cpp */
+    if (strcmp(targetTool, "qtchooser") == 0 || strcmp(targetTool, "qtchooser-static") == 0)
+        targetTool = getenv("QTCHOOSER_RUNTOOL");
+    else
+        runToolMode = 1;
+
+    for ( ; optind < argc; ++optind) {
+        char *arg = argv[optind];
+        if (*arg != '-')
+            break;
+        ++arg;
+        if (*arg == '-')
+            ++arg;
+        if (!*arg) {
+            ++optind;
+            break;
+        } else if (beginsWith(arg, "qt")) {
+            arg += 2;
+            targetSdk = *arg == '=' ? arg + 1 : arg;
+        } else if (!targetTool && beginsWith(arg, "run-tool=")) {
+            targetTool = arg + strlen("run-tool=");
+            runToolMode = 1;
+        } else {
+            break;
+        }
+    }
+
+    if (!runToolMode && !targetTool) {
+        /* not running a tool: let the full qtchooser handle it */
+        argv[0] = (char *)QTCHOOSER_BINDIR "/qtchooser";
+        return forward(argv0, argv);
+    }
+    if (!targetTool) {
+        fprintf(stderr, "%s: no tool selected. Stop.\n", argv0);
+        return 1;
+    }
+
+    if (!targetSdk || !*targetSdk) {
+        /* a project's .qtchooser applies if no version was selected */
+        switch (projectSdk(pinnedSdk, sizeof pinnedSdk)) {
+        case -1:
+            targetSdk = "";
+            break;
+        case 0:
+            return forward(argv0, argv);
+        default:
+            targetSdk = pinnedSdk;
+        }
+    }
+    if (!selectSdk(targetSdk, targetTool, &sdk) || strcmp(libraryPathMode(&sdk), "ldso") == 0)
+        return forward(argv0, argv);
+    return runTool(argv0, targetSdk, targetTool, &sdk, argv + optind - 1);
+}
@@ -1,2 +1,2 @@
 TEMPLATE = subdirs
-SUBDIRS = qtchooser
+SUBDIRS = qtchooser scaling
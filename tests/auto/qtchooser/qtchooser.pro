@@ -8,3 +8,8 @@ QT     += testlib
 
 SOURCES += tst_qtchooser.cpp
 DEFINES += SRCDIR=\\\"$$PWD/\\\"
+
+# link the same library the wrapper is built from
+QTCHOOSER_SRC = $$PWD/../../../src/qtchooser
+INCLUDEPATH += $$QTCHOOSER_SRC
+LIBS += $$QTCHOOSER_SRC/libqtchooser.a -lpthread
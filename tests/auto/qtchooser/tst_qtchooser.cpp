@@ -41,6 +41,8 @@
 
 #include <QtTest>
 
+#include "qtchooser.h"
+
 #ifdef Q_OS_WIN
 #  include <process.h>
 #  define getpid _getpid
@@ -75,9 +77,11 @@ public:
     QProcessEnvironment testModeEnvironment;
     QString testData;
     QString toolPath;
+    QString staticToolPath;
     QString pathsWithDefault;
     QString tempFileName;
     QString tempFileBaseName;
+    QTemporaryDir cacheDir;
 
     tst_ToolChooser();
     inline QProcess *execute(const QStringList &arguments)
@@ -93,6 +97,7 @@ public Q_SLOTS:
 
 private Q_SLOTS:
     void list();
+    void listVerbose();
     void selectTool_data();
     void selectTool();
     void selectQt_data();
@@ -104,6 +109,27 @@ private Q_SLOTS:
     void install_data();
     void install();
     void install2();
+    void concurrentInstall();
+    void scan();
+    void manifest();
+    void printShellEnv();
+    void configFormat();
+    void resolveCache();
+    void zeroAllocations();
+    void libraryPath();
+    void fallbackIndex();
+    void resolveBatch();
+    void execBatch();
+    void outputCache();
+    void versionSelect_data();
+    void versionSelect();
+    void versionIndex();
+    void projectPin();
+    void library();
+    void compile();
+    void materialize();
+    void trace();
+    void stats();
 };
 
 tst_ToolChooser::tst_ToolChooser()
@@ -119,10 +145,12 @@ tst_ToolChooser::tst_ToolChooser()
     testModeEnvironment.insert("XDG_CONFIG_HOME", "/dev/null");
     testModeEnvironment.insert("XDG_CONFIG_DIRS", pathsWithDefault);
     testModeEnvironment.insert("QT_SELECT", "4.8");
+    testModeEnvironment.insert("XDG_CACHE_HOME", cacheDir.path());
 
     pathsWithDefault.prepend(testData + "/default" LIST_SEP);
 
     toolPath = QCoreApplication::applicationDirPath() + "/../../../src/qtchooser/test/qtchooser" EXE_SUFFIX;
+    staticToolPath = QCoreApplication::applicationDirPath() + "/../../../src/qtchooser/test/qtchooser-static" EXE_SUFFIX;
 
     tempFileBaseName = "tool-" + QString::number(getpid()) + ".exe";
     tempFileName = QDir::currentPath() + "/" + tempFileBaseName;
@@ -172,6 +200,61 @@ void tst_ToolChooser::list()
     QVERIFY(foundVersions.contains("5"));
 }
 
+void tst_ToolChooser::listVerbose()
+{
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("config/qtchooser"));
+    QVERIFY(dir.mkpath("qt/bin"));
+    QVERIFY(dir.mkpath("qt/lib"));
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/healthy.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QFile::encodeName(tempdir.path() + "/qt/bin\n" + tempdir.path() + "/qt/lib\n"));
+    }
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/dangling.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QFile::encodeName(tempdir.path() + "/gone/bin\n" + tempdir.path() + "/gone/lib\n"));
+    }
+    {
+        QFile f(tempdir.path() + "/qt/bin/qmake");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.close();
+        QVERIFY(f.setPermissions(f.permissions() | QFile::ExeOwner));
+        QFile g(tempdir.path() + "/qt/bin/moc");
+        QVERIFY(g.open(QIODevice::WriteOnly));
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/config");
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-list-versions" << "-json", env));
+    QVERIFY(proc);
+    QCOMPARE(proc->exitCode(), 1);     // because of the dangling SDK
+
+    QJsonParseError error;
+    QJsonDocument doc = QJsonDocument::fromJson(proc->readAllStandardOutput(), &error);
+    QVERIFY2(error.error == QJsonParseError::NoError, qPrintable(error.errorString()));
+    QJsonArray sdks = doc.array();
+    QCOMPARE(sdks.size(), 2);
+
+    // sorted by name
+    QJsonObject dangling = sdks.at(0).toObject();
+    QCOMPARE(dangling.value("name").toString(), QString("dangling"));
+    QVERIFY(dangling.value("problems").toArray().contains(QString("no bin dir")));
+    QVERIFY(dangling.value("problems").toArray().contains(QString("no lib dir")));
+
+    QJsonObject healthy = sdks.at(1).toObject();
+    QCOMPARE(healthy.value("name").toString(), QString("healthy"));
+    QCOMPARE(healthy.value("tools").toArray(), QJsonArray() << QString("qmake"));
+    QCOMPARE(healthy.value("problems").toArray(), QJsonArray() << QString("not executable: moc"));
+
+    // the table has a header and one line per SDK
+    proc.reset(execute(QStringList() << "-list-versions" << "-verbose", env));
+    QVERIFY(proc);
+    QCOMPARE(proc->readAllStandardOutput().count('\n'), 3);
+}
+
 void tst_ToolChooser::selectTool_data()
 {
     QTest::addColumn<int>("mode");
@@ -433,6 +516,9 @@ void tst_ToolChooser::install()
 
         out = proc->readLine();
         QCOMPARE(QString(out).trimmed(), QLibraryInfo::location(QLibraryInfo::LibrariesPath));
+
+        out = proc->readLine();
+        QCOMPARE(QString(out).trimmed(), "prefix=" + QLibraryInfo::location(QLibraryInfo::PrefixPath));
     }
 }
 
@@ -461,7 +547,10 @@ void tst_ToolChooser::install2()
     proc.setProcessEnvironment(env);
     QString qmake = QLibraryInfo::location(QLibraryInfo::BinariesPath) + "/qmake";
     QString expectedContents = QLibraryInfo::location(QLibraryInfo::BinariesPath) + '\n' +
-                               QLibraryInfo::location(QLibraryInfo::LibrariesPath) + '\n';
+                               QLibraryInfo::location(QLibraryInfo::LibrariesPath) + '\n' +
+                               "prefix=" + QLibraryInfo::location(QLibraryInfo::PrefixPath) + '\n' +
+                               "headers=" + QLibraryInfo::location(QLibraryInfo::HeadersPath) + '\n' +
+                               "plugins=" + QLibraryInfo::location(QLibraryInfo::PluginsPath) + '\n';
 
     // test 1: check that it installs into $HOME and recursively mkdirs
     proc.setProgram(realToolPath);
@@ -492,6 +581,1152 @@ void tst_ToolChooser::install2()
     }
 }
 
+void tst_ToolChooser::concurrentInstall()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("This test requires shell scripts");
+#endif
+    const int count = 32;
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("qmakes"));
+    for (int i = 0; i < count; ++i) {
+        QFile f(tempdir.path() + "/qmakes/qmake" + QString::number(i));
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("#!/bin/sh\n"
+                "echo QT_INSTALL_PREFIX:/prefix" + QByteArray::number(i) + "\n"
+                "echo QT_INSTALL_BINS:/bin" + QByteArray::number(i) + "\n"
+                "echo QT_INSTALL_LIBS:/lib" + QByteArray::number(i) + "\n");
+        f.close();
+        QVERIFY(f.setPermissions(f.permissions() | QFile::ExeOwner));
+    }
+
+    QString realToolPath = QCoreApplication::applicationDirPath() + "/../../../src/qtchooser/qtchooser" EXE_SUFFIX;
+    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+    env.insert("XDG_CONFIG_HOME", tempdir.path() + "/home");
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/etc");
+    env.insert("XDG_CACHE_HOME", tempdir.path() + "/cache");
+
+    // for each qmake at the same time: replace one SDK, create another one
+    // that only one of them may create, and one SDK of its own
+    QList<QProcess *> forced, exclusive, own;
+    for (int i = 0; i < count; ++i) {
+        const QString qmake = tempdir.path() + "/qmakes/qmake" + QString::number(i);
+        const QStringList arguments[] = {
+            QStringList() << "-install" << "-f" << "shared" << qmake,
+            QStringList() << "-install" << "exclusive" << qmake,
+            QStringList() << "-install" << "sdk" + QString::number(i) << qmake
+        };
+        QList<QProcess *> *lists[] = { &forced, &exclusive, &own };
+        for (int j = 0; j < 3; ++j) {
+            QProcess *proc = new QProcess;
+            proc->setProcessEnvironment(env);
+            proc->start(realToolPath, arguments[j], QIODevice::ReadOnly | QIODevice::Text);
+            lists[j]->append(proc);
+        }
+    }
+
+    int created = 0;
+    for (int i = 0; i < count; ++i) {
+        QScopedPointer<QProcess> proc(forced.at(i));
+        QVERIFY(proc->waitForFinished());
+        VERIFY_NORMAL_EXIT(proc);
+
+        proc.reset(own.at(i));
+        QVERIFY(proc->waitForFinished());
+        VERIFY_NORMAL_EXIT(proc);
+
+        proc.reset(exclusive.at(i));
+        QVERIFY(proc->waitForFinished());
+        QCOMPARE(proc->exitStatus(), QProcess::NormalExit);
+        if (proc->exitCode() == 0)
+            ++created;
+        else
+            QVERIFY2(proc->readAllStandardError().contains("already exists"), qPrintable(proc->errorString()));
+    }
+    QCOMPARE(created, 1);
+
+    // every file is complete and there's nothing else in the directory
+    const QString confDir = tempdir.path() + "/etc/qtchooser/";
+    QStringList files = QDir(confDir).entryList(QDir::Files | QDir::Hidden);
+    QCOMPARE(files.size(), count + 2);
+    foreach (const QString &file, files) {
+        QFile f(confDir + file);
+        QVERIFY(file.endsWith(".conf"));
+        QVERIFY(f.open(QIODevice::ReadOnly));
+        QList<QByteArray> lines = f.readAll().split('\n');
+        QCOMPARE(lines.size(), 4);
+        QVERIFY(lines.at(0).startsWith("/bin"));
+        QCOMPARE(lines.at(1), "/lib" + lines.at(0).mid(4));
+        QCOMPARE(lines.at(2), "prefix=/prefix" + lines.at(0).mid(4));
+        if (file.startsWith("sdk"))
+            QCOMPARE(lines.at(0), "/bin" + file.mid(3, file.size() - 8).toLatin1());
+    }
+}
+
+void tst_ToolChooser::scan()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("This test requires shell scripts");
+#endif
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    const QStringList versions = QStringList() << "5.12.0" << "5.15.2";
+    foreach (const QString &version, versions) {
+        QString prefix = tempdir.path() + "/opt/Qt " + version + "/gcc_64";
+        QVERIFY(dir.mkpath(prefix + "/bin"));
+        QFile f(prefix + "/bin/qmake");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("#!/bin/sh\n"
+                "echo \"QT_INSTALL_PREFIX:" + prefix.toLocal8Bit() + "\"\n"
+                "echo \"QT_INSTALL_BINS:" + prefix.toLocal8Bit() + "/bin\"\n"
+                "echo \"QT_INSTALL_LIBS:" + prefix.toLocal8Bit() + "/lib\"\n"
+                "echo \"QT_VERSION:" + version.toLatin1() + "\"\n");
+        f.close();
+        QVERIFY(f.setPermissions(f.permissions() | QFile::ExeOwner));
+    }
+    // a qmake that is really qtchooser must be skipped
+    QVERIFY(dir.mkpath("opt/usr/bin"));
+    QVERIFY(QFile::link(toolPath, tempdir.path() + "/opt/usr/bin/qmake"));
+
+    QProcessEnvironment env = testModeEnvironment;
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-scan" << tempdir.path() + "/opt", env));
+    VERIFY_NORMAL_EXIT(proc);
+
+    // test mode prints the file names and the contents instead of writing them
+    QByteArray output = proc->readAll();
+    QByteArray escapedPath = tempdir.path().mid(1).toLocal8Bit().replace('/', '-');
+    foreach (const QString &version, versions) {
+        QByteArray name = version.toLatin1() + '-' + escapedPath + "-opt-Qt-" + version.toLatin1() + "-gcc_64";
+        QByteArray prefix = tempdir.path().toLocal8Bit() + "/opt/Qt " + version.toLatin1() + "/gcc_64";
+        QVERIFY2(output.contains(testData.toLocal8Bit() + "/config2/qtchooser/" + name + ".conf\n"), output);
+        QVERIFY2(output.contains(prefix + "/bin\n" + prefix + "/lib\nprefix=" + prefix + '\n'), output);
+    }
+    QCOMPARE(output.count(".conf\n"), versions.size());
+}
+
+void tst_ToolChooser::manifest()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("This test requires shell scripts");
+#endif
+    // empty.conf and oneline.conf are malformed, so they're left out
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-export"));
+    QVERIFY(!!proc);
+    QCOMPARE(proc->exitCode(), 1);
+    QVERIFY(proc->readAllStandardError().contains("malformed config file"));
+    QCOMPARE(proc->readAllStandardOutput().constData(),
+             "[4.8]\nbin=/correct-4.8/tooldir\nlib=/correct-4.8/libdir\n\n"
+             "[5]\nbin=/qt5/tooldir\nlib=/qt5/libdir\n\n"
+             "[later]\nbin=/later/tooldir\nlib=/later/libdir\n");
+
+    QTemporaryDir tempdir;
+    QFile qmake(tempdir.path() + "/qmake");
+    QVERIFY(qmake.open(QIODevice::WriteOnly));
+    qmake.write("#!/bin/sh\n"
+                "echo QT_INSTALL_PREFIX:/queried\n"
+                "echo QT_INSTALL_BINS:/queried/bin\n"
+                "echo QT_INSTALL_LIBS:/queried/lib\n");
+    qmake.close();
+    QVERIFY(qmake.setPermissions(qmake.permissions() | QFile::ExeOwner));
+
+    // 4.8 is already there with the same bin dir, so it's left alone;
+    // qmake is only run for the entry without one
+    QFile manifest(tempdir.path() + "/manifest");
+    QVERIFY(manifest.open(QIODevice::WriteOnly));
+    manifest.write("# comment\n"
+                   "[4.8]\nbin=/correct-4.8/tooldir\nlib=/correct-4.8/libdir\n\n"
+                   "[listed]\nbin=/listed/bin\nlib=/listed/lib\nheaders=/listed/include\n"
+                   "qmake=/nonexistent/qmake\n\n"
+                   "[queried]\nqmake=" + QFile::encodeName(qmake.fileName()) + "\nlib=/other/lib\n");
+    manifest.close();
+    proc.reset(execute(QStringList() << "-import" << manifest.fileName()));
+    VERIFY_NORMAL_EXIT(proc);
+
+    // test mode prints the file names and the contents instead of writing them
+    const QByteArray dir = testData.toLocal8Bit() + "/config2/qtchooser/";
+    QCOMPARE(proc->readAll(),
+             QByteArray(dir + "listed.conf\n/listed/bin\n/listed/lib\nheaders=/listed/include\n\n"
+                        + dir + "queried.conf\n/queried/bin\n/other/lib\nprefix=/queried\n\n"));
+
+    // an SDK of the same name elsewhere is only replaced with -f, and the
+    // entries before it aren't written either
+    QVERIFY(manifest.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    manifest.write("[new]\nbin=/new/bin\n\n[5]\nbin=/elsewhere/bin\nlib=/elsewhere/lib\n");
+    manifest.close();
+    proc.reset(execute(QStringList() << "-import" << manifest.fileName()));
+    QVERIFY(!!proc);
+    QCOMPARE(proc->exitCode(), 1);
+    QVERIFY(proc->readAllStandardError().contains("SDK \"5\" already exists"));
+    QCOMPARE(proc->readAllStandardOutput().constData(), "");
+    proc.reset(execute(QStringList() << "-import" << "-f" << manifest.fileName()));
+    VERIFY_NORMAL_EXIT(proc);
+    QVERIFY(proc->readAll().contains(dir + "5.conf\n/elsewhere/bin\n"));
+
+    // nothing is imported if any entry is invalid
+    QVERIFY(manifest.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    manifest.write("[good]\nbin=/good/bin\n[no-bin]\nlib=/lib\n");
+    manifest.close();
+    proc.reset(execute(QStringList() << "-import" << manifest.fileName()));
+    QVERIFY(!!proc);
+    QCOMPARE(proc->exitCode(), 1);
+    QVERIFY(proc->readAllStandardError().contains(":3: SDK \"no-bin\" has neither bin nor qmake"));
+    QCOMPARE(proc->readAllStandardOutput().constData(), "");
+}
+
+void tst_ToolChooser::printShellEnv()
+{
+    QProcessEnvironment env = testModeEnvironment;
+    // switching from Qt 5 to Qt 4.8
+    env.insert("QTLIBDIR", "/qt5/libdir");
+    env.insert("QTDIR", "/qt5");
+    env.insert("LD_LIBRARY_PATH", "/first:/qt5/libdir:/last");
+    env.insert("PKG_CONFIG_PATH", "/qt5/libdir/pkgconfig");
+    env.insert("CMAKE_PREFIX_PATH", "/qt5:/other");
+
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-qt=4.8" << "-print-env=bash", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QByteArray output = proc->readAll();
+    QVERIFY2(output.contains("export LD_LIBRARY_PATH='/correct-4.8/libdir:/first:/last';\n"), output);
+    QVERIFY2(output.contains("export PKG_CONFIG_PATH='/correct-4.8/libdir/pkgconfig';\n"), output);
+    QVERIFY2(output.contains("export CMAKE_PREFIX_PATH='/correct-4.8:/other';\n"), output);
+    QVERIFY2(output.contains("export QT_SELECT='4.8';\n"), output);
+    QVERIFY2(output.contains("export QTDIR='/correct-4.8';\n"), output);
+
+    proc.reset(execute(QStringList() << "-qt=4.8" << "-print-env=fish", env));
+    VERIFY_NORMAL_EXIT(proc);
+    output = proc->readAll();
+    QVERIFY2(output.contains("set -gx LD_LIBRARY_PATH '/correct-4.8/libdir' '/first' '/last';\n"), output);
+
+    // and from Qt 5 to none
+    proc.reset(execute(QStringList() << "-qt=none" << "-print-env=zsh", env));
+    VERIFY_NORMAL_EXIT(proc);
+    output = proc->readAll();
+    QVERIFY2(output.contains("export LD_LIBRARY_PATH='/first:/last';\n"), output);
+    QVERIFY2(output.contains("unset PKG_CONFIG_PATH;\n"), output);
+    QVERIFY2(output.contains("unset QTDIR;\n"), output);
+
+    proc.reset(execute(QStringList() << "-print-env=csh", env));
+    QVERIFY(proc);
+    QVERIFY(proc->exitCode() != 0);
+}
+
+void tst_ToolChooser::configFormat()
+{
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("config/qtchooser"));
+    {
+        // no newline at the end of the last line
+        QFile f(tempdir.path() + "/config/qtchooser/nonl.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("/nonl/tooldir\n/nonl/libdir");
+    }
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/keys.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("/keys/tooldir\n/keys/libdir\n"
+                "prefix=/keys\n"
+                "# comment=ignored\n"
+                "unknown=ignored\n"
+                "no equals sign\n"
+                "headers=/keys/include\n");
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/config");
+
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-qt=nonl" << "-print-env", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QByteArray output = proc->readAll();
+    QVERIFY2(output.contains("QTTOOLDIR=\"/nonl/tooldir\"\n"), output);
+    QVERIFY2(output.contains("QTLIBDIR=\"/nonl/libdir\"\n"), output);
+
+    proc.reset(execute(QStringList() << "-qt=keys" << "-print-env", env));
+    VERIFY_NORMAL_EXIT(proc);
+    output = proc->readAll();
+    QVERIFY2(output.contains("QTTOOLDIR=\"/keys/tooldir\"\n"), output);
+    QVERIFY2(output.contains("QTLIBDIR=\"/keys/libdir\"\n"), output);
+}
+
+void tst_ToolChooser::resolveCache()
+{
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("config/qtchooser"));
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/config" LIST_SEP + testData + "/config2");
+    env.insert("XDG_CACHE_HOME", tempdir.path() + "/cache");
+    env.insert("QT_SELECT", "5");
+
+    // first run: resolves from config2 and populates the cache
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-run-tool=moc", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(proc->readLine().trimmed(), QByteArray("/qt5/tooldir/moc"));
+    QVERIFY(!QDir(tempdir.path() + "/cache/qtchooser").entryList(QDir::Files).isEmpty());
+
+    // shadow the SDK in an earlier search path: the cache entry must be discarded
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/5.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("/shadow/tooldir\n/shadow/libdir\n");
+    }
+    proc.reset(execute(QStringList() << "-run-tool=moc", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(proc->readLine().trimmed(), QByteArray("/shadow/tooldir/moc"));
+
+    // and so must editing the matched file in place
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/5.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        f.write("/edited-in-place/tooldir\n/edited-in-place/libdir\n");
+    }
+    proc.reset(execute(QStringList() << "-run-tool=moc", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(proc->readLine().trimmed(), QByteArray("/edited-in-place/tooldir/moc"));
+}
+
+void tst_ToolChooser::zeroAllocations()
+{
+#if defined(Q_OS_LINUX)
+    const QString mallocCount = QCoreApplication::applicationDirPath()
+            + "/../../../src/qtchooser/test/libmalloccount.so";
+    QVERIFY(QFile::exists(mallocCount));
+
+    QTemporaryDir tempdir;
+    QVERIFY(QDir(tempdir.path()).mkpath("project/build"));
+    {
+        QFile f(tempdir.path() + "/project/.qtchooser");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("5\n");
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", testData + "/config2");
+    env.insert("XDG_CACHE_HOME", tempdir.path() + "/cache");
+    env.insert("LD_PRELOAD", mallocCount);
+    env.insert("QTCHOOSER_MALLOC_COUNT", tempdir.path() + "/count");
+    env.remove("QTCHOOSER_STATS");
+    env.remove("QTCHOOSER_TRACE");
+    env.remove("QTCHOOSER_OUTPUT_CACHE");
+
+    // with a version selected, then with the project's pin from its cache
+    for (int pinned = 0; pinned < 2; ++pinned) {
+        if (pinned)
+            env.remove("QT_SELECT");
+        else
+            env.insert("QT_SELECT", "5");
+
+        // the first run fills the caches; the second must not allocate
+        for (int run = 0; run < 2; ++run) {
+            QProcess proc;
+            proc.setProcessEnvironment(env);
+            proc.setWorkingDirectory(tempdir.path() + "/project/build");
+            proc.start(toolPath, QStringList() << "-run-tool=moc" << "arg", QIODevice::ReadOnly | QIODevice::Text);
+            QVERIFY(proc.waitForFinished());
+            VERIFY_NORMAL_EXIT(&proc);
+            QCOMPARE(proc.readLine().trimmed(), QByteArray("/qt5/tooldir/moc"));
+            QCOMPARE(proc.readLine().trimmed(), QByteArray("arg"));
+
+            QFile count(tempdir.path() + "/count");
+            QVERIFY(count.open(QIODevice::ReadOnly));
+            if (run == 1)
+                QCOMPARE(count.readAll().trimmed(), QByteArray("0"));
+        }
+    }
+#else
+    QSKIP("The allocations are counted by interposing malloc with LD_PRELOAD");
+#endif
+}
+
+void tst_ToolChooser::libraryPath()
+{
+#if defined(Q_OS_LINUX)
+    QTemporaryDir tempdir;
+    QVERIFY(QDir(tempdir.path()).mkpath("config/qtchooser"));
+    {
+        // an SDK whose "tool" is a dynamically-linked executable
+        QFile f(tempdir.path() + "/config/qtchooser/exe.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QFile::encodeName(QFileInfo(toolPath).absolutePath()) + "\n/exe/libdir\nlibpath=ldso\n");
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/config" LIST_SEP + testData + "/config2");
+    env.insert("XDG_CACHE_HOME", tempdir.path() + "/cache");
+    env.insert("LD_LIBRARY_PATH", "/first");
+    env.insert("QT_SELECT", "5");
+
+    // off by default
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-run-tool=moc", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(proc->readAll(), QByteArray("/qt5/tooldir/moc\n"));
+
+    // twice each, to resolve and then from the cache
+    env.insert("QTCHOOSER_LIBPATH", "env");
+    for (int i = 0; i < 2; ++i) {
+        proc.reset(execute(QStringList() << "-run-tool=moc", env));
+        VERIFY_NORMAL_EXIT(proc);
+        QCOMPARE(proc->readAll(), QByteArray("/qt5/tooldir/moc\nLD_LIBRARY_PATH=/qt5/libdir:/first\n"));
+    }
+    proc.reset(execute(staticToolPath, QStringList() << "-run-tool=moc", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(proc->readAll(), QByteArray("/qt5/tooldir/moc\nLD_LIBRARY_PATH=/qt5/libdir:/first\n"));
+
+    // the config file's setting applies when the variable isn't set; the
+    // static wrapper leaves the ldso mode to qtchooser
+    env.remove("QTCHOOSER_LIBPATH");
+    env.insert("QT_SELECT", "exe");
+    for (int i = 0; i < 3; ++i) {
+        const QString program = i < 2 ? toolPath : staticToolPath;
+        proc.reset(execute(program, QStringList() << "-run-tool=qtchooser" << "arg", env));
+        VERIFY_NORMAL_EXIT(proc);
+        QList<QByteArray> lines = proc->readAll().split('\n');
+        QCOMPARE(lines.size(), 8);
+        QVERIFY2(lines.at(0).startsWith('/'), lines.at(0));     // the dynamic loader
+        QCOMPARE(lines.at(1), QByteArray("--library-path"));
+        QCOMPARE(lines.at(2), QByteArray("/exe/libdir:/first"));
+        QCOMPARE(lines.at(3), QByteArray("--argv0"));
+        QCOMPARE(lines.at(4), QFile::encodeName(QFileInfo(toolPath).absolutePath() + "/qtchooser"));
+        QCOMPARE(lines.at(5), lines.at(4));
+        QCOMPARE(lines.at(6), QByteArray("arg"));
+    }
+#else
+    QSKIP("The library path is only set on Linux");
+#endif
+}
+
+void tst_ToolChooser::fallbackIndex()
+{
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("first/qtchooser"));
+    QVERIFY(dir.mkpath("second/qtchooser"));
+    QVERIFY(dir.mkpath("first-qt/bin"));
+    QVERIFY(dir.mkpath("second-qt/bin"));
+    foreach (const QString &name, QStringList() << "first" << "second") {
+        QFile f(tempdir.path() + '/' + name + "/qtchooser/" + name + ".conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QFile::encodeName(tempdir.path() + '/' + name + "-qt/bin\n/" + name + "-lib\n"));
+        if (name == "second")
+            f.write("libpath=env\n");
+    }
+    const QFile::Permissions exe = QFile::ReadOwner | QFile::WriteOwner | QFile::ExeOwner;
+    QString secondTool = tempdir.path() + "/second-qt/bin/qdbus";
+    QVERIFY(QFile(secondTool).open(QIODevice::WriteOnly));
+    QVERIFY(QFile::setPermissions(secondTool, exe));
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/first" LIST_SEP + tempdir.path() + "/second");
+    env.insert("XDG_CACHE_HOME", tempdir.path() + "/cache");
+    env.remove("QT_SELECT");
+    env.remove("LD_LIBRARY_PATH");
+
+    // first run builds the index, the second one uses it, with the same
+    // settings of the config file
+    for (int i = 0; i < 2; ++i) {
+        QScopedPointer<QProcess> proc(execute(QStringList() << "-run-tool=qdbus", env));
+        VERIFY_NORMAL_EXIT(proc);
+        QCOMPARE(QString::fromLocal8Bit(proc->readLine().trimmed()), secondTool);
+        QCOMPARE(proc->readLine().trimmed(), QByteArray("LD_LIBRARY_PATH=/second-lib"));
+    }
+
+    // a new tool in an earlier SDK's bin dir must be found
+    QString firstTool = tempdir.path() + "/first-qt/bin/qdbus";
+    QVERIFY(QFile(firstTool).open(QIODevice::WriteOnly));
+    QVERIFY(QFile::setPermissions(firstTool, exe));
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-run-tool=qdbus", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(QString::fromLocal8Bit(proc->readLine().trimmed()), firstTool);
+
+    // and removed ones must not
+    QVERIFY(QFile::remove(firstTool));
+    QVERIFY(QFile::remove(secondTool));
+    proc.reset(execute(QStringList() << "-run-tool=qdbus", env));
+    QVERIFY(proc);
+    QCOMPARE(proc->readAllStandardOutput().constData(), "");
+    QVERIFY(proc->exitCode() != 0);
+}
+
+void tst_ToolChooser::resolveBatch()
+{
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", pathsWithDefault);
+
+    QProcess proc;
+    proc.setProcessEnvironment(env);
+    proc.start(toolPath, QStringList() << "-resolve-batch", QIODevice::ReadWrite | QIODevice::Text);
+    QVERIFY(proc.waitForStarted());
+    proc.write("5 moc\n"
+               "4.8 uic\n"
+               "- qmake\n"
+               "\n"
+               "invalid moc\n"
+               "oneline moc\n"
+               "malformed\n");
+    proc.closeWriteChannel();
+    QVERIFY(proc.waitForFinished());
+    VERIFY_NORMAL_EXIT(&proc);
+
+    QList<QByteArray> lines = proc.readAllStandardOutput().trimmed().split('\n');
+    QCOMPARE(lines.size(), 6);
+    QCOMPARE(lines.at(0), QByteArray("/qt5/tooldir/moc"));
+    QCOMPARE(lines.at(1), QByteArray("/correct-4.8/tooldir/uic"));
+    QCOMPARE(lines.at(2), QByteArray("/default-qt/tooldir/qmake"));
+    QVERIFY2(lines.at(3).startsWith("error: "), lines.at(3));
+    QVERIFY2(lines.at(4).startsWith("error: "), lines.at(4));
+    QVERIFY2(lines.at(5).startsWith("error: "), lines.at(5));
+}
+
+void tst_ToolChooser::execBatch()
+{
+#ifdef Q_OS_WIN
+    QSKIP("This test requires a POSIX shell");
+#endif
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("config/qtchooser"));
+    QVERIFY(dir.mkpath("qt/bin"));
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/default.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QFile::encodeName(tempdir.path() + "/qt/bin\n" + tempdir.path() + "/qt/lib\n"));
+    }
+    {
+        // the first jobs take the longest, so they finish last
+        QFile f(tempdir.path() + "/qt/bin/moc");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("#!/bin/sh\n"
+                "sleep 0.$((5 - $1))\n"
+                "echo \"out $*\"\n"
+                "echo \"err $1\" >&2\n"
+                "test $1 != 3\n");
+        QVERIFY(f.setPermissions(f.permissions() | QFile::ExeOwner));
+    }
+    {
+        QFile f(tempdir.path() + "/jobs");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("moc 1 'a b'\n"
+                "# comment\n"
+                "moc 2 a\\ b\n"
+                "\n"
+                "moc 3 \"a b\"\n"
+                "moc 4\n");
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.remove("QT_SELECT");
+    env.insert("XDG_CONFIG_HOME", tempdir.path() + "/config");
+    env.remove("MAKEFLAGS");
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-exec-batch" << tempdir.path() + "/jobs" << "-j" << "4", env));
+    QVERIFY(proc);
+    QCOMPARE(proc->exitCode(), 1);
+    QCOMPARE(proc->readAllStandardOutput().constData(),
+             "out 1 a b\n"
+             "out 2 a b\n"
+             "out 3 a b\n"
+             "out 4\n");
+    QList<QByteArray> errors = proc->readAllStandardError().trimmed().split('\n');
+    QCOMPARE(errors.size(), 6);
+    QCOMPARE(errors.at(0), QByteArray("err 1"));
+    QCOMPARE(errors.at(1), QByteArray("err 2"));
+    QCOMPARE(errors.at(2), QByteArray("err 3"));
+    QVERIFY2(errors.at(3).contains("job 3 (moc) exited with code 1"), errors.at(3));
+    QCOMPARE(errors.at(4), QByteArray("err 4"));
+    QVERIFY2(errors.at(5).contains("1 of 4 jobs failed"), errors.at(5));
+}
+
+void tst_ToolChooser::outputCache()
+{
+#ifdef Q_OS_WIN
+    QSKIP("This test requires a POSIX shell");
+#endif
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("config/qtchooser"));
+    QVERIFY(dir.mkpath("qt/bin"));
+    QVERIFY(dir.mkpath("src"));
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/default.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QFile::encodeName(tempdir.path() + "/qt/bin\n" + tempdir.path() + "/qt/lib\n"));
+    }
+    {
+        // counts its runs and copies the input and the header it includes
+        QFile f(tempdir.path() + "/qt/bin/moc");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("#!/bin/sh\n"
+                "echo run >> runs\n"
+                "echo warning >&2\n"
+                "cat \"$3\" src/inc.h > \"$2\"\n");
+        QVERIFY(f.setPermissions(f.permissions() | QFile::ExeOwner));
+    }
+    const char *const files[][2] = {
+        { "src/a.h", "#include \"inc.h\"\nclass A;\n" },
+        { "src/inc.h", "1\n" }
+    };
+    for (size_t i = 0; i < sizeof files / sizeof files[0]; ++i) {
+        QFile f(tempdir.path() + '/' + files[i][0]);
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(files[i][1]);
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.remove("QT_SELECT");
+    env.insert("XDG_CONFIG_HOME", tempdir.path() + "/config");
+    env.insert("QTCHOOSER_OUTPUT_CACHE", tempdir.path() + "/cache");
+
+    // run, hit, then run again after the included header changed
+    const char *const expected[] = { "#include \"inc.h\"\nclass A;\n1\n", "#include \"inc.h\"\nclass A;\n1\n",
+                                     "#include \"inc.h\"\nclass A;\n2\n" };
+    const int expectedRuns[] = { 1, 1, 2 };
+    for (int i = 0; i < 3; ++i) {
+        if (i == 2) {
+            QFile f(tempdir.path() + "/src/inc.h");
+            QVERIFY(f.open(QIODevice::WriteOnly));
+            f.write("2\n");
+        }
+        QFile::remove(tempdir.path() + "/out.cpp");
+
+        QProcess proc;
+        proc.setProcessEnvironment(env);
+        proc.setWorkingDirectory(tempdir.path());
+        proc.start(toolPath, QStringList() << "-run-tool=moc" << "-o" << "out.cpp" << "src/a.h",
+                   QIODevice::ReadOnly | QIODevice::Text);
+        QVERIFY(proc.waitForFinished());
+        QCOMPARE(proc.exitCode(), 0);
+        QCOMPARE(proc.readAllStandardError().constData(), "warning\n");
+
+        QFile out(tempdir.path() + "/out.cpp");
+        QVERIFY(out.open(QIODevice::ReadOnly));
+        QCOMPARE(out.readAll().constData(), expected[i]);
+        QFile runs(tempdir.path() + "/runs");
+        QVERIFY(runs.open(QIODevice::ReadOnly));
+        QCOMPARE(runs.readAll().count('\n'), expectedRuns[i]);
+    }
+
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-output-cache-stats", env));
+    VERIFY_NORMAL_EXIT(proc);
+    const QByteArray report = proc->readAllStandardOutput();
+    QVERIFY2(report.contains("hits:            1 "), report);
+    QVERIFY2(report.contains("misses:          2\n"), report);
+
+    // the second pass of rcc reads the object file of the first one
+    {
+        QFile f(tempdir.path() + "/qt/bin/rcc");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("#!/bin/sh\n"
+                "echo run >> rccruns\n"
+                "cat \"$4\" > \"$6\"\n");
+        QVERIFY(f.setPermissions(f.permissions() | QFile::ExeOwner));
+    }
+    {
+        QFile f(tempdir.path() + "/src/res.qrc");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("<RCC><qresource/></RCC>\n");
+    }
+    const char *const objects[] = { "first\n", "first\n", "second\n" };
+    for (int i = 0; i < 3; ++i) {
+        QFile object(tempdir.path() + "/obj.o");
+        QVERIFY(object.open(QIODevice::WriteOnly));
+        object.write(objects[i]);
+        object.close();
+        QFile::remove(tempdir.path() + "/out.o");
+
+        QProcess proc;
+        proc.setProcessEnvironment(env);
+        proc.setWorkingDirectory(tempdir.path());
+        proc.start(toolPath, QStringList() << "-run-tool=rcc" << "--pass" << "2" << "-temp" << "obj.o"
+                   << "-o" << "out.o" << "src/res.qrc", QIODevice::ReadOnly | QIODevice::Text);
+        QVERIFY(proc.waitForFinished());
+        QCOMPARE(proc.exitCode(), 0);
+
+        QFile out(tempdir.path() + "/out.o");
+        QVERIFY(out.open(QIODevice::ReadOnly));
+        QCOMPARE(out.readAll().constData(), objects[i]);
+        QFile runs(tempdir.path() + "/rccruns");
+        QVERIFY(runs.open(QIODevice::ReadOnly));
+        QCOMPARE(runs.readAll().count('\n'), expectedRuns[i]);
+    }
+
+    // only the headers directory of the SDK is left out, not the rest of its
+    // prefix, where the sources of a project may be too
+    QVERIFY(dir.mkpath("qt/include"));
+    QVERIFY(dir.mkpath("qt/project"));
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/default.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QFile::encodeName(tempdir.path() + "/qt/bin\n" + tempdir.path() + "/qt/lib\n"
+                                  "headers=" + tempdir.path() + "/qt/include\n"));
+    }
+    {
+        QFile f(tempdir.path() + "/qt/bin/moc");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("#!/bin/sh\n"
+                "echo run >> headerruns\n"
+                "cat \"$4\" > \"$3\"\n");
+    }
+    const char *const headers[][2] = {
+        { "qt/project/b.h", "#include \"own.h\"\n#include <qobject.h>\n" },
+        { "qt/project/own.h", "1\n" },
+        { "qt/include/qobject.h", "1\n" }
+    };
+    for (size_t i = 0; i < sizeof headers / sizeof headers[0]; ++i) {
+        QFile f(tempdir.path() + '/' + headers[i][0]);
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(headers[i][1]);
+    }
+
+    // run, hit after a Qt header changed, run again after the project's did
+    const char *const changed[] = { 0, "qt/include/qobject.h", "qt/project/own.h" };
+    for (int i = 0; i < 3; ++i) {
+        if (changed[i]) {
+            QFile f(tempdir.path() + '/' + changed[i]);
+            QVERIFY(f.open(QIODevice::WriteOnly));
+            f.write("2\n");
+        }
+
+        QProcess proc;
+        proc.setProcessEnvironment(env);
+        proc.setWorkingDirectory(tempdir.path());
+        proc.start(toolPath, QStringList() << "-run-tool=moc" << "-I" + tempdir.path() + "/qt/include"
+                   << "-o" << "out.cpp" << tempdir.path() + "/qt/project/b.h",
+                   QIODevice::ReadOnly | QIODevice::Text);
+        QVERIFY(proc.waitForFinished());
+        QCOMPARE(proc.exitCode(), 0);
+        QFile runs(tempdir.path() + "/headerruns");
+        QVERIFY(runs.open(QIODevice::ReadOnly));
+        QCOMPARE(runs.readAll().count('\n'), expectedRuns[i]);
+    }
+}
+
+void tst_ToolChooser::versionSelect_data()
+{
+    QTest::addColumn<QString>("selector");
+    QTest::addColumn<QString>("expected");
+
+    QTest::newRow("exact-name") << "5" << "5";
+    QTest::newRow("prefix") << "5.12" << "5.12.3-gcc";
+    QTest::newRow("prefix-with-qt") << "4" << "qt4-x86_64-linux-gnu";
+    QTest::newRow("latest") << "latest" << "6.5.0";
+    QTest::newRow("greater-equal") << ">=5.12" << "6.5.0";
+    QTest::newRow("less") << "<6" << "5.15.2-gcc_64";
+    QTest::newRow("less-equal") << "<=5.12.3" << "5.12.3-gcc";
+    QTest::newRow("greater") << ">6.5" << "";
+    QTest::newRow("not-a-selector") << "5." << "";
+}
+
+void tst_ToolChooser::versionSelect()
+{
+    QFETCH(QString, selector);
+    QFETCH(QString, expected);
+
+    // 6.7 is newer than everything else, but malformed
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("config/qtchooser"));
+    const char *const names[] = { "5", "5.12.3-gcc", "5.15.2-gcc_64", "6.5.0", "qt4-x86_64-linux-gnu", "6.7" };
+    for (size_t i = 0; i < sizeof names / sizeof names[0]; ++i) {
+        QFile f(tempdir.path() + "/config/qtchooser/" + names[i] + ".conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QByteArray("/") + names[i] + "/bin\n");
+        if (i + 1 < sizeof names / sizeof names[0])
+            f.write(QByteArray("/") + names[i] + "/lib\n");
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/config");
+    env.insert("XDG_CACHE_HOME", tempdir.path() + "/cache");
+
+    // twice: building the version index, then using it
+    for (int i = 0; i < 2; ++i) {
+        QScopedPointer<QProcess> proc(execute(QStringList() << "-qt=" + selector << "-print-env", env));
+        QVERIFY(proc);
+        if (expected.isEmpty()) {
+            QCOMPARE(proc->exitCode(), 1);
+            continue;
+        }
+        VERIFY_NORMAL_EXIT(proc);
+        QCOMPARE(QString::fromLocal8Bit(proc->readLine().trimmed()), "QT_SELECT=\"" + expected + '"');
+    }
+
+    // -resolve-batch agrees
+    QProcess proc;
+    proc.setProcessEnvironment(env);
+    proc.start(toolPath, QStringList() << "-resolve-batch", QIODevice::ReadWrite | QIODevice::Text);
+    QVERIFY(proc.waitForStarted());
+    proc.write(selector.toLocal8Bit() + " moc\n");
+    proc.closeWriteChannel();
+    QVERIFY(proc.waitForFinished());
+    VERIFY_NORMAL_EXIT(&proc);
+    QByteArray line = proc.readAllStandardOutput().trimmed();
+    if (expected.isEmpty())
+        QVERIFY2(line.startsWith("error: "), line);
+    else
+        QCOMPARE(QString::fromLocal8Bit(line), '/' + expected + "/bin/moc");
+
+#ifdef Q_OS_UNIX
+    // and so does the static wrapper, which leaves selectors to qtchooser
+    QScopedPointer<QProcess> staticProc(execute(staticToolPath, QStringList() << "-qt=" + selector
+                                                << "-run-tool=moc", env));
+    QVERIFY(staticProc);
+    if (expected.isEmpty()) {
+        QCOMPARE(staticProc->exitCode(), 1);
+    } else {
+        VERIFY_NORMAL_EXIT(staticProc);
+        QCOMPARE(QString::fromLocal8Bit(staticProc->readLine().trimmed()), '/' + expected + "/bin/moc");
+    }
+#endif
+}
+
+void tst_ToolChooser::versionIndex()
+{
+    // a date-stamped build, with a number that doesn't fit in an int
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("config/qtchooser"));
+    const char *const names[] = { "5.15.2", "5.3000000000-nightly" };
+    for (size_t i = 0; i < sizeof names / sizeof names[0]; ++i) {
+        QFile f(tempdir.path() + "/config/qtchooser/" + names[i] + ".conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QByteArray("/") + names[i] + "/bin\n/" + names[i] + "/lib\n");
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/config");
+    env.insert("XDG_CACHE_HOME", tempdir.path() + "/cache");
+    for (int i = 0; i < 2; ++i) {
+        QScopedPointer<QProcess> proc(execute(QStringList() << "-qt=latest" << "-print-env", env));
+        VERIFY_NORMAL_EXIT(proc);
+        QCOMPARE(proc->readLine().trimmed(), QByteArray("QT_SELECT=\"5.3000000000-nightly\""));
+    }
+
+    // the index has the whole number, so that it can be read back
+    const QStringList indexes = QDir(tempdir.path() + "/cache/qtchooser").entryList(QStringList() << "versions-*");
+    QCOMPARE(indexes.size(), 1);
+    QFile f(tempdir.path() + "/cache/qtchooser/" + indexes.at(0));
+    QVERIFY(f.open(QIODevice::ReadOnly));
+    QByteArray index = f.readAll();
+    QVERIFY2(index.contains("\nsdk 5.3000000000 5.3000000000-nightly\n"), index);
+}
+
+void tst_ToolChooser::projectPin()
+{
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("project/src/build"));
+    {
+        QFile f(tempdir.path() + "/project/.qtchooser");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("# this project needs Qt 5\n\n5\n");
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.remove("QT_SELECT");
+    env.insert("XDG_CACHE_HOME", tempdir.path() + "/cache");
+    const QString buildDir = tempdir.path() + "/project/src/build";
+
+    // twice: searching the parents, then from the cache
+    for (int i = 0; i < 2; ++i) {
+        QProcess proc;
+        proc.setProcessEnvironment(env);
+        proc.setWorkingDirectory(buildDir);
+        proc.start(toolPath, QStringList() << "-run-tool=moc", QIODevice::ReadOnly | QIODevice::Text);
+        QVERIFY(proc.waitForFinished());
+        VERIFY_NORMAL_EXIT(&proc);
+        QCOMPARE(proc.readLine().trimmed(), QByteArray("/qt5/tooldir/moc"));
+    }
+
+#ifdef Q_OS_UNIX
+    // the static wrapper finds the pin too
+    {
+        QProcess proc;
+        proc.setProcessEnvironment(env);
+        proc.setWorkingDirectory(buildDir);
+        proc.start(staticToolPath, QStringList() << "-run-tool=moc", QIODevice::ReadOnly | QIODevice::Text);
+        QVERIFY(proc.waitForFinished());
+        VERIFY_NORMAL_EXIT(&proc);
+        QCOMPARE(proc.readLine().trimmed(), QByteArray("/qt5/tooldir/moc"));
+    }
+#endif
+
+    // as does -resolve-batch for "-", but not for a named SDK
+    {
+        QProcess proc;
+        proc.setProcessEnvironment(env);
+        proc.setWorkingDirectory(buildDir);
+        proc.start(toolPath, QStringList() << "-resolve-batch", QIODevice::ReadWrite | QIODevice::Text);
+        QVERIFY(proc.waitForStarted());
+        proc.write("- moc\n4.8 moc\n");
+        proc.closeWriteChannel();
+        QVERIFY(proc.waitForFinished());
+        VERIFY_NORMAL_EXIT(&proc);
+        QCOMPARE(proc.readAllStandardOutput(), QByteArray("/qt5/tooldir/moc\n/correct-4.8/tooldir/moc\n"));
+    }
+
+    // -qt and QT_SELECT win over the pin
+    QProcess proc;
+    proc.setProcessEnvironment(env);
+    proc.setWorkingDirectory(buildDir);
+    proc.start(toolPath, QStringList() << "-qt=4.8" << "-run-tool=moc", QIODevice::ReadOnly | QIODevice::Text);
+    QVERIFY(proc.waitForFinished());
+    VERIFY_NORMAL_EXIT(&proc);
+    QCOMPARE(proc.readLine().trimmed(), QByteArray("/correct-4.8/tooldir/moc"));
+
+    env.insert("QT_SELECT", "4.8");
+    proc.setProcessEnvironment(env);
+    proc.start(toolPath, QStringList() << "-print-env", QIODevice::ReadOnly | QIODevice::Text);
+    QVERIFY(proc.waitForFinished());
+    VERIFY_NORMAL_EXIT(&proc);
+    QCOMPARE(proc.readLine().trimmed(), QByteArray("QT_SELECT=\"4.8\""));
+    env.remove("QT_SELECT");
+
+    // a closer pin takes over, even though the result was cached
+    {
+        QFile f(tempdir.path() + "/project/src/.qtchooser");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("4.8\n");
+    }
+    proc.setProcessEnvironment(env);
+    proc.start(toolPath, QStringList() << "-print-env", QIODevice::ReadOnly | QIODevice::Text);
+    QVERIFY(proc.waitForFinished());
+    VERIFY_NORMAL_EXIT(&proc);
+    QCOMPARE(proc.readLine().trimmed(), QByteArray("QT_SELECT=\"4.8\""));
+}
+
+void tst_ToolChooser::library()
+{
+    // the library reads our own environment
+    const QProcessEnvironment &env = testModeEnvironment;
+    qputenv("XDG_CONFIG_HOME", QFile::encodeName(env.value("XDG_CONFIG_HOME")));
+    qputenv("XDG_CONFIG_DIRS", QFile::encodeName(pathsWithDefault));
+    qputenv("XDG_CACHE_HOME", QFile::encodeName(env.value("XDG_CACHE_HOME")));
+    qputenv("QTCHOOSER_NO_GLOBAL_DIR", "1");
+
+    char buffer[256];
+    QCOMPARE(qtchooser_resolve("5", "moc", buffer, sizeof buffer), 0);
+    QCOMPARE(QByteArray(buffer), QByteArray("/qt5/tooldir/moc"));
+    QCOMPARE(qtchooser_libraries_path("5", buffer, sizeof buffer), 0);
+    QCOMPARE(QByteArray(buffer), QByteArray("/qt5/libdir"));
+
+    // QT_SELECT is not consulted
+    qputenv("QT_SELECT", "4.8");
+    QCOMPARE(qtchooser_resolve(0, "moc", buffer, sizeof buffer), 0);
+    QCOMPARE(QByteArray(buffer), QByteArray("/default-qt/tooldir/moc"));
+    qputenv("QT_SELECT", QByteArray());
+
+    // same answer as the wrapper
+    QProcessEnvironment wrapperEnv = env;
+    wrapperEnv.insert("XDG_CONFIG_DIRS", pathsWithDefault);
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-qt=5" << "-run-tool=moc", wrapperEnv));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(qtchooser_resolve("5", "moc", buffer, sizeof buffer), 0);
+    QCOMPARE(proc->readLine().trimmed(), QByteArray(buffer));
+
+    QCOMPARE(qtchooser_resolve("nonexistent", "moc", buffer, sizeof buffer), int(QTCHOOSER_ERROR_NOT_FOUND));
+    QCOMPARE(qtchooser_resolve("5", "moc", buffer, 4), int(QTCHOOSER_ERROR_BUFFER));
+    QCOMPARE(qtchooser_resolve("5", "bin/moc", buffer, sizeof buffer), int(QTCHOOSER_ERROR_INVALID));
+    QVERIFY(qstrlen(qtchooser_strerror(QTCHOOSER_ERROR_NOT_FOUND)));
+}
+
+void tst_ToolChooser::compile()
+{
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("config/qtchooser"));
+    foreach (const QString &name, QDir(testData + "/config1/qtchooser").entryList(QDir::Files))
+        QVERIFY(QFile::copy(testData + "/config1/qtchooser/" + name, tempdir.path() + "/config/qtchooser/" + name));
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/config" LIST_SEP + testData + "/config2");
+    env.insert("QTCHOOSER_NO_CACHE", "1");
+
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-compile" << tempdir.path() + "/config/qtchooser", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QVERIFY(QFile::exists(tempdir.path() + "/config/qtchooser.registry"));
+
+    // the registry gives the same answers as the files, including the shadowing
+    proc.reset(execute(QStringList() << "-list-versions", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(proc->readAll(), QByteArray("4.8\n5\nempty\nlater\noneline\n"));
+    proc.reset(execute(QStringList() << "-print-env", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QVERIFY(proc->readAll().contains("QTTOOLDIR=\"/correct-4.8/tooldir\"\n"));
+    proc.reset(execute(QStringList() << "-qt=5" << "-print-env", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QVERIFY(proc->readAll().contains("QTTOOLDIR=\"/qt5/tooldir\"\n"));
+    proc.reset(execute(QStringList() << "-qt=empty" << "-print-env", env));
+    QVERIFY(proc);
+    QVERIFY(proc->exitCode() != 0);
+
+    // adding a file makes the registry stale
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/added.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("/added/tooldir\n/added/libdir\n");
+    }
+    proc.reset(execute(QStringList() << "-qt=added" << "-print-env", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QVERIFY(proc->readAll().contains("QTTOOLDIR=\"/added/tooldir\"\n"));
+
+    // the library checks the registry again on each lookup, for long-lived
+    // processes: it uses one compiled after the first lookup...
+    qputenv("XDG_CONFIG_HOME", QFile::encodeName(env.value("XDG_CONFIG_HOME")));
+    qputenv("XDG_CONFIG_DIRS", QFile::encodeName(env.value("XDG_CONFIG_DIRS")));
+    qputenv("QTCHOOSER_NO_CACHE", "1");
+    qputenv("QTCHOOSER_NO_GLOBAL_DIR", "1");
+    char buffer[256];
+    QCOMPARE(qtchooser_resolve("added", "moc", buffer, sizeof buffer), 0);
+    QCOMPARE(QByteArray(buffer), QByteArray("/added/tooldir/moc"));
+    proc.reset(execute(QStringList() << "-compile" << tempdir.path() + "/config/qtchooser", env));
+    VERIFY_NORMAL_EXIT(proc);
+    {
+        // editing a file in place doesn't make the registry stale
+        QFile f(tempdir.path() + "/config/qtchooser/added.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        f.write("/edited/tooldir\n/edited/libdir\n");
+    }
+    QCOMPARE(qtchooser_resolve("added", "moc", buffer, sizeof buffer), 0);
+    QCOMPARE(QByteArray(buffer), QByteArray("/added/tooldir/moc"));
+
+    // ...and stops using it once the directory changed
+    QVERIFY(QFile::remove(tempdir.path() + "/config/qtchooser/added.conf"));
+    QCOMPARE(qtchooser_resolve("added", "moc", buffer, sizeof buffer), int(QTCHOOSER_ERROR_NOT_FOUND));
+    qputenv("QTCHOOSER_NO_CACHE", QByteArray());
+}
+
+void tst_ToolChooser::materialize()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("Symlinks are required for this test");
+#endif
+    QTemporaryDir tempdir;
+    QDir dir(tempdir.path());
+    QVERIFY(dir.mkpath("config/qtchooser"));
+    QVERIFY(dir.mkpath("qt/bin"));
+    QVERIFY(QFile::copy(toolPath, tempdir.path() + "/qt/bin/moc"));
+    QVERIFY(QFile::copy(toolPath, tempdir.path() + "/qt/bin/uic"));
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/sdk.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QFile::encodeName(tempdir.path() + "/qt/bin\n" + tempdir.path() + "/qt/lib\n"));
+    }
+
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("XDG_CONFIG_DIRS", tempdir.path() + "/config");
+    const QString farm = tempdir.path() + "/farm";
+
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-materialize" << "sdk" << farm, env));
+    VERIFY_NORMAL_EXIT(proc);
+    QVERIFY(QFileInfo(farm).isSymLink());
+    QCOMPARE(QFileInfo(farm + "/moc").symLinkTarget(), tempdir.path() + "/qt/bin/moc");
+    QCOMPARE(QDir(farm).entryList(QDir::System | QDir::Files), QStringList() << "moc" << "uic");
+    const QString firstTarget = QFileInfo(farm).symLinkTarget();
+
+    // running again without changes must not replace it
+    proc.reset(execute(QStringList() << "-materialize" << "sdk" << farm, env));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(QFileInfo(farm).symLinkTarget(), firstTarget);
+
+    // adding a tool must
+    QVERIFY(QFile::copy(toolPath, tempdir.path() + "/qt/bin/rcc"));
+    proc.reset(execute(QStringList() << "-materialize" << "sdk" << farm, env));
+    VERIFY_NORMAL_EXIT(proc);
+    QVERIFY(QFileInfo(farm).symLinkTarget() != firstTarget);
+    QVERIFY(!QFile::exists(firstTarget));
+    QCOMPARE(QDir(farm).entryList(QDir::System | QDir::Files), QStringList() << "moc" << "rcc" << "uic");
+
+    // a bin directory relative to the home directory
+    QVERIFY(dir.mkpath("home/qt/bin"));
+    QVERIFY(QFile::copy(toolPath, tempdir.path() + "/home/qt/bin/moc"));
+    {
+        QFile f(tempdir.path() + "/config/qtchooser/home.conf");
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("~/qt/bin\n~/qt/lib\n");
+    }
+    env.insert("HOME", tempdir.path() + "/home");
+    const QString homeFarm = tempdir.path() + "/homefarm";
+    proc.reset(execute(QStringList() << "-materialize" << "home" << homeFarm, env));
+    VERIFY_NORMAL_EXIT(proc);
+    QCOMPARE(QFileInfo(homeFarm + "/moc").symLinkTarget(), tempdir.path() + "/home/qt/bin/moc");
+    QCOMPARE(QDir(homeFarm).entryList(QDir::System | QDir::Files), QStringList() << "moc");
+}
+
+void tst_ToolChooser::trace()
+{
+    QTemporaryDir tempdir;
+    const QString traceFile = tempdir.path() + "/trace.json";
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("QTCHOOSER_TRACE", traceFile);
+
+    QScopedPointer<QProcess> proc(execute(QStringList() << "-run-tool=moc", env));
+    VERIFY_NORMAL_EXIT(proc);
+    proc.reset(execute(QStringList() << "-list-versions", env));
+    VERIFY_NORMAL_EXIT(proc);
+
+    // the array is left open, so that more processes can append to it
+    QFile f(traceFile);
+    QVERIFY(f.open(QIODevice::ReadOnly));
+    QByteArray contents = f.readAll();
+    QVERIFY(contents.startsWith("[\n"));
+    QVERIFY(contents.endsWith(",\n"));
+    contents += "{}]";
+
+    QJsonParseError error;
+    QJsonDocument doc = QJsonDocument::fromJson(contents, &error);
+    QVERIFY2(error.error == QJsonParseError::NoError, qPrintable(error.errorString()));
+
+    QSet<QString> names;
+    QSet<qint64> pids;
+    foreach (const QJsonValue &value, doc.array()) {
+        QJsonObject event = value.toObject();
+        if (event.isEmpty())
+            continue;
+        names << event.value("name").toString();
+        pids << qint64(event.value("pid").toDouble());
+        QVERIFY(event.contains("ts"));
+    }
+    QCOMPARE(pids.size(), 2);
+    QVERIFY(names.contains("matchSdk"));
+    QVERIFY(names.contains("iterateSdks"));
+}
+
+void tst_ToolChooser::stats()
+{
+    QTemporaryDir tempdir;
+    const QString statsFile = tempdir.path() + "/stats";
+    QProcessEnvironment env = testModeEnvironment;
+    env.insert("QTCHOOSER_STATS", statsFile);
+
+    QScopedPointer<QProcess> proc;
+    for (int i = 0; i < 3; ++i) {
+        proc.reset(execute(QStringList() << "-run-tool=moc", env));
+        VERIFY_NORMAL_EXIT(proc);
+    }
+    proc.reset(execute(QStringList() << "-qt=5" << "-run-tool=uic", env));
+    VERIFY_NORMAL_EXIT(proc);
+
+    // one fixed-size record of 120 bytes per run
+    QCOMPARE(QFileInfo(statsFile).size(), qint64(4 * 120));
+
+    proc.reset(execute(QStringList() << "-stats" << "-prometheus", env));
+    VERIFY_NORMAL_EXIT(proc);
+    QByteArray output = proc->readAllStandardOutput();
+    QVERIFY2(output.contains("qtchooser_runs_total{tool=\"moc\",sdk=\"4.8\"} 3\n"), output);
+    QVERIFY2(output.contains("qtchooser_runs_total{tool=\"uic\",sdk=\"5\"} 1\n"), output);
+    QVERIFY2(output.contains("qtchooser_resolve_seconds_count{tool=\"moc\"} 3\n"), output);
+
+    // label values are escaped
+    proc.reset(execute(QStringList() << "-qt=a\"b\\c\nd" << "-run-tool=moc", env));
+    QVERIFY(proc);
+    QCOMPARE(proc->exitCode(), 1);
+    proc.reset(execute(QStringList() << "-stats" << "-prometheus", env));
+    VERIFY_NORMAL_EXIT(proc);
+    output = proc->readAllStandardOutput();
+    QVERIFY2(output.contains("qtchooser_runs_total{tool=\"moc\",sdk=\"a\\\"b\\\\c\\nd\"} 1\n"), output);
+}
+
 QTEST_MAIN(tst_ToolChooser)
 
 #include "tst_qtchooser.moc"
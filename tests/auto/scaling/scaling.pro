@@ -0,0 +1,8 @@
+CONFIG += testcase
+CONFIG -= app_bundle
+TARGET = tst_scaling
+
+QT     -= gui
+QT     += testlib
+
+SOURCES += tst_scaling.cpp
@@ -0,0 +1,257 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Intel Corporation.
+** Contact: http://www.qt-project.org/legal
+**
+** This file is part of the Qt tool chooser of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and Digia.  For licensing terms and
+** conditions see http://qt.digia.com/licensing.  For further information
+** use the contact form at http://qt.digia.com/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** In addition, as a special exception, Digia gives you certain additional
+** rights.  These rights are described in the Digia Qt LGPL Exception
+** version 1.1, included in the file LGPL_EXCEPTION.txt in this package.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3.0 as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU General Public License version 3.0 requirements will be
+** met: http://www.gnu.org/copyleft/gpl.html.
+**
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+/*
+ * Checks that the cost of the wrapper grows at most linearly with the number
+ * of config files and of search paths. It generates trees of up to 10000
+ * .conf files spread over up to 100 XDG_CONFIG_DIRS entries and compares the
+ * wall time and, if strace is available, the number of system calls of each
+ * mode against the smallest tree.
+ */
+
+#include <QtTest>
+
+#ifdef Q_OS_WIN
+#  define LIST_SEP ";"
+#  define EXE_SUFFIX ".exe"
+#else
+#  define LIST_SEP ":"
+#  define EXE_SUFFIX ""
+#endif
+
+struct Mode
+{
+    const char *name;
+    const char *arguments[3];
+    // allowed growth over the smallest tree
+    double usPerConfig;
+    double usPerDir;
+    double syscallsPerConfig;
+    double syscallsPerDir;
+};
+
+// -list-versions has to read every directory, but looking up a single SDK
+// should only cost a few calls per search path
+static const Mode modes[] = {
+    { "list-versions", { "-list-versions", 0 }, 20, 1000, 0.1, 8 },
+    { "print-env", { "-qt=target", "-print-env", 0 }, 1, 500, 0.01, 8 },
+    { "run-tool", { "-qt=target", "-run-tool=moc", 0 }, 1, 500, 0.01, 8 }
+};
+static const int modeCount = sizeof modes / sizeof modes[0];
+static const int iterations = 5;
+
+struct Measurement
+{
+    double us;
+    long syscalls;
+};
+
+class tst_Scaling : public QObject
+{
+    Q_OBJECT
+
+public:
+    QString toolPath;
+    QString stracePath;
+    Measurement baseline[modeCount];
+
+    tst_Scaling();
+    QProcessEnvironment createTree(const QString &root, int configCount, int dirCount);
+    bool measure(const QProcessEnvironment &env, const Mode &mode, Measurement *result);
+
+private Q_SLOTS:
+    void initTestCase();
+    void scaling_data();
+    void scaling();
+};
+
+tst_Scaling::tst_Scaling()
+{
+    toolPath = QCoreApplication::applicationDirPath() + "/../../../src/qtchooser/test/qtchooser" EXE_SUFFIX;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+    stracePath = QStandardPaths::findExecutable("strace");
+#endif
+}
+
+// Spreads configCount SDKs over dirCount search paths. The SDK that is looked
+// up, "target", is in the last one, so every path is searched.
+QProcessEnvironment tst_Scaling::createTree(const QString &root, int configCount, int dirCount)
+{
+    QStringList dirs;
+    for (int i = 0; i < dirCount; ++i) {
+        dirs << root + "/config" + QString::number(i);
+        if (!QDir().mkpath(dirs.last() + "/qtchooser"))
+            return QProcessEnvironment();
+    }
+
+    for (int i = 0; i <= configCount; ++i) {
+        QString name = i < configCount ? QString("sdk%1").arg(i, 5, 10, QLatin1Char('0')) : QString("target");
+        QFile f(dirs.at(i < configCount ? i % dirCount : dirCount - 1) + "/qtchooser/" + name + ".conf");
+        if (!f.open(QIODevice::WriteOnly))
+            return QProcessEnvironment();
+        f.write(QFile::encodeName(root + "/" + name + "/bin\n" + root + "/" + name + "/lib\n"));
+    }
+
+    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+    env.insert("XDG_CONFIG_HOME", "/dev/null");
+    env.insert("XDG_CONFIG_DIRS", dirs.join(LIST_SEP));
+    env.insert("XDG_CACHE_HOME", root + "/cache");
+    env.insert("QTCHOOSER_NO_GLOBAL_DIR", "1");
+    env.remove("QT_SELECT");
+    return env;
+}
+
+// Records the fastest of a few runs, after one that warms up the caches, and
+// the system calls of one more run under strace -c.
+bool tst_Scaling::measure(const QProcessEnvironment &env, const Mode &mode, Measurement *result)
+{
+    QStringList arguments;
+    for (int i = 0; mode.arguments[i]; ++i)
+        arguments << mode.arguments[i];
+
+    result->us = -1;
+    result->syscalls = -1;
+    for (int i = 0; i <= iterations; ++i) {
+        QProcess proc;
+        proc.setProcessEnvironment(env);
+        QElapsedTimer timer;
+        timer.start();
+        proc.start(toolPath, arguments, QIODevice::ReadOnly);
+        if (!proc.waitForFinished() || proc.exitCode() != 0) {
+            qWarning() << mode.name << "failed:" << proc.readAllStandardError();
+            return false;
+        }
+#if QT_VERSION >= QT_VERSION_CHECK(4, 8, 0)
+        double us = timer.nsecsElapsed() / 1000.;
+#else
+        double us = timer.elapsed() * 1000.;
+#endif
+        if (i > 0 && (result->us < 0 || us < result->us))
+            result->us = us;
+    }
+
+    if (stracePath.isEmpty())
+        return true;
+
+    QTemporaryFile summary;
+    if (!summary.open())
+        return false;
+    QProcess proc;
+    proc.setProcessEnvironment(env);
+    proc.start(stracePath, QStringList() << "-f" << "-c" << "-o" << summary.fileName() << toolPath << arguments,
+               QIODevice::ReadOnly);
+    if (!proc.waitForFinished() || proc.exitCode() != 0) {
+        qWarning() << "strace failed:" << proc.readAllStandardError();
+        return false;
+    }
+
+    // the last line is "<%time> <seconds> [<usecs/call>] <calls> [<errors>] total"
+    // and every column before "calls" is always present in that line
+    while (!summary.atEnd()) {
+        QList<QByteArray> fields = summary.readLine().simplified().split(' ');
+        if (fields.size() >= 5 && fields.last() == "total")
+            result->syscalls = fields.at(3).toLong();
+    }
+    return result->syscalls > 0;
+}
+
+void tst_Scaling::initTestCase()
+{
+    QVERIFY(QFile::exists(toolPath));
+    if (stracePath.isEmpty())
+        qWarning("strace not found, only checking the wall time");
+
+    QTemporaryDir tempdir;
+    QProcessEnvironment env = createTree(tempdir.path(), 10, 1);
+    QVERIFY(!env.isEmpty());
+    for (int m = 0; m < modeCount; ++m) {
+        QVERIFY2(measure(env, modes[m], &baseline[m]), modes[m].name);
+        qDebug("baseline %s: %.0f us, %ld syscalls", modes[m].name, baseline[m].us, baseline[m].syscalls);
+    }
+}
+
+void tst_Scaling::scaling_data()
+{
+    QTest::addColumn<int>("configCount");
+    QTest::addColumn<int>("dirCount");
+
+    QTest::newRow("10-configs-10-dirs") << 10 << 10;
+    QTest::newRow("1k-configs-1-dir") << 1000 << 1;
+    QTest::newRow("1k-configs-10-dirs") << 1000 << 10;
+    QTest::newRow("1k-configs-100-dirs") << 1000 << 100;
+    QTest::newRow("10k-configs-1-dir") << 10000 << 1;
+    QTest::newRow("10k-configs-100-dirs") << 10000 << 100;
+}
+
+void tst_Scaling::scaling()
+{
+    QFETCH(int, configCount);
+    QFETCH(int, dirCount);
+
+    QTemporaryDir tempdir;
+    QProcessEnvironment env = createTree(tempdir.path(), configCount, dirCount);
+    QVERIFY(!env.isEmpty());
+
+    for (int m = 0; m < modeCount; ++m) {
+        const Mode &mode = modes[m];
+        Measurement result;
+        QVERIFY2(measure(env, mode, &result), mode.name);
+        qDebug("%s: %.0f us, %ld syscalls", mode.name, result.us, result.syscalls);
+
+        // the wall time is noisy, so allow ten times the baseline on top of the growth
+        double maxUs = 10 * baseline[m].us + mode.usPerConfig * configCount + mode.usPerDir * dirCount;
+        QVERIFY2(result.us <= maxUs,
+                 qPrintable(QString("%1 took %2 us, more than %3 us")
+                            .arg(mode.name).arg(result.us, 0, 'f', 0).arg(maxUs, 0, 'f', 0)));
+
+        if (result.syscalls < 0)
+            continue;
+        double maxSyscalls = baseline[m].syscalls + mode.syscallsPerConfig * configCount
+                + mode.syscallsPerDir * dirCount;
+        QVERIFY2(result.syscalls <= maxSyscalls,
+                 qPrintable(QString("%1 made %2 system calls, more than %3")
+                            .arg(mode.name).arg(result.syscalls).arg(maxSyscalls, 0, 'f', 0)));
+    }
+}
+
+QTEST_MAIN(tst_Scaling)
+
+#include "tst_scaling.moc"